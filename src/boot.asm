@@ -28,10 +28,23 @@
 %define DESC_32BIT 0x4000
 %define DESC_64BIT 0x2000 ; only needed for the code segment
 
+; Geometry of the 1.44 MB floppy images
+%define SECTORS_PER_TRACK 18
+
+; The boot information block filled in by makeboot.py lives at this offset in the boot sector
+%define BOOT_INFO 0x1F0
+; makeboot.py also puts a FAT12 BIOS parameter block after the initial jump, the boot code starts after it
+%define BPB_END 0x3E
+; The initrd archive is loaded right after the kernel from the disk, to INITRD_SEGMENT:0 in memory
+%define INITRD_SEGMENT 0x2000
+
 	extern	sector_count
 	extern	kmain
 	extern	bss_start
 	extern	bss_end
+	extern	image_end
+	global	initrd_sectors
+	global	image_crc32c
 
 	section	boot
 
@@ -39,6 +52,10 @@
 
 	; Start at address 0x7C00
 _start:
+	jmp	short bpb_end
+	nop
+	times	BPB_END - ($ - $$) db 0
+bpb_end:
 	; Clear CS, some BIOSes jump to a different address than 0:0x7C00 but the same memory location
 	jmp	0:rm_start
 rm_start:
@@ -50,32 +67,93 @@ rm_start:
 	mov	ds, ax
 	mov	es, ax
 
-.read_sectors:
-	; ES:BX contains the destination buffer, 0:0x7E00
-	mov	bx, _start + 0x200
-	; AH is 0x02, AL contains the sector count
-	mov	ax, 0x0200 + (sector_count - 1)
+	; The image is read one track at a time, the BIOS cannot be relied on to read across tracks
+	; ES:BX contains the destination buffer, starting at 0x07E0:0 (0:0x7E00) and advancing ES after every read
+	mov	ax, 0x07E0
+	mov	es, ax
 	; Access is according to cylinder:head:sector
 	; CH contains the cylinder number, CL the 1 based sector number
 	; First sector is already in memory, so we start from 2
 	mov	cx, 0x0002
 	; DH contains the head number
-	mov	dh, 0x00
 	; DL contains the drive number, the value is received by the boot sector code
+	mov	dh, 0x00
+	; SI counts the sectors left to read
+	mov	si, sector_count - 1
+
+.read_sectors:
+	; Read up to the end of the track
+	mov	al, SECTORS_PER_TRACK + 1
+	sub	al, cl
+	; The DMA controller cannot cross a 64 KiB boundary, stop right before it
+	; ES is sector aligned, so there are 0x80 - ((ES >> 5) & 0x7F) sectors left until the boundary
+	mov	bx, es
+	shl	bx, 1
+	shl	bx, 1
+	shl	bx, 1
+	and	bh, 0x7F
+	mov	bl, 0x80
+	sub	bl, bh
+	cmp	al, bl
+	jbe	.below_boundary
+	mov	al, bl
+.below_boundary:
+	; Do not read past the image
+	mov	ah, 0
+	cmp	ax, si
+	jbe	.count_ready
+	mov	ax, si
+.count_ready:
+	mov	di, ax
+	; AH is 0x02, AL contains the sector count
+	mov	ah, 0x02
+	xor	bx, bx
 	int	0x13
 
 	jnc	.success
 	; There was a failure, reset the disk system and try again
-	mov	al, 0
+	xor	ax, ax
 	int	0x13
 	jmp	.read_sectors
 .success:
-	cmp	al, sector_count - 1
-	je	.complete
+	sub	si, di
+	; Advance ES by 0x20 paragraphs per sector
+	mov	ax, di
+	mov	ah, al
+	mov	al, 0
+	shr	ax, 1
+	shr	ax, 1
+	shr	ax, 1
+	mov	bx, es
+	add	ax, bx
+	mov	es, ax
+	; Move on to the next track, alternating between the two heads
+	mov	ax, di
+	add	cl, al
+	cmp	cl, SECTORS_PER_TRACK + 1
+	jb	.next
+	mov	cl, 1
+	xor	dh, 1
+	jnz	.next
+	inc	ch
+.next:
+	test	si, si
+	jnz	.read_sectors
 
-	; TODO: read the remaining sectors
+	; The initrd follows on the disk, ES only reaches INITRD_SEGMENT once it has been read
+	mov	ax, es
+	cmp	ax, INITRD_SEGMENT
+	jae	.loaded
+	mov	si, [initrd_sectors]
+	mov	ax, INITRD_SEGMENT
+	mov	es, ax
+	test	si, si
+	jnz	.read_sectors
+.loaded:
 
-.complete:
+	; Restore ES = DS = 0 for the rest of the startup code
+	push	ds
+	pop	es
 
 %ifndef	OS86
 	; Enable the A20 line
@@ -118,7 +196,7 @@ rm_start:
 	pop	di
 
 	push	di
-	mov	cx, 3
+	mov	cx, 2
 .setup_directories:
 	lea	eax, [di + 0x1000]
 	or	ax, 3
@@ -126,11 +204,12 @@ rm_start:
 	add	di, 0x1000
 	loop	.setup_directories
 
-	mov	eax, 3
-	mov	ecx, 0x200
+	; The first 16 MiB in 2 MiB pages, the kernel allocates its own page tables from there
+	mov	eax, 0x83
+	mov	cx, 8
 .setup_id_paging:
 	mov	[di], eax
-	add	eax, 0x1000
+	add	eax, 0x200000
 	add	di, 8
 	loop	.setup_id_paging
 
@@ -198,12 +277,13 @@ pm_start:
 	mov	fs, ax
 	mov	gs, ax
 
-	; Clear bss
+	; Clear bss, the linker script aligns both ends to 8 bytes
 	mov	edi, bss_start
 	mov	ecx, bss_end
 	sub	ecx, edi
-	mov	al, 0
-	rep	stosb
+	shr	ecx, 2
+	xor	eax, eax
+	rep	stosd
 %elifdef OS64
 	bits	64
 pm_start:
@@ -217,12 +297,13 @@ pm_start:
 	mov	fs, ax
 	mov	gs, ax
 
-	; Clear bss
+	; Clear bss, the linker script aligns both ends to 8 bytes
 	mov	rdi, bss_start
 	mov	rcx, bss_end
 	sub	rcx, rdi
-	mov	al, 0
-	rep	stosb
+	shr	rcx, 3
+	xor	eax, eax
+	rep	stosq
 %endif
 
 	jmp	kmain
@@ -271,8 +352,335 @@ gdt:
 gdt_end:
 %endif
 
+	; Boot information, filled in by makeboot.py, the boot code above has to end before it
+	times	BOOT_INFO - ($ - $$) db 0
+	; Length of the initrd in sectors, 0 if there is none
+initrd_sectors:
+	dw	0
+	; CRC-32C of the kernel after the boot sector, 0 if makeboot.py did not compute one
+image_crc32c:
+	dd	0
+	times	0x1FE - ($ - $$) db 0
+	dw	0xAA55
+
+%ifndef OS86
+%ifndef OS286
+; The 386 and x86-64 kernels can also be started by a Multiboot loader such as qemu -kernel, which skips the BIOS disk
+; reads and the mode switches of the boot sector. The header gives the addresses to load the flat image (kernel.bin)
+; to, so the loader does not have to understand the ELF file of the x86-64 kernel. The first module is taken as the
+; initrd and moved to where the boot sector would have loaded it.
+%define MULTIBOOT_MAGIC             0x1BADB002
+%define MULTIBOOT_LOADER_MAGIC      0x2BADB002
+%define MULTIBOOT_MEMORY_INFO       0x00000002
+%define MULTIBOOT_ADDRESSES         0x00010000
+%define MULTIBOOT_FLAGS             (MULTIBOOT_MEMORY_INFO | MULTIBOOT_ADDRESSES)
+; Fields of the information structure the loader passes in EBX
+%define MULTIBOOT_INFO_FLAGS        0
+%define MULTIBOOT_INFO_MEMORY_UPPER 8
+%define MULTIBOOT_INFO_COMMAND_LINE 16
+%define MULTIBOOT_INFO_MODULE_COUNT 20
+%define MULTIBOOT_INFO_MODULES      24
+%define MULTIBOOT_HAS_MEMORY        0x001
+%define MULTIBOOT_HAS_COMMAND_LINE  0x004
+%define MULTIBOOT_HAS_MODULES       0x008
+%define MULTIBOOT_COMMAND_LINE_SIZE 64
+; The initrd has to end below the extended BIOS data area
+%define INITRD_LIMIT (0x9F000 - (INITRD_SEGMENT << 4))
+; Offsets in the kexec_t structure of kernel.c
+%define KEXEC_SOURCE      0
+%define KEXEC_DESTINATION 4
+%define KEXEC_SIZE        8
+%define KEXEC_CLEAR       12
+%define KEXEC_ENTRY       16
+%define KEXEC_INFO        20
+
+	; Has to be within the first 8 KiB of the image, the linker script puts it right after the boot sector
+	section	multiboot
+
+	bits	32
+
+	align	4, db 0
+multiboot_header:
+	dd	MULTIBOOT_MAGIC
+	dd	MULTIBOOT_FLAGS
+	dd	-(MULTIBOOT_MAGIC + MULTIBOOT_FLAGS)
+	dd	multiboot_header
+	dd	_start
+	dd	image_end
+	dd	stack_top
+	dd	multiboot_start
+
+multiboot_start:
+	; The loader leaves us in 32-bit protected mode with flat segments, paging off, A20 on and interrupts disabled
+	cmp	eax, MULTIBOOT_LOADER_MAGIC
+	jne	.halt
+	test	dword [ebx + MULTIBOOT_INFO_FLAGS], MULTIBOOT_HAS_MEMORY
+	jz	.memory_done
+	; mem_upper counts the KiB from 1 MiB up to the first hole
+	mov	eax, [ebx + MULTIBOOT_INFO_MEMORY_UPPER]
+	add	eax, 1024
+	mov	[multiboot_memory], eax
+.memory_done:
+	test	dword [ebx + MULTIBOOT_INFO_FLAGS], MULTIBOOT_HAS_COMMAND_LINE
+	jz	.command_line_done
+	mov	esi, [ebx + MULTIBOOT_INFO_COMMAND_LINE]
+	mov	edi, multiboot_command_line
+	mov	ecx, MULTIBOOT_COMMAND_LINE_SIZE - 1
+	cld
+.command_line:
+	lodsb
+	test	al, al
+	jz	.command_line_done
+	stosb
+	loop	.command_line
+.command_line_done:
+
+	; Everything needed from the information structure has to be read before the copy, which may overwrite it
+	test	dword [ebx + MULTIBOOT_INFO_FLAGS], MULTIBOOT_HAS_MODULES
+	jz	.initrd_done
+	cmp	dword [ebx + MULTIBOOT_INFO_MODULE_COUNT], 0
+	je	.initrd_done
+	mov	esi, [ebx + MULTIBOOT_INFO_MODULES]
+	mov	ecx, [esi + 4]
+	mov	esi, [esi]
+	sub	ecx, esi
+	cmp	ecx, INITRD_LIMIT
+	ja	.initrd_done
+	lea	eax, [ecx + 511]
+	shr	eax, 9
+	mov	[initrd_sectors], ax
+	mov	edi, INITRD_SEGMENT << 4
+	; The module may overlap its destination on either side, a copy from higher addresses goes backwards
+	cld
+	cmp	edi, esi
+	; Already in place when the loader is kexec
+	je	.initrd_done
+	jb	.copy
+	lea	esi, [esi + ecx - 1]
+	lea	edi, [edi + ecx - 1]
+	std
+.copy:
+	rep	movsb
+	cld
+.initrd_done:
+
+%ifdef OS386
+	lgdt	[gdtr]
+	jmp	0x08:pm_start
+%else
+	; The same identity map of the first 16 MiB as the boot sector builds, from 0x1000
+	mov	edi, 0x1000
+	mov	ecx, 0x1000
+	xor	eax, eax
+	rep	stosd
+	mov	dword [0x1000], 0x2003
+	mov	dword [0x2000], 0x3003
+	mov	eax, 0x83
+	mov	edi, 0x3000
+	mov	ecx, 8
+.setup_id_paging:
+	mov	[edi], eax
+	add	eax, 0x200000
+	add	edi, 8
+	loop	.setup_id_paging
+
+	; Enable paging extensions and PAE, then long mode and paging, the loader's code segment runs in compatibility mode
+	mov	eax, 0x000000a0
+	mov	cr4, eax
+	mov	eax, 0x1000
+	mov	cr3, eax
+	mov	ecx, 0xC0000080
+	rdmsr
+	or	ax, 0x0100
+	wrmsr
+	mov	eax, cr0
+	or	eax, 0x80000001
+	mov	cr0, eax
+	lgdt	[gdtr]
+	jmp	0x08:pm_start
+%endif
+
+.halt:
+	hlt
+	jmp	.halt
+
+	section	.text
+
+; Called by kexec in kernel.c with a kexec_t, after it has been copied below the kernel: loads a new kernel image over
+; this one and starts it like a Multiboot loader. It only addresses itself relative to the instruction pointer, and
+; touches nothing of the old kernel once the copy starts.
+	global	kexec_trampoline
+	global	kexec_trampoline_end
+%ifdef OS386
+	bits	32
+kexec_trampoline:
+	mov	eax, [esp + 4]
+	mov	esi, [eax + KEXEC_SOURCE]
+	mov	edi, [eax + KEXEC_DESTINATION]
+	mov	ecx, [eax + KEXEC_SIZE]
+	mov	edx, [eax + KEXEC_CLEAR]
+	mov	ebp, [eax + KEXEC_ENTRY]
+	mov	ebx, [eax + KEXEC_INFO]
+	; The first 16 MiB are identity mapped, execution goes on at the same address with paging off
+	mov	eax, cr0
+	and	eax, 0x7FFFFFFF
+	mov	cr0, eax
+%else
+	bits	64
+kexec_trampoline:
+	; Paging cannot be turned off with PCIDs enabled
+	mov	rax, cr4
+	and	rax, ~0x20000
+	mov	cr4, rax
+	; A GDT with 32-bit segments, at the address the trampoline was copied to
+	lea	rax, [rel .gdt]
+	mov	[rel .gdtr + 2], rax
+	lgdt	[rel .gdtr]
+	lea	rax, [rel .compatibility]
+	mov	[rel .far], eax
+	mov	esi, [rdi + KEXEC_SOURCE]
+	mov	ecx, [rdi + KEXEC_SIZE]
+	mov	edx, [rdi + KEXEC_CLEAR]
+	mov	ebp, [rdi + KEXEC_ENTRY]
+	mov	ebx, [rdi + KEXEC_INFO]
+	mov	edi, [rdi + KEXEC_DESTINATION]
+	jmp	far dword [rel .far]
+
+	bits	32
+.compatibility:
+	mov	ax, 0x10
+	mov	ds, ax
+	mov	es, ax
+	mov	ss, ax
+	; Turning paging off in compatibility mode leaves long mode, then it is disabled
+	mov	eax, cr0
+	and	eax, 0x7FFFFFFF
+	mov	cr0, eax
+	push	ecx
+	push	edx
+	mov	ecx, 0xC0000080
+	rdmsr
+	and	eax, ~0x0100
+	wrmsr
+	pop	edx
+	pop	ecx
+%endif
+	cld
+	rep	movsb
+	mov	ecx, edx
+	xor	eax, eax
+	rep	stosb
+	mov	eax, MULTIBOOT_LOADER_MAGIC
+	jmp	ebp
+%ifdef OS64
+	align	8, db 0
+.gdt:
+	dw	0, 0, 0, 0
+	descriptor	0, 0xFFFFFFFF, DESC_CODE | DESC_32BIT
+	descriptor	0, 0xFFFFFFFF, DESC_DATA | DESC_32BIT
+.gdtr:
+	dw	.gdtr - .gdt - 1
+	dq	0
+.far:
+	dd	0
+	dw	0x08
+%endif
+kexec_trampoline_end:
+%endif
+%endif
+
+%ifdef OS86
+	section	.text
+	bits	16
+
+; Called by kernel.c on a 386 or later: loads DS, ES, FS and GS with a flat 4 GiB data segment in protected mode and
+; goes back to real mode with their old values. Loading a segment register in real mode only changes its base, the
+; limit stays until the next mode switch (unreal mode).
+	global	unreal_enter
+unreal_enter:
+	pushf
+	cli
+	push	ds
+	push	es
+	push	fs
+	push	gs
+	lgdt	[unreal_gdtr]
+	mov	eax, cr0
+	or	al, 1
+	mov	cr0, eax
+	; CS keeps its real mode contents, nothing here needs a protected mode code segment
+	jmp	short .protected
+.protected:
+	mov	ax, 0x08
+	mov	ds, ax
+	mov	es, ax
+	mov	fs, ax
+	mov	gs, ax
+	mov	eax, cr0
+	and	al, 0xFE
+	mov	cr0, eax
+	jmp	short .real
+.real:
+	pop	gs
+	pop	fs
+	pop	es
+	pop	ds
+	popf
+	ret
+
+; Called by unreal_copy in kernel.c in unreal mode, copies forwards between linear addresses:
+;	void unreal_movs(uint32_t destination, uint32_t source, uint32_t size)
+	global	unreal_movs
+unreal_movs:
+	push	bp
+	mov	bp, sp
+	push	si
+	push	di
+	push	ds
+	push	es
+	xor	ax, ax
+	mov	ds, ax
+	mov	es, ax
+	mov	edi, [bp + 4]
+	mov	esi, [bp + 8]
+	mov	ecx, [bp + 12]
+	mov	edx, ecx
+	shr	ecx, 2
+	cld
+	a32 rep movsd
+	mov	ecx, edx
+	and	ecx, 3
+	a32 rep movsb
+	pop	es
+	pop	ds
+	pop	di
+	pop	si
+	pop	bp
+	ret
+
+	align	8, db 0
+unreal_gdt:
+	dw	0, 0, 0, 0
+	descriptor	0, 0xFFFFFFFF, DESC_DATA | DESC_16BIT
+unreal_gdtr:
+	dw	unreal_gdtr - unreal_gdt - 1
+	dd	unreal_gdt
+%endif
+
 	section	.data
 	; A data section is required for the linker script
+%ifndef OS86
+%ifndef OS286
+	global	multiboot_memory
+	align	4, db 0
+	; KiB of memory from address 0 reported by a Multiboot loader, 0 when started from the boot sector
+multiboot_memory:
+	dd	0
+	global	multiboot_command_line
+multiboot_command_line:
+	times	MULTIBOOT_COMMAND_LINE_SIZE db 0
+%endif
+%endif
 
 	section	stack nobits alloc noexec write align=4
 	resb	0x200
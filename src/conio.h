@@ -1,8 +1,68 @@
 #ifndef _CONIO_H
 #define _CONIO_H
 
+#include "stddef.h"
 #include "stdint.h"
 
+#if HOST
+/* The host build routes port accesses to the mock hardware in host.c, size is the access width in bytes */
+void host_outp(unsigned port, uint32_t value, unsigned size);
+uint32_t host_inp(unsigned port, unsigned size);
+
+static inline void outp(unsigned port, unsigned value)
+{
+	host_outp(port, (uint8_t)value, 1);
+}
+
+static inline void outpw(unsigned port, unsigned value)
+{
+	host_outp(port, (uint16_t)value, 2);
+}
+
+static inline void outpl(unsigned port, unsigned value)
+{
+	host_outp(port, value, 4);
+}
+
+static inline unsigned inp(unsigned port)
+{
+	return (uint8_t)host_inp(port, 1);
+}
+
+static inline unsigned inpw(unsigned port)
+{
+	return (uint16_t)host_inp(port, 2);
+}
+
+static inline unsigned inpl(unsigned port)
+{
+	return host_inp(port, 4);
+}
+
+static inline void inpsw(unsigned port, void * buffer, size_t count)
+{
+	for(uint16_t * p = buffer; count > 0; count--)
+		*p++ = host_inp(port, 2);
+}
+
+static inline void outpsw(unsigned port, const void * buffer, size_t count)
+{
+	for(const uint16_t * p = buffer; count > 0; count--)
+		host_outp(port, *p++, 2);
+}
+
+static inline void inpsl(unsigned port, void * buffer, size_t count)
+{
+	for(uint32_t * p = buffer; count > 0; count--)
+		*p++ = host_inp(port, 4);
+}
+
+static inline void outpsl(unsigned port, const void * buffer, size_t count)
+{
+	for(const uint32_t * p = buffer; count > 0; count--)
+		host_outp(port, *p++, 4);
+}
+#else
 static inline void outp(unsigned port, unsigned value)
 {
 	__asm__ volatile("outb %b0, %w1"
@@ -13,7 +73,7 @@ static inline void outp(unsigned port, unsigned value)
 
 static inline void outpw(unsigned port, unsigned value)
 {
-	__asm__ volatile("outw %b0, %w1"
+	__asm__ volatile("outw %w0, %w1"
 		:
 		: "a"((uint16_t)value), "Nd"((uint16_t)port)
 		: "memory");
@@ -22,7 +82,7 @@ static inline void outpw(unsigned port, unsigned value)
 #ifndef __ia16__
 static inline void outpl(unsigned port, unsigned value)
 {
-	__asm__ volatile("outl %b0, %w1"
+	__asm__ volatile("outl %k0, %w1"
 		:
 		: "a"((uint32_t)value), "Nd"((uint16_t)port)
 		: "memory");
@@ -42,7 +102,7 @@ static inline unsigned inp(unsigned port)
 static inline unsigned inpw(unsigned port)
 {
 	uint16_t ret;
-	__asm__("inw %w1, %b0"
+	__asm__("inw %w1, %w0"
 		: "=a"(ret)
 		: "Nd"((uint16_t)port)
 		: "memory");
@@ -53,7 +113,7 @@ static inline unsigned inpw(unsigned port)
 static inline unsigned inpl(unsigned port)
 {
 	uint32_t ret;
-	__asm__("inl %w1, %b0"
+	__asm__("inl %w1, %k0"
 		: "=a"(ret)
 		: "Nd"((uint16_t)port)
 		: "memory");
@@ -61,4 +121,53 @@ static inline unsigned inpl(unsigned port)
 }
 #endif
 
+/* Transfers count words or doublewords between a port and memory with a single string instruction */
+static inline void inpsw(unsigned port, void * buffer, size_t count)
+{
+#ifdef __ia16__
+	// INS writes through ES, which may hold a far pointer segment of the caller, the buffer is in DS
+	__asm__ volatile("pushw\t%%es\n\t"
+		"pushw\t%%ds\n\t"
+		"popw\t%%es\n\t"
+		"rep insw\n\t"
+		"popw\t%%es"
+		: "+D"(buffer), "+c"(count)
+		: "d"((uint16_t)port)
+		: "memory");
+#else
+	__asm__ volatile("rep insw"
+		: "+D"(buffer), "+c"(count)
+		: "d"((uint16_t)port)
+		: "memory");
+#endif
+}
+
+/* OUTS reads through DS like ordinary accesses, so ES does not matter here */
+static inline void outpsw(unsigned port, const void * buffer, size_t count)
+{
+	__asm__ volatile("rep outsw"
+		: "+S"(buffer), "+c"(count)
+		: "d"((uint16_t)port)
+		: "memory");
+}
+
+#ifndef __ia16__
+static inline void inpsl(unsigned port, void * buffer, size_t count)
+{
+	__asm__ volatile("rep insl"
+		: "+D"(buffer), "+c"(count)
+		: "d"((uint16_t)port)
+		: "memory");
+}
+
+static inline void outpsl(unsigned port, const void * buffer, size_t count)
+{
+	__asm__ volatile("rep outsl"
+		: "+S"(buffer), "+c"(count)
+		: "d"((uint16_t)port)
+		: "memory");
+}
+#endif
+#endif
+
 #endif // _CONIO_H
@@ -0,0 +1,121 @@
+/*
+ * Driver for the host build of the kernel (make host).
+ *
+ * kernel.c is compiled natively with -DHOST=1, which routes port accesses here, keeps the interrupt flag in a variable
+ * and points the text buffer at ordinary memory. The kernel then starts as usual and runs its benchmark cases, the
+ * serial port output goes to stdout and the debug exit port ends the process. An initrd archive built with
+ * makeboot.py --archive can be given as the first argument, it takes the place of the one the boot sector would load.
+ * A floppy image with a file system can follow, the kernel reads it as its boot floppy.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PORT_COM1_DATA          0x3F8
+#define PORT_COM1_LINE_CONTROL  (PORT_COM1_DATA + 3)
+#define PORT_COM1_MODEM_CONTROL (PORT_COM1_DATA + 4)
+#define PORT_COM1_LINE_STATUS   (PORT_COM1_DATA + 5)
+#define PORT_DEBUG_EXIT         0xF4
+
+#define UART_LINE_CONTROL_DLAB  0x80
+#define UART_LINE_STATUS_THRE   0x20
+#define UART_LINE_STATUS_TEMT   0x40
+#define UART_MODEM_CONTROL_LOOPBACK 0x10
+
+void kmain(void);
+
+// read by the kernel in place of the boot sector field and the memory at 0x20000
+uint16_t initrd_sectors;
+const uint8_t * host_initrd;
+// the floppy disk, in 512 byte blocks
+const uint8_t * host_floppy;
+uint32_t host_floppy_blocks;
+
+static uint8_t com1_line_control, com1_modem_control;
+
+void host_outp(unsigned port, uint32_t value, unsigned size)
+{
+	(void) size;
+
+	switch(port)
+	{
+	case PORT_COM1_DATA:
+		// the divisor latch shares the port with the data register, in loopback nothing leaves the UART
+		if((com1_line_control & UART_LINE_CONTROL_DLAB) == 0 && (com1_modem_control & UART_MODEM_CONTROL_LOOPBACK) == 0
+			&& value != '\r')
+		{
+			putchar(value);
+		}
+		break;
+	case PORT_COM1_LINE_CONTROL:
+		com1_line_control = value;
+		break;
+	case PORT_COM1_MODEM_CONTROL:
+		com1_modem_control = value;
+		break;
+	case PORT_DEBUG_EXIT:
+		fflush(stdout);
+		exit(value);
+	}
+}
+
+uint32_t host_inp(unsigned port, unsigned size)
+{
+	switch(port)
+	{
+	case PORT_COM1_LINE_STATUS:
+		// always ready to transmit
+		return UART_LINE_STATUS_THRE | UART_LINE_STATUS_TEMT;
+	case PORT_COM1_LINE_CONTROL:
+		return com1_line_control;
+	default:
+		// nothing responds, like an empty ISA bus
+		return size == 4 ? 0xFFFFFFFF : size == 2 ? 0xFFFF : 0xFF;
+	}
+}
+
+static void load_initrd(const char * path)
+{
+	FILE * file = fopen(path, "rb");
+	if(file == NULL)
+	{
+		perror(path);
+		exit(1);
+	}
+	static uint8_t buffer[0x7F000] __attribute__((aligned(16)));
+	size_t size = fread(buffer, 1, sizeof buffer, file);
+	fclose(file);
+	host_initrd = buffer;
+	// rounded up to whole sectors like on the disk image, the rest of the buffer stays zero
+	initrd_sectors = (size + 511) / 512;
+}
+
+static void load_floppy(const char * path)
+{
+	FILE * file = fopen(path, "rb");
+	if(file == NULL)
+	{
+		perror(path);
+		exit(1);
+	}
+	static uint8_t buffer[2880 * 512];
+	size_t size = fread(buffer, 1, sizeof buffer, file);
+	fclose(file);
+	host_floppy = buffer;
+	host_floppy_blocks = size / 512;
+}
+
+int main(int argc, char * argv[])
+{
+	if(argc > 1)
+	{
+		load_initrd(argv[1]);
+	}
+	if(argc > 2)
+	{
+		load_floppy(argv[2]);
+	}
+	kmain();
+	return 0;
+}
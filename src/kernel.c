@@ -6,22 +6,148 @@
 #include "string.h"
 #include "i86.h"
 #include "conio.h"
+#include "kprintf.h"
+#include "ring.h"
+#if FBCON
+# include "font8x8.h"
+#endif
+
+enum
+{
+	FLAGS_IF = 0x0200,
+};
+
+#if IRQTRACE
+// the interrupt latency tracer, told about every change of the interrupt flag
+static void irqtrace_disable(void) __attribute__((noinline));
+static void irqtrace_enable(void) __attribute__((noinline));
+#else
+# define irqtrace_disable() ((void) 0)
+# define irqtrace_enable() ((void) 0)
+#endif
+
+#if HOST
+// the host build keeps the interrupt flag in a variable, no interrupts are ever delivered
+static bool host_interrupt_flag;
+
+static inline void enable_interrupts(void)
+{
+	irqtrace_enable();
+	host_interrupt_flag = true;
+}
+
+static inline void disable_interrupts(void)
+{
+	host_interrupt_flag = false;
+	irqtrace_disable();
+}
+
+static inline size_t save_and_disable_interrupts(void)
+{
+	size_t flags = host_interrupt_flag ? FLAGS_IF : 0;
+	host_interrupt_flag = false;
+	irqtrace_disable();
+	return flags;
+}
 
+static inline void restore_interrupts(size_t flags)
+{
+	if((flags & FLAGS_IF) != 0)
+	{
+		irqtrace_enable();
+	}
+	host_interrupt_flag = (flags & FLAGS_IF) != 0;
+}
+#else
 static inline void enable_interrupts(void)
 {
+	irqtrace_enable();
 	asm volatile("sti");
 }
 
 static inline void disable_interrupts(void)
 {
 	asm volatile("cli");
+	irqtrace_disable();
+}
+
+// disables interrupts and returns the previous flags for restore_interrupts
+static inline size_t save_and_disable_interrupts(void)
+{
+	size_t flags;
+	asm volatile("pushf\n\tpop\t%0\n\tcli" : "=r"(flags) : : "memory");
+	irqtrace_disable();
+	return flags;
+}
+
+static inline void restore_interrupts(size_t flags)
+{
+	if((flags & FLAGS_IF) != 0)
+	{
+		irqtrace_enable();
+	}
+	asm volatile("push\t%0\n\tpopf" : : "r"(flags) : "memory", "cc");
 }
+#endif
 
 static inline void io_wait(void)
 {
 	outp(0x80, 0); // unused port
 }
 
+#if OS386 || OS64
+typedef struct cpuid_t
+{
+	uint32_t eax, ebx, ecx, edx;
+} cpuid_t;
+
+enum
+{
+	CPUID_1_EDX_PSE = 1 << 3,
+	CPUID_1_EDX_TSC = 1 << 4,
+	CPUID_1_EDX_PGE = 1 << 13,
+	CPUID_1_ECX_PCID = 1 << 17,
+	CPUID_1_ECX_SSE42 = 1 << 20,
+	CPUID_1_ECX_XSAVE = 1 << 26,
+	CPUID_1_ECX_OSXSAVE = 1 << 27,
+	CPUID_1_ECX_AVX = 1 << 28,
+	CPUID_7_EBX_AVX2 = 1 << 5,
+	CPUID_7_EBX_ERMS = 1 << 9,
+};
+
+// CPUID is present if the ID flag in EFLAGS can be toggled, every 64-bit CPU has it
+static inline bool cpu_has_cpuid(void)
+{
+#if OS386
+	uint32_t before, after;
+	asm volatile(
+		"pushfl\n\t"
+		"popl\t%0\n\t"
+		"movl\t%0, %1\n\t"
+		"xorl\t$0x00200000, %1\n\t"
+		"pushl\t%1\n\t"
+		"popfl\n\t"
+		"pushfl\n\t"
+		"popl\t%1\n\t"
+		"pushl\t%0\n\t"
+		"popfl"
+		: "=&r"(before), "=&r"(after) : : "cc");
+	return ((before ^ after) & 0x00200000) != 0;
+#else
+	return true;
+#endif
+}
+
+static inline cpuid_t cpuid(uint32_t leaf, uint32_t subleaf)
+{
+	cpuid_t result;
+	asm volatile("cpuid"
+		: "=a"(result.eax), "=b"(result.ebx), "=c"(result.ecx), "=d"(result.edx)
+		: "a"(leaf), "c"(subleaf));
+	return result;
+}
+#endif
+
 #if !OS86
 typedef struct segment_descriptor_t
 {
@@ -154,7 +280,12 @@ enum
 	SEL_KERNEL_ES = 0x18,
 	SEL_USER_CS = 0x20,
 	SEL_USER_SS = 0x28,
-	SEL_MAX = 0x30,
+	// one 64 KiB window per selector over the initrd
+	SEL_INITRD = 0x30,
+	// the descriptor of the LDT, the rest of the GDT is handed out by segment_alloc
+	SEL_LDT = 0x70,
+	SEL_DYNAMIC = 0x78,
+	SEL_MAX = 0x200,
 #else
 	SEL_USER_CS = 0x18,
 	SEL_USER_SS = 0x20,
@@ -177,7 +308,10 @@ static inline void load_gdt(descriptor_t * table, uint16_t size)
 
 	/* after calling LGDT, a long return is used to load CS:[E/R]IP, and then the remaining registers are filled with SEL_KERNEL_SS */
 
-#if OS286
+#if HOST
+	// the host build only fills in the tables
+	(void) gdtr;
+#elif OS286
 	/* The 80286 only has the SS, DS and ES registers */
 	asm volatile(
 		"pushw\t%1\n\t"
@@ -234,7 +368,9 @@ static inline void load_idt(descriptor64_t * table, uint16_t size)
 	idtr.limit = size - 1;
 	idtr.base = (size_t)table;
 
-#if OS286
+#if HOST
+	(void) idtr;
+#elif OS286
 	asm volatile("lidt\t(%0)" : : "B"(&idtr) : "memory");
 #else
 	asm volatile("lidt\t(%0)" : : "r"(&idtr) : "memory");
@@ -242,7 +378,198 @@ static inline void load_idt(descriptor64_t * table, uint16_t size)
 }
 #endif
 
-#if OS86
+#if OS286
+/*
+ * Segment allocator
+ *
+ * The 286 reaches memory only through descriptors, the fixed ones above cover the kernel, the screen and the initrd.
+ * Data segments anywhere else in the 16 MiB address space come from the rest of the GDT and from an LDT. Their free
+ * descriptors are kept on two lists threaded through the descriptors themselves: a free one is not present and holds
+ * the selector of the next one in its first word. segment_alloc takes from the GDT first, then from the LDT.
+ *
+ * segment_window gives a far pointer to a linear address through a small cache of 64 KiB windows with a selector each.
+ * A window already covering the range is reused as it is, so the descriptors of hot windows are not rewritten, and a
+ * miss moves the least recently used one. A pointer from it stays valid until SEGMENT_WINDOWS other windows have been
+ * moved. segment_copy moves blocks between linear addresses a window at a time, near pointers are linear addresses as
+ * well since the kernel data segment starts at 0.
+ */
+
+#define SEGMENT_ADDRESS_END 0x1000000UL
+
+enum
+{
+	SEGMENT_LDT_ENTRIES = 64,
+	SEGMENT_WINDOWS = 8,
+	// window bases are rounded down to this, so that neighbouring accesses share a window
+	SEGMENT_WINDOW_ALIGN = 0x1000,
+	SEGMENT_COPY_STEP = 0x8000,
+
+	SEGMENT_SELECTOR_LDT = 0x04,
+	SEGMENT_ACCESS_LDT = 0x82,
+};
+
+typedef struct segment_window_t
+{
+	uint32_t base;
+	uint16_t selector;
+	uint16_t last_use;
+} segment_window_t;
+
+typedef struct segment_stats_t
+{
+	uint16_t allocated;
+	uint32_t window_hits;
+	uint32_t window_misses;
+} segment_stats_t;
+
+descriptor_t ldt[SEGMENT_LDT_ENTRIES];
+// the first free selector of each table, 0 if there is none
+static uint16_t segment_free_gdt;
+static uint16_t segment_free_ldt;
+static segment_window_t segment_windows[SEGMENT_WINDOWS];
+static uint16_t segment_use_counter;
+// the selector of a window that must not be moved, 0 for none
+static uint16_t segment_pinned;
+static segment_stats_t segment_stats;
+
+static inline descriptor_t * segment_descriptor(uint16_t selector)
+{
+	return &((selector & SEGMENT_SELECTOR_LDT) != 0 ? ldt : gdt)[selector >> 3];
+}
+
+static inline void segment_push_free(uint16_t selector)
+{
+	uint16_t * list = (selector & SEGMENT_SELECTOR_LDT) != 0 ? &segment_free_ldt : &segment_free_gdt;
+	descriptor_t * descriptor = segment_descriptor(selector);
+	descriptor->w[0] = *list;
+	descriptor->w[1] = 0;
+	descriptor->w[2] = 0;
+	descriptor->w[3] = 0;
+	*list = selector;
+}
+
+/* A data segment of limit + 1 bytes at a linear address, returns its selector or 0 if the range is out of reach or no descriptors are left */
+static inline uint16_t segment_alloc(uint32_t base, uint16_t limit)
+{
+	if(base >= SEGMENT_ADDRESS_END || SEGMENT_ADDRESS_END - base <= limit)
+	{
+		return 0;
+	}
+	uint16_t * list = segment_free_gdt != 0 ? &segment_free_gdt : &segment_free_ldt;
+	uint16_t selector = *list;
+	if(selector == 0)
+	{
+		return 0;
+	}
+	descriptor_t * descriptor = segment_descriptor(selector);
+	*list = descriptor->w[0];
+	descriptor_set_segment(descriptor, base, limit, DESCRIPTOR_ACCESS_DATA | DESCRIPTOR_ACCESS_CPL0, DESCRIPTOR_FLAGS_16BIT);
+	segment_stats.allocated++;
+	return selector;
+}
+
+/* Gives a selector back, it must not be loaded in a segment register any more */
+static inline void segment_free(uint16_t selector)
+{
+	segment_push_free(selector);
+	segment_stats.allocated--;
+}
+
+/* Loads the LDT and puts every descriptor after the fixed ones on the free lists, the GDT has to be loaded */
+static inline void segment_init(void)
+{
+	descriptor_set_segment(&gdt[SEL_LDT / 8], (size_t)ldt, sizeof ldt - 1, SEGMENT_ACCESS_LDT, 0);
+	asm volatile("lldt\t%0" : : "r"((uint16_t)SEL_LDT) : "memory");
+
+	// backwards, so that the lowest selectors are handed out first
+	for(uint16_t selector = SEL_MAX - 8; selector >= SEL_DYNAMIC; selector -= 8)
+	{
+		segment_push_free(selector);
+	}
+	// unlike in the GDT, the first entry of the LDT is usable, its selector is not 0 either
+	for(int i = SEGMENT_LDT_ENTRIES - 1; i >= 0; i--)
+	{
+		segment_push_free(i * 8 | SEGMENT_SELECTOR_LDT);
+	}
+
+	for(int i = 0; i < SEGMENT_WINDOWS; i++)
+	{
+		// a base no range can fall into until the window is first moved
+		segment_windows[i].base = SEGMENT_ADDRESS_END;
+		segment_windows[i].selector = segment_alloc(0, 0);
+	}
+}
+
+/* A far pointer to size bytes at a linear address, NULL if they are not all below 16 MiB */
+static inline void far * segment_window(uint32_t address, uint16_t size)
+{
+	if(size == 0 || address >= SEGMENT_ADDRESS_END || SEGMENT_ADDRESS_END - address < size)
+	{
+		return NULL;
+	}
+
+	segment_window_t * victim = NULL;
+	for(int i = 0; i < SEGMENT_WINDOWS; i++)
+	{
+		segment_window_t * window = &segment_windows[i];
+		if(address >= window->base && address - window->base <= 0x10000UL - size)
+		{
+			window->last_use = ++segment_use_counter;
+			segment_stats.window_hits++;
+			return MK_FP(window->selector, address - window->base);
+		}
+		// ages rather than use counts, which stay in order when the counter wraps
+		if(window->selector != segment_pinned && (victim == NULL
+		|| (uint16_t)(segment_use_counter - window->last_use) > (uint16_t)(segment_use_counter - victim->last_use)))
+		{
+			victim = window;
+		}
+	}
+
+	segment_stats.window_misses++;
+	victim->base = address & ~(uint32_t)(SEGMENT_WINDOW_ALIGN - 1);
+	if(address - victim->base > 0x10000UL - size)
+	{
+		victim->base = address;
+	}
+	victim->last_use = ++segment_use_counter;
+	descriptor_set_segment(segment_descriptor(victim->selector), victim->base, 0xFFFF, DESCRIPTOR_ACCESS_DATA | DESCRIPTOR_ACCESS_CPL0, DESCRIPTOR_FLAGS_16BIT);
+	return MK_FP(victim->selector, address - victim->base);
+}
+
+/* Copies size bytes between linear addresses, forwards. Returns false if one of the ranges is not below 16 MiB. */
+static inline bool segment_copy(uint32_t destination, uint32_t source, uint32_t size)
+{
+	while(size > 0)
+	{
+		uint16_t count = size < SEGMENT_COPY_STEP ? size : SEGMENT_COPY_STEP;
+		// the source lookup must not move the destination window
+		void far * to = segment_window(destination, count);
+		segment_pinned = FP_SEG(to);
+		const void far * from = segment_window(source, count);
+		segment_pinned = 0;
+		if(to == NULL || from == NULL)
+		{
+			return false;
+		}
+		_fmemcpy(to, from, count);
+		destination += count;
+		source += count;
+		size -= count;
+	}
+	return true;
+}
+#endif
+
+#if HOST
+// the entry points only serve as addresses for the descriptors
+# define DEFINE_ISR_NO_ERROR_CODE(__hex) \
+void isr##__hex(void); \
+void isr##__hex(void) \
+{ \
+}
+# define DEFINE_ISR_ERROR_CODE DEFINE_ISR_NO_ERROR_CODE
+#elif OS86
 # define DEFINE_ISR_NO_ERROR_CODE(__hex) \
 void isr##__hex(void); \
 asm( \
@@ -602,11 +929,12 @@ typedef struct registers_t
 	uint16_t ax;
 	uint16_t interrupt_number;
 	uint16_t error_code;
-	uint16_t ss;
-	uint16_t sp;
-	uint16_t flags;
 	uint16_t ip;
 	uint16_t cs;
+	uint16_t flags;
+	// only after a change of privilege level
+	uint16_t sp;
+	uint16_t ss;
 } registers_t;
 #elif OS386
 typedef struct registers_t
@@ -663,10 +991,14 @@ typedef struct registers_t
 } registers_t;
 #endif
 
-#if OS86
+#if HOST
+// no interrupts are delivered to the host build
+#elif OS86
 asm(
 	".global\tisr_common\n\t"
 	"isr_common:\n\t"
+	// C code relies on the direction flag being clear, the interrupted code might have been copying backwards
+	"cld\n\t"
 	"pushw\t%cx\n\t"
 	"pushw\t%dx\n\t"
 	"pushw\t%bx\n\t"
@@ -697,6 +1029,7 @@ asm(
 asm(
 	".global\tisr_common\n\t"
 	"isr_common:\n\t"
+	"cld\n\t"
 	"pushaw\n\t"
 	"pushw\t%es\n\t"
 	"pushw\t%ds\n\t"
@@ -716,6 +1049,7 @@ asm(
 asm(
 	".global\tisr_common\n\t"
 	"isr_common:\n\t"
+	"cld\n\t"
 	"pushal\n\t"
 	"pushl\t%es\n\t"
 	"pushl\t%ds\n\t"
@@ -739,6 +1073,7 @@ asm(
 asm(
 	".global\tisr_common\n\t"
 	"isr_common:\n\t"
+	"cld\n\t"
 	"pushq\t%rax\n\t"
 	"pushq\t%rcx\n\t"
 	"pushq\t%rdx\n\t"
@@ -805,6 +1140,20 @@ static inline void set_interrupt(uint8_t interrupt_number, uint16_t selector, vo
 #endif
 }
 
+#if OS86
+# define DESCRIPTOR_ACCESS_INTGATE 0
+# define KERNEL_SEGMENT 0
+#elif OS286
+# define DESCRIPTOR_ACCESS_INTGATE DESCRIPTOR_ACCESS_INTGATE16
+# define KERNEL_SEGMENT SEL_KERNEL_CS
+#elif OS386
+# define DESCRIPTOR_ACCESS_INTGATE DESCRIPTOR_ACCESS_INTGATE32
+# define KERNEL_SEGMENT SEL_KERNEL_CS
+#elif OS64
+# define DESCRIPTOR_ACCESS_INTGATE DESCRIPTOR_ACCESS_INTGATE64
+# define KERNEL_SEGMENT SEL_KERNEL_CS
+#endif
+
 #define PORT_PIC1_COMMAND 0x20
 #define PORT_PIC1_DATA    (PORT_PIC1_COMMAND + 1)
 #define PORT_PIC2_COMMAND 0xA0
@@ -817,402 +1166,7328 @@ static inline void set_interrupt(uint8_t interrupt_number, uint16_t selector, vo
 
 #define PORT_PS2_DATA     0x60
 
+#define PORT_CMOS_INDEX   0x70
+#define PORT_CMOS_DATA    (PORT_CMOS_INDEX + 1)
+
+// the 8237 DMA controller for the 8-bit channels, with the page register of channel 2
+#define PORT_DMA2_ADDRESS   0x04
+#define PORT_DMA2_COUNT     0x05
+#define PORT_DMA_MASK       0x0A
+#define PORT_DMA_MODE       0x0B
+#define PORT_DMA_FLIP_FLOP  0x0C
+#define PORT_DMA2_PAGE      0x81
+
+#define PORT_ATA1_DATA          0x1F0
+#define PORT_ATA1_ERROR         (PORT_ATA1_DATA + 1)
+#define PORT_ATA1_SECTOR_COUNT  (PORT_ATA1_DATA + 2)
+#define PORT_ATA1_LBA_LOW       (PORT_ATA1_DATA + 3)
+#define PORT_ATA1_LBA_MID       (PORT_ATA1_DATA + 4)
+#define PORT_ATA1_LBA_HIGH      (PORT_ATA1_DATA + 5)
+#define PORT_ATA1_DRIVE         (PORT_ATA1_DATA + 6)
+#define PORT_ATA1_COMMAND       (PORT_ATA1_DATA + 7) // the status register when read
+#define PORT_ATA1_CONTROL       0x3F6 // the alternate status register when read
+
+#define PORT_FDC_DIGITAL_OUTPUT 0x3F2
+#define PORT_FDC_MAIN_STATUS    0x3F4
+#define PORT_FDC_FIFO           0x3F5
+#define PORT_FDC_CONFIG_CONTROL 0x3F7
+
+#define PORT_PCI_CONFIG_ADDRESS 0xCF8
+#define PORT_PCI_CONFIG_DATA    0xCFC
+
+#define PORT_COM1_DATA          0x3F8
+#define PORT_COM1_INTERRUPT     (PORT_COM1_DATA + 1)
+#define PORT_COM1_FIFO          (PORT_COM1_DATA + 2)
+#define PORT_COM1_LINE_CONTROL  (PORT_COM1_DATA + 3)
+#define PORT_COM1_MODEM_CONTROL (PORT_COM1_DATA + 4)
+#define PORT_COM1_LINE_STATUS   (PORT_COM1_DATA + 5)
+
+// the isa-debug-exit device of QEMU, writing a value v terminates it with exit status 2 * v + 1
+#define PORT_DEBUG_EXIT         0xF4
+
+// system control port A, with the fast gate for the A20 line
+#define PORT_SYSTEM_CONTROL_A   0x92
+
 #define PIC_ICW1_ICW4 0x01
 #define PIC_ICW1_INIT 0x10
 #define PIC_ICW4_8086 0x01
 #define PIC_EOI       0x20
+#define PIC_READ_IRR  0x0A
 
 #define PIT_CHANNEL0 0x00
+#define PIT_ACCESS_LATCH 0x00
 #define PIT_ACCESS_WORD 0x30
+#define PIT_RATE_GENERATOR 0x04
 #define PIT_SQUARE_WAVE 0x06
 
+#define PIT_FREQUENCY 1193182
+
+#define DMA_MASK_ON        0x04
+#define DMA_MODE_WRITE     0x04 // from the device to memory
+#define DMA_MODE_SINGLE    0x40
+
+#define UART_LINE_CONTROL_8N1  0x03
+#define UART_LINE_CONTROL_DLAB 0x80
+#define UART_FIFO_ENABLE_CLEAR 0xC7
+#define UART_LINE_STATUS_THRE  0x20
+#define UART_MODEM_CONTROL_LOOPBACK 0x10
+
+#define SYSTEM_CONTROL_A_A20   0x02
+
 enum
 {
 	IRQ0 = 32,
 	IRQ8 = IRQ0 + 8,
 };
 
+// COM1 at 115200 baud, 8 data bits, no parity, 1 stop bit, polled
+static inline void serial_init(void)
+{
+	outp(PORT_COM1_INTERRUPT,    0x00);
+	outp(PORT_COM1_LINE_CONTROL, UART_LINE_CONTROL_DLAB);
+	outp(PORT_COM1_DATA,         0x01); // divisor low byte
+	outp(PORT_COM1_INTERRUPT,    0x00); // divisor high byte
+	outp(PORT_COM1_LINE_CONTROL, UART_LINE_CONTROL_8N1);
+	outp(PORT_COM1_FIFO,         UART_FIFO_ENABLE_CLEAR);
+}
+
+static inline void serial_putchar(char c)
+{
+	while((inp(PORT_COM1_LINE_STATUS) & UART_LINE_STATUS_THRE) == 0)
+		;
+	outp(PORT_COM1_DATA, c);
+}
+
+static inline void serial_write(const char * text, size_t length)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		if(text[i] == '\n')
+		{
+			serial_putchar('\r');
+		}
+		serial_putchar(text[i]);
+	}
+}
+
+// a second destination for the kernel and benchmark output, set by the virtio console driver
+static void (* kprintf_mirror)(const char * text, size_t length);
+
+#if (OS386 || OS64) && !HOST
+/*
+ * Virtual memory
+ *
+ * The first VM_IDENTITY_SIZE bytes are identity mapped with global pages, page tables and frames come from the part of
+ * it above VM_FRAMES_START, so that they can be accessed through their physical addresses. vm_map uses large pages
+ * (4 MiB on the 386 with PSE, 2 MiB in long mode) wherever the addresses and the size allow it.
+ *
+ * Large tables that are not needed all at once come from the heap instead of the BSS, a reserved range above the
+ * identity map whose pages are not present until they are first touched. The page fault handler then gives them a
+ * zeroed frame, so that nothing is cleared or allocated at startup for memory that ends up unused.
+ *
+ * TLB invalidations are collected while the tables are changed and carried out at the end of every operation, one
+ * INVLPG per page up to VM_FLUSH_BATCH pages, a full flush beyond that, which also drops global entries. Changes to
+ * an address space that is not current wait for the switch to it, except for the kernel mappings: every space shares
+ * them as global entries, which no switch flushes, so they are invalidated right away. Processors without CPUID are
+ * taken to be 386s without INVLPG and always get a full flush. In long mode, address spaces get their own PCID if the
+ * processor has them, so switching between them does not flush the TLB.
+ */
+
+#if OS386
+typedef uint32_t vm_entry_t;
+# define VM_LEVELS 2
+# define VM_LEVEL_BITS 10
+#else
+typedef uint64_t vm_entry_t;
+# define VM_LEVELS 4
+# define VM_LEVEL_BITS 9
+#endif
+
 enum
 {
-	SCREEN_WIDTH = 80,
-	SCREEN_HEIGHT = 25
-};
+	VM_PAGE_SIZE = 0x1000,
+	VM_ENTRIES = 1 << VM_LEVEL_BITS,
+	VM_LARGE_PAGE_SIZE = VM_PAGE_SIZE << VM_LEVEL_BITS,
 
-static uint8_t screen_x = 0, screen_y = 0, screen_attribute = 0x07;
+	VM_PRESENT = 0x001,
+	VM_WRITE = 0x002,
+	VM_USER = 0x004,
+	VM_CACHE_DISABLE = 0x010,
+	VM_LARGE = 0x080,
+	VM_GLOBAL = 0x100,
+	// ignored by the processor, keeps vm_map from using large pages
+	VM_SMALL_PAGES = 0x200,
+	VM_FLAGS = 0xFFF,
 
-#if OS86
-uint16_t far * const screen_buffer = (uint16_t far *)MK_FP(0xB800, 0);
-#elif OS286
-uint16_t far * const screen_buffer = (uint16_t far *)MK_FP(0x0018, 0);
+	VM_IDENTITY_SIZE = 0x1000000,
+	VM_FRAMES_START = 0x200000,
+	VM_HEAP_BASE = 0x20000000,
+	VM_HEAP_SIZE = 0x10000000,
+	VM_HEAP_ALIGN = 16,
+
+	// page fault error code bits
+	VM_FAULT_PRESENT = 0x01,
+
+	VM_FLUSH_BATCH = 32,
+};
+
+#if OS386
+# define VM_ADDRESS_MASK ((vm_entry_t)~VM_FLAGS)
 #else
-uint16_t * const screen_buffer = (uint16_t *)0x000B8000;
+# define VM_ADDRESS_MASK ((vm_entry_t)0x000FFFFFFFFFF000)
+// keeps the TLB entries of the new PCID when loading CR3
+# define VM_CR3_NO_FLUSH ((size_t)1 << 63)
 #endif
 
-static inline void screen_set_word(int offset, uint16_t value)
+#define CR0_MP    0x00000002
+#define CR0_EM    0x00000004
+#define CR0_TS    0x00000008
+#define CR0_NE    0x00000020
+#define CR0_PG    0x80000000
+#define CR4_PSE   0x00000010
+#define CR4_PGE   0x00000080
+#define CR4_OSFXSR     0x00000200
+#define CR4_OSXMMEXCPT 0x00000400
+#define CR4_PCIDE 0x00020000
+#define CR4_OSXSAVE    0x00040000
+
+// KiB of memory from address 0 when started by a Multiboot loader (boot.asm), 0 when started from the boot sector
+extern uint32_t multiboot_memory;
+
+typedef struct vm_space_t
 {
-	screen_buffer[offset] = value;
+	vm_entry_t * root;
+	uint16_t pcid;
+	// changed while not loaded, its TLB entries have to be flushed on the next switch
+	bool stale;
+} vm_space_t;
+
+static vm_space_t vm_kernel_space;
+static vm_space_t * vm_current_space;
+static bool vm_has_large_pages, vm_has_global_pages, vm_has_pcid, vm_has_invlpg;
+static uint16_t vm_next_pcid = 1;
+
+static size_t vm_next_frame = VM_FRAMES_START;
+// the end of the frames handed out, lower than VM_IDENTITY_SIZE if a Multiboot loader reported less memory
+static size_t vm_frames_end = VM_IDENTITY_SIZE;
+// freed frames are linked through their first word
+static size_t vm_free_frames;
+
+// the end of the heap handed out so far
+static size_t vm_heap_next = VM_HEAP_BASE;
+
+typedef struct vm_stats_t
+{
+	uint32_t faults;
+	// heap pages given a frame on their first access
+	uint32_t zero_fills;
+} vm_stats_t;
+
+static vm_stats_t vm_stats;
+
+static size_t vm_flush_pages[VM_FLUSH_BATCH];
+// above VM_FLUSH_BATCH if the whole TLB has to be flushed
+static unsigned vm_flush_count;
+
+static inline size_t read_cr0(void)
+{
+	size_t value;
+	asm volatile("mov\t%%cr0, %0" : "=r"(value));
+	return value;
 }
 
-static inline uint16_t screen_get_word(int offset)
+static inline void write_cr0(size_t value)
 {
-	return screen_buffer[offset];
+	asm volatile("mov\t%0, %%cr0" : : "r"(value) : "memory");
 }
 
-static inline void screen_scroll_lines(int count)
+static inline size_t read_cr2(void)
 {
-	if(count > SCREEN_HEIGHT)
-	{
-		count = SCREEN_HEIGHT;
-	}
-	for(int i = 0; i < SCREEN_WIDTH * (SCREEN_HEIGHT - count); i++)
-	{
-		screen_buffer[i] = screen_buffer[i + SCREEN_WIDTH * count];
-	}
-	for(int i = 0; i < SCREEN_WIDTH * count; i++)
-	{
-		screen_buffer[i + SCREEN_WIDTH * (SCREEN_HEIGHT - count)] = (screen_attribute << 8) | ' ';
-	}
+	size_t value;
+	asm volatile("mov\t%%cr2, %0" : "=r"(value));
+	return value;
 }
 
-static inline void screen_move_cursor(void)
+static inline size_t read_cr3(void)
 {
-	uint16_t location = screen_y * SCREEN_WIDTH + screen_x;
-	outp(0x3D4, 0x0E);
-	outp(0x3D5, location >> 8);
-	outp(0x3D4, 0x0F);
-	outp(0x3D5, location);
+	size_t value;
+	asm volatile("mov\t%%cr3, %0" : "=r"(value));
+	return value;
 }
 
-static inline void screen_putchar(int c)
+static inline void write_cr3(size_t value)
 {
-	switch(c)
+	asm volatile("mov\t%0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline size_t read_cr4(void)
+{
+	size_t value;
+	asm volatile("mov\t%%cr4, %0" : "=r"(value));
+	return value;
+}
+
+static inline void write_cr4(size_t value)
+{
+	asm volatile("mov\t%0, %%cr4" : : "r"(value) : "memory");
+}
+
+/* Returns a zeroed frame, or 0 if there are none left */
+static inline size_t vm_frame_alloc(void)
+{
+	size_t frame;
+	if(vm_free_frames != 0)
 	{
-	case '\b':
-		if(screen_x > 0)
-		{
-			screen_x--;
-		}
-		break;
-	case '\t':
-		screen_x = (screen_x + 8) & ~7;
-		break;
-	case '\n':
-		screen_x = 0;
-		screen_y++;
-		break;
-	default:
-		if(' ' <= c && c <= '~')
-		{
-			screen_set_word(screen_y * SCREEN_WIDTH + screen_x, (screen_attribute << 8) + (uint8_t)c);
-			screen_x++;
-		}
-		break;
+		frame = vm_free_frames;
+		vm_free_frames = *(size_t *)frame;
 	}
-	if(screen_x >= SCREEN_WIDTH)
+	else if(vm_next_frame < vm_frames_end)
 	{
-		screen_y += screen_x / SCREEN_WIDTH;
-		screen_x %= SCREEN_WIDTH;
+		frame = vm_next_frame;
+		vm_next_frame += VM_PAGE_SIZE;
 	}
-	if(screen_y >= SCREEN_HEIGHT)
+	else
 	{
-		screen_scroll_lines(screen_y + 1 - SCREEN_HEIGHT);
-		screen_y = SCREEN_HEIGHT - 1;
+		return 0;
 	}
-	screen_move_cursor();
+	memset((void *)frame, 0, VM_PAGE_SIZE);
+	return frame;
 }
 
-static inline void screen_putstr(const char far * text)
+/* Returns count physically consecutive zeroed frames from the part never handed out, for devices that are given one address for a larger structure, or 0 */
+static inline size_t vm_frames_alloc(unsigned count)
 {
-	for(int i = 0; text[i] != '\0'; i++)
+	size_t frames = vm_next_frame;
+	if(vm_frames_end - frames < (size_t)count * VM_PAGE_SIZE)
 	{
-		screen_putchar((uint8_t)text[i]);
+		return 0;
 	}
+	vm_next_frame += (size_t)count * VM_PAGE_SIZE;
+	memset((void *)frames, 0, (size_t)count * VM_PAGE_SIZE);
+	return frames;
 }
 
-static inline void screen_puthex(size_t value)
+static inline void vm_frame_free(size_t frame)
 {
-	char buffer[sizeof(value) * 2 + 1];
+	*(size_t *)frame = vm_free_frames;
+	vm_free_frames = frame;
+}
+
+static inline unsigned vm_index(size_t address, int level)
+{
+	return (address >> (12 + level * VM_LEVEL_BITS)) & (VM_ENTRIES - 1);
+}
+
+/* Finds the entry for an address at a level, 0 for small pages and 1 for large pages, optionally creating the tables on the way. Returns NULL if a table is missing or a large page is in the way. */
+static inline vm_entry_t * vm_walk(vm_space_t * space, size_t address, int level, bool create)
+{
+	vm_entry_t * table = space->root;
+	for(int current = VM_LEVELS - 1; current > level; current--)
+	{
+		vm_entry_t * entry = &table[vm_index(address, current)];
+		if((*entry & VM_PRESENT) == 0)
+		{
+			size_t frame = create ? vm_frame_alloc() : 0;
+			if(frame == 0)
+			{
+				return NULL;
+			}
+			// the access rights are decided by the last level
+			*entry = frame | VM_PRESENT | VM_WRITE | VM_USER;
+		}
+		else if((*entry & VM_LARGE) != 0)
+		{
+			return NULL;
+		}
+		table = (vm_entry_t *)(size_t)(*entry & VM_ADDRESS_MASK);
+	}
+	return &table[vm_index(address, level)];
+}
+
+static inline void vm_flush_all(void)
+{
+	if(vm_has_global_pages)
+	{
+		// toggling PGE also drops the global entries, in every PCID
+		size_t cr4 = read_cr4();
+		write_cr4(cr4 & ~CR4_PGE);
+		write_cr4(cr4);
+	}
+	else
+	{
+		write_cr3(read_cr3());
+	}
+}
+
+static inline void vm_invalidate(vm_space_t * space, size_t address)
+{
+	// the kernel mappings are in every address space and global, so reloading CR3 on a switch does not drop them
+	if(space != vm_current_space && space != &vm_kernel_space)
+	{
+		space->stale = true;
+		return;
+	}
+	if(vm_flush_count < VM_FLUSH_BATCH)
+	{
+		vm_flush_pages[vm_flush_count] = address;
+	}
+	if(vm_flush_count <= VM_FLUSH_BATCH)
+	{
+		vm_flush_count++;
+	}
+}
+
+static inline void vm_commit(void)
+{
+	if(vm_flush_count > VM_FLUSH_BATCH || (!vm_has_invlpg && vm_flush_count != 0))
+	{
+		vm_flush_all();
+	}
+	else
+	{
+		for(unsigned i = 0; i < vm_flush_count; i++)
+		{
+			asm volatile("invlpg\t(%0)" : : "r"(vm_flush_pages[i]) : "memory");
+		}
+	}
+	vm_flush_count = 0;
+}
+
+/* Maps size bytes from virtual to physical, both page aligned. Returns false if it runs out of frames for tables or a large page is in the way, the pages up to that point stay mapped. */
+static inline bool vm_map(vm_space_t * space, size_t virtual, size_t physical, size_t size, unsigned flags)
+{
+	bool large_pages = vm_has_large_pages && (flags & VM_SMALL_PAGES) == 0;
+	flags = (flags & (VM_FLAGS & ~VM_SMALL_PAGES & ~VM_LARGE)) | VM_PRESENT;
+	if(!vm_has_global_pages)
+	{
+		flags &= ~VM_GLOBAL;
+	}
+
+	bool success = true;
+	size_t end = virtual + size;
+	while(virtual < end)
+	{
+		vm_entry_t * entry = NULL;
+		vm_entry_t value = 0;
+		size_t step = VM_LARGE_PAGE_SIZE;
+		if(large_pages && ((virtual | physical) & (VM_LARGE_PAGE_SIZE - 1)) == 0 && end - virtual >= VM_LARGE_PAGE_SIZE)
+		{
+			entry = vm_walk(space, virtual, 1, true);
+			value = physical | flags | VM_LARGE;
+			// a page table is already in place, keep using it
+			if(entry != NULL && (*entry & (VM_PRESENT | VM_LARGE)) == VM_PRESENT)
+			{
+				entry = NULL;
+			}
+		}
+		if(entry == NULL)
+		{
+			entry = vm_walk(space, virtual, 0, true);
+			value = physical | flags;
+			step = VM_PAGE_SIZE;
+		}
+		if(entry == NULL)
+		{
+			success = false;
+			break;
+		}
+		// entries that were not present cannot be in the TLB
+		if((*entry & VM_PRESENT) != 0)
+		{
+			vm_invalidate(space, virtual);
+		}
+		*entry = value;
+		virtual += step;
+		physical += step;
+	}
+	vm_commit();
+	return success;
+}
+
+/* Removes the mappings of a range, or changes their flags if remove is false. A large page is always changed as a whole. */
+static inline void vm_change(vm_space_t * space, size_t virtual, size_t size, bool remove, unsigned flags)
+{
+	flags = (flags & (VM_FLAGS & ~VM_SMALL_PAGES & ~VM_LARGE)) | VM_PRESENT;
+	if(!vm_has_global_pages)
+	{
+		flags &= ~VM_GLOBAL;
+	}
+
+	size_t end = virtual + size;
+	while(virtual < end)
+	{
+		size_t large_start = virtual & ~(size_t)(VM_LARGE_PAGE_SIZE - 1);
+		vm_entry_t * entry = vm_walk(space, virtual, 1, false);
+		if(entry == NULL || (*entry & VM_PRESENT) == 0)
+		{
+			// nothing is mapped in this large page sized region
+			virtual = large_start + VM_LARGE_PAGE_SIZE;
+		}
+		else if((*entry & VM_LARGE) != 0)
+		{
+			*entry = remove ? 0 : (*entry & VM_ADDRESS_MASK) | flags | VM_LARGE;
+			vm_invalidate(space, large_start);
+			virtual = large_start + VM_LARGE_PAGE_SIZE;
+		}
+		else
+		{
+			entry = vm_walk(space, virtual, 0, false);
+			if((*entry & VM_PRESENT) != 0)
+			{
+				*entry = remove ? 0 : (*entry & VM_ADDRESS_MASK) | flags;
+				vm_invalidate(space, virtual);
+			}
+			virtual += VM_PAGE_SIZE;
+		}
+		if(virtual < large_start)
+		{
+			// wrapped around the end of the address space
+			break;
+		}
+	}
+	vm_commit();
+}
+
+static inline void vm_unmap(vm_space_t * space, size_t virtual, size_t size)
+{
+	vm_change(space, virtual, size, true, 0);
+}
+
+static inline void vm_protect(vm_space_t * space, size_t virtual, size_t size, unsigned flags)
+{
+	vm_change(space, virtual, size, false, flags);
+}
+
+/* A new address space sharing the kernel mappings present at this point, at the granularity of the top level entries */
+static inline bool vm_space_create(vm_space_t * space)
+{
+	size_t root = vm_frame_alloc();
+	if(root == 0)
+	{
+		return false;
+	}
+	space->root = (vm_entry_t *)root;
+	memcpy(space->root, vm_kernel_space.root, VM_PAGE_SIZE);
+	space->pcid = vm_has_pcid ? vm_next_pcid++ : 0;
+	space->stale = false;
+	return true;
+}
+
+static inline void vm_switch(vm_space_t * space)
+{
+	size_t cr3 = (size_t)space->root;
+#if OS64
+	if(vm_has_pcid)
+	{
+		cr3 |= space->pcid;
+		if(!space->stale)
+		{
+			cr3 |= VM_CR3_NO_FLUSH;
+		}
+	}
+#endif
+	space->stale = false;
+	vm_current_space = space;
+	write_cr3(cr3);
+}
+
+/* Reserves size bytes of the heap, they only get frames as they are touched. Returns NULL once the heap is used up, there is no way to give memory back. */
+static inline void * vm_heap_alloc(size_t size)
+{
+	size = (size + VM_HEAP_ALIGN - 1) & ~(size_t)(VM_HEAP_ALIGN - 1);
+	if(VM_HEAP_BASE + VM_HEAP_SIZE - vm_heap_next < size)
+	{
+		return NULL;
+	}
+	void * block = (void *)vm_heap_next;
+	vm_heap_next += size;
+	return block;
+}
+
+/* Called on every page fault, maps a zeroed frame for an access to a part of the heap that has been handed out. Returns false for the faults it cannot resolve. */
+static inline bool vm_fault(size_t error_code)
+{
+	vm_stats.faults++;
+	size_t address = read_cr2();
+	if((error_code & VM_FAULT_PRESENT) != 0 || address < VM_HEAP_BASE || address >= vm_heap_next)
+	{
+		return false;
+	}
+	size_t page = address & ~(size_t)(VM_PAGE_SIZE - 1);
+	size_t frame = vm_frame_alloc();
+	if(frame == 0)
+	{
+		return false;
+	}
+	if(!vm_map(&vm_kernel_space, page, frame, VM_PAGE_SIZE, VM_WRITE | VM_GLOBAL | VM_SMALL_PAGES))
+	{
+		vm_frame_free(frame);
+		return false;
+	}
+	// address spaces created earlier may not share the top level entry yet
+	unsigned top = vm_index(page, VM_LEVELS - 1);
+	if((vm_current_space->root[top] & VM_PRESENT) == 0)
+	{
+		vm_current_space->root[top] = vm_kernel_space.root[top];
+	}
+	vm_stats.zero_fills++;
+	return true;
+}
+
+/* Replaces the boot time paging setup (none for OS386, the first 16 MiB in large pages for OS64) with the kernel space */
+static inline void vm_init(void)
+{
+	size_t cr4 = 0;
+#if OS64
+	cr4 = read_cr4();
+	// long mode always has 2 MiB pages
+	vm_has_large_pages = true;
+#endif
+	if(cpu_has_cpuid() && cpuid(0, 0).eax >= 1)
+	{
+		cpuid_t features = cpuid(1, 0);
+		// CPUID appeared with late 486s, which already have INVLPG
+		vm_has_invlpg = true;
+		if((features.edx & CPUID_1_EDX_PSE) != 0)
+		{
+			vm_has_large_pages = true;
+			cr4 |= CR4_PSE;
+		}
+		vm_has_global_pages = (features.edx & CPUID_1_EDX_PGE) != 0;
+#if OS64
+		vm_has_pcid = (features.ecx & CPUID_1_ECX_PCID) != 0;
+#endif
+	}
+	// CR4 does not exist on processors without CPUID
+	if(cr4 != 0)
+	{
+		write_cr4(cr4);
+	}
+
+	if(multiboot_memory != 0 && (size_t)multiboot_memory * 1024 < vm_frames_end)
+	{
+		size_t end = (size_t)multiboot_memory * 1024 & ~(size_t)(VM_PAGE_SIZE - 1);
+		vm_frames_end = end > vm_next_frame ? end : vm_next_frame;
+	}
+	vm_kernel_space.root = (vm_entry_t *)vm_frame_alloc();
+	vm_map(&vm_kernel_space, 0, 0, VM_IDENTITY_SIZE, VM_WRITE | VM_GLOBAL);
+	// PCIDs are not enabled yet, vm_switch cannot be used
+	write_cr3((size_t)vm_kernel_space.root);
+	vm_current_space = &vm_kernel_space;
+#if OS386
+	write_cr0(read_cr0() | CR0_PG);
+#endif
+
+	if(vm_has_global_pages)
+	{
+		cr4 |= CR4_PGE;
+	}
+	if(vm_has_pcid)
+	{
+		// the kernel space runs with PCID 0, as required when enabling them
+		cr4 |= CR4_PCIDE;
+	}
+	if(cr4 != 0)
+	{
+		write_cr4(cr4);
+	}
+}
+#endif
+
+#if OS64
+/*
+ * Extended processor state
+ *
+ * The kernel is compiled without SSE, so that the compiler never touches the x87, SSE and AVX registers by itself.
+ * fpu_init still enables them, AVX too when the processor and XSAVE support it, for the code that asks for them: a
+ * SIMD region runs between kernel_fpu_begin and kernel_fpu_end with an fpu_context_t of its own, and its functions
+ * turn the instructions on with the target attribute.
+ *
+ * The registers hold the state of one context at a time, the owner, and are only switched when another context
+ * actually uses them. kernel_fpu_begin sets CR0.TS when the region's context is not the owner, so that its first
+ * SIMD instruction raises #NM (vector 7). fpu_switch then saves the registers to the owner's area with XSAVE (or
+ * FXSAVE), loads those of the region's context and clears TS. A region that follows one of the same context switches
+ * nothing. Regions nest, an interrupt handler with SIMD code needs a context of its own.
+ *
+ * In the host build the process already has the registers to itself, the regions are empty there.
+ */
+
+enum
+{
+	// x87 control word and MXCSR of a context that has not run yet, all exceptions masked
+	FPU_INITIAL_FCW = 0x037F,
+	FPU_INITIAL_MXCSR = 0x1F80,
+	FPU_AREA_FCW = 0,
+	FPU_AREA_MXCSR = 24,
+	// below this many bytes, a scan is not worth a possible switch of the registers
+	FPU_SCAN_THRESHOLD = 256,
+
+	XCR0_X87 = 0x01,
+	XCR0_SSE = 0x02,
+	XCR0_AVX = 0x04,
+};
+
+typedef struct fpu_context_t fpu_context_t;
+
+struct fpu_context_t
+{
+	// the registers while another context owns them, one page in the XSAVE or FXSAVE layout
+	uint8_t * area;
+	// the region this one is nested in
+	fpu_context_t * previous;
+};
+
+typedef struct fpu_stats_t
+{
+	// #NM exceptions taken, and how many of them saved another context
+	uint32_t traps;
+	uint32_t saves;
+} fpu_stats_t;
+
+static bool fpu_avx2;
+// for SIMD regions of the main flow of the kernel
+static fpu_context_t fpu_kernel_context;
+
+static inline uint64_t xgetbv(uint32_t index)
+{
+	uint32_t low, high;
+	asm volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(index));
+	return (uint64_t)high << 32 | low;
+}
+
+/* Whether AVX2 can be used, once the operating system has enabled the AVX state */
+static inline bool fpu_detect_avx2(void)
+{
+	return (cpuid(1, 0).ecx & CPUID_1_ECX_OSXSAVE) != 0 && (xgetbv(0) & (XCR0_SSE | XCR0_AVX)) == (XCR0_SSE | XCR0_AVX)
+		&& cpuid(0, 0).eax >= 7 && (cpuid(7, 0).ebx & CPUID_7_EBX_AVX2) != 0;
+}
+
+#if HOST
+static inline bool fpu_context_init(fpu_context_t * context)
+{
+	(void) context;
+	return true;
+}
+
+static inline bool fpu_context_ready(const fpu_context_t * context)
+{
+	(void) context;
+	return true;
+}
+
+static inline void kernel_fpu_begin(fpu_context_t * context)
+{
+	(void) context;
+}
+
+static inline void kernel_fpu_end(fpu_context_t * context)
+{
+	(void) context;
+}
+
+static inline void fpu_init(void)
+{
+	fpu_avx2 = fpu_detect_avx2();
+	fpu_context_init(&fpu_kernel_context);
+}
+#else
+static bool fpu_xsave;
+static fpu_stats_t fpu_stats;
+// whose state is in the registers, and the context of the innermost region running
+static fpu_context_t * fpu_owner;
+static fpu_context_t * fpu_current;
+// a copy of CR0.TS
+static bool fpu_ts;
+
+static inline bool fpu_context_init(fpu_context_t * context)
+{
+	context->area = (uint8_t *)vm_frames_alloc(1);
+	context->previous = NULL;
+	if(context->area == NULL)
+	{
+		return false;
+	}
+	// XRSTOR takes the other components of a zeroed header as being in their initial state
+	*(uint16_t *)(context->area + FPU_AREA_FCW) = FPU_INITIAL_FCW;
+	*(uint32_t *)(context->area + FPU_AREA_MXCSR) = FPU_INITIAL_MXCSR;
+	return true;
+}
+
+/* Whether fpu_context_init got an area for the context, SIMD regions may only run with one */
+static inline bool fpu_context_ready(const fpu_context_t * context)
+{
+	return context->area != NULL;
+}
+
+static inline void fpu_set_ts(bool ts)
+{
+	if(ts == fpu_ts)
+	{
+		return;
+	}
+	fpu_ts = ts;
+	if(ts)
+	{
+		write_cr0(read_cr0() | CR0_TS);
+	}
+	else
+	{
+		asm volatile("clts" : : : "memory");
+	}
+}
+
+static inline void kernel_fpu_begin(fpu_context_t * context)
+{
+	size_t flags = save_and_disable_interrupts();
+	context->previous = fpu_current;
+	fpu_current = context;
+	fpu_set_ts(fpu_owner != context);
+	restore_interrupts(flags);
+}
+
+static inline void kernel_fpu_end(fpu_context_t * context)
+{
+	size_t flags = save_and_disable_interrupts();
+	fpu_current = context->previous;
+	// the registers stay with their owner, for the next region of the same context
+	if(fpu_current != NULL)
+	{
+		fpu_set_ts(fpu_owner != fpu_current);
+	}
+	restore_interrupts(flags);
+}
+
+/* The #NM handler, returns false if no SIMD region is running */
+static inline bool fpu_switch(void)
+{
+	if(fpu_current == NULL || !fpu_context_ready(fpu_current))
+	{
+		return false;
+	}
+	fpu_set_ts(false);
+	fpu_stats.traps++;
+	if(fpu_owner == fpu_current)
+	{
+		return true;
+	}
+	if(fpu_owner != NULL)
+	{
+		if(fpu_xsave)
+			asm volatile("xsave64\t(%0)" : : "r"(fpu_owner->area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+		else
+			asm volatile("fxsave64\t(%0)" : : "r"(fpu_owner->area) : "memory");
+		fpu_stats.saves++;
+	}
+	if(fpu_xsave)
+		asm volatile("xrstor64\t(%0)" : : "r"(fpu_current->area), "a"(0xFFFFFFFF), "d"(0xFFFFFFFF) : "memory");
+	else
+		asm volatile("fxrstor64\t(%0)" : : "r"(fpu_current->area) : "memory");
+	fpu_owner = fpu_current;
+	return true;
+}
+
+static inline void fpu_init(void)
+{
+	// TS may still be set by a kernel that started this one through kexec
+	write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+	size_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+	uint32_t features = cpuid(1, 0).ecx;
+	fpu_xsave = (features & CPUID_1_ECX_XSAVE) != 0;
+	if(fpu_xsave)
+	{
+		cr4 |= CR4_OSXSAVE;
+	}
+	write_cr4(cr4);
+	if(fpu_xsave)
+	{
+		// the AVX state fits into the page of a context, larger ones like AVX-512 are left off
+		uint32_t xcr0 = XCR0_X87 | XCR0_SSE | ((features & CPUID_1_ECX_AVX) != 0 ? XCR0_AVX : 0);
+		asm volatile("xsetbv" : : "c"(0), "a"(xcr0), "d"(0));
+	}
+	asm volatile("fninit");
+	// without an area for the kernel context, the scans go a word at a time
+	if(!fpu_context_init(&fpu_kernel_context))
+	{
+		fpu_avx2 = false;
+		return;
+	}
+	fpu_avx2 = fpu_detect_avx2();
+}
+#endif
+
+/* Scans a word at a time like strlen, the lowest byte flagged by the test is always a real match */
+static inline size_t fpu_scan_words(const uint8_t * data, uint8_t c, size_t size)
+{
+	size_t pattern = c * __STRING_ONES;
+	size_t i = 0;
+	for(; i + sizeof(__string_word_t) <= size; i += sizeof(__string_word_t))
+	{
+		size_t word = *(const __string_word_t *)(data + i) ^ pattern;
+		size_t zero = (word - __STRING_ONES) & ~word & __STRING_HIGHS;
+		if(zero != 0)
+		{
+			return i + __builtin_ctzl(zero) / 8;
+		}
+	}
+	for(; i < size; i++)
+	{
+		if(data[i] == c)
+			break;
+	}
+	return i;
+}
+
+typedef char fpu_v16qi_t __attribute__((vector_size(16)));
+typedef char fpu_v32qi_t __attribute__((vector_size(32)));
+
+// only within a SIMD region
+__attribute__((target("sse2")))
+static size_t fpu_scan_sse2(const uint8_t * data, uint8_t c, size_t size)
+{
+	fpu_v16qi_t pattern = (fpu_v16qi_t){ 0 } + (char)c;
+	size_t i = 0;
+	for(; i + 16 <= size; i += 16)
+	{
+		int mask = __builtin_ia32_pmovmskb128(__builtin_ia32_loaddqu((const char *)data + i) == pattern);
+		if(mask != 0)
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + fpu_scan_words(data + i, c, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t fpu_scan_avx2(const uint8_t * data, uint8_t c, size_t size)
+{
+	fpu_v32qi_t pattern = (fpu_v32qi_t){ 0 } + (char)c;
+	size_t i = 0;
+	for(; i + 32 <= size; i += 32)
+	{
+		int mask = __builtin_ia32_pmovmskb256(__builtin_ia32_loaddqu256((const char *)data + i) == pattern);
+		if(mask != 0)
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + fpu_scan_words(data + i, c, size - i);
+}
+
+/* memchr returning an offset, size if c does not occur */
+static inline size_t fpu_scan(fpu_context_t * context, const void * data, uint8_t c, size_t size)
+{
+	if(size < FPU_SCAN_THRESHOLD || !fpu_context_ready(context))
+	{
+		return fpu_scan_words(data, c, size);
+	}
+	kernel_fpu_begin(context);
+	size_t offset = fpu_avx2 ? fpu_scan_avx2(data, c, size) : fpu_scan_sse2(data, c, size);
+	kernel_fpu_end(context);
+	return offset;
+}
+#endif
+
+#if OS386 || OS64
+/*
+ * PCI
+ *
+ * pci_init enumerates the devices once into pci_devices, from bus 0 down through the PCI-to-PCI bridges, and the
+ * drivers look theirs up in that table instead of probing configuration space themselves. Configuration space is
+ * reached through the 0xCF8/0xCFC ports, or memory mapped (ECAM) when the ACPI MCFG table describes it: one memory
+ * access per register instead of two port accesses, each of which traps to the hypervisor.
+ */
+
+enum
+{
+	PCI_DEVICES_MAX = 32,
+
+	// configuration space registers
+	PCI_CONFIG_ID = 0x00, // vendor in the low half, device in the high half
+	PCI_CONFIG_COMMAND = 0x04,
+	PCI_CONFIG_CLASS = 0x08, // class, subclass, programming interface and revision from the high byte down
+	PCI_CONFIG_HEADER_TYPE = 0x0C, // in the third byte
+	PCI_CONFIG_BAR0 = 0x10,
+	PCI_CONFIG_BAR4 = 0x20,
+	PCI_CONFIG_BRIDGE_BUSES = 0x18, // the secondary bus in the second byte
+	PCI_CONFIG_INTERRUPT = 0x3C, // the legacy interrupt line in the low byte
+
+	PCI_HEADER_MULTIFUNCTION = 0x80,
+	PCI_CLASS_BRIDGE = 0x0604,
+
+	PCI_COMMAND_IO = 0x0001,
+	PCI_COMMAND_MEMORY = 0x0002,
+	PCI_COMMAND_BUS_MASTER = 0x0004,
+
+	// memory mapped configuration space takes 1 MiB per bus, only the first buses are mapped
+	PCI_ECAM_BUS_SIZE = 0x100000,
+	PCI_ECAM_BUSES = 16,
+
+	// larger tables are taken to be garbage
+	ACPI_TABLE_MAX = 0x10000,
+};
+
+typedef struct pci_device_t
+{
+	uint8_t bus;
+	uint8_t device;
+	uint8_t function;
+	// 0xFF if the firmware did not route one
+	uint8_t irq;
+	uint32_t id;
+	uint32_t class;
+} pci_device_t;
+
+static pci_device_t pci_devices[PCI_DEVICES_MAX];
+static uint8_t pci_device_count;
+// where the configuration space of bus pci_ecam_bus_first is mapped, 0 to use the ports
+static size_t pci_ecam;
+static uint8_t pci_ecam_bus_first, pci_ecam_bus_end;
+
+static inline uint32_t pci_config_read32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset)
+{
+	if(pci_ecam != 0 && bus >= pci_ecam_bus_first && bus < pci_ecam_bus_end)
+	{
+		return *(volatile uint32_t *)(pci_ecam + ((size_t)(bus - pci_ecam_bus_first) << 20 | (size_t)device << 15 | (size_t)function << 12 | (offset & 0xFC)));
+	}
+	outpl(PORT_PCI_CONFIG_ADDRESS, 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)device << 11) | ((uint32_t)function << 8) | (offset & 0xFC));
+	return inpl(PORT_PCI_CONFIG_DATA);
+}
+
+static inline void pci_config_write32(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value)
+{
+	if(pci_ecam != 0 && bus >= pci_ecam_bus_first && bus < pci_ecam_bus_end)
+	{
+		*(volatile uint32_t *)(pci_ecam + ((size_t)(bus - pci_ecam_bus_first) << 20 | (size_t)device << 15 | (size_t)function << 12 | (offset & 0xFC))) = value;
+		return;
+	}
+	outpl(PORT_PCI_CONFIG_ADDRESS, 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)device << 11) | ((uint32_t)function << 8) | (offset & 0xFC));
+	outpl(PORT_PCI_CONFIG_DATA, value);
+}
+
+static inline uint32_t pci_read(const pci_device_t * device, uint8_t offset)
+{
+	return pci_config_read32(device->bus, device->device, device->function, offset);
+}
+
+static inline void pci_write(const pci_device_t * device, uint8_t offset, uint32_t value)
+{
+	pci_config_write32(device->bus, device->device, device->function, offset, value);
+}
+
+/* Turns on the decoding of the BARs and bus mastering in the command register */
+static inline void pci_enable(const pci_device_t * device, uint16_t flags)
+{
+	pci_write(device, PCI_CONFIG_COMMAND, (pci_read(device, PCI_CONFIG_COMMAND) & 0xFFFF) | flags);
+}
+
+static inline const pci_device_t * pci_find_id(uint32_t id)
+{
+	for(uint8_t i = 0; i < pci_device_count; i++)
+	{
+		if(pci_devices[i].id == id)
+		{
+			return &pci_devices[i];
+		}
+	}
+	return NULL;
+}
+
+/* The first device whose class register matches class in the bits of mask */
+static inline const pci_device_t * pci_find_class(uint32_t class, uint32_t mask)
+{
+	for(uint8_t i = 0; i < pci_device_count; i++)
+	{
+		if((pci_devices[i].class & mask) == class)
+		{
+			return &pci_devices[i];
+		}
+	}
+	return NULL;
+}
+
+static inline void pci_scan_bus(uint8_t bus)
+{
+	for(uint8_t device = 0; device < 32; device++)
+	{
+		for(uint8_t function = 0; function < 8; function++)
+		{
+			uint32_t id = pci_config_read32(bus, device, function, PCI_CONFIG_ID);
+			if((id & 0xFFFF) == 0xFFFF)
+			{
+				if(function == 0)
+					break;
+				continue;
+			}
+			uint32_t class = pci_config_read32(bus, device, function, PCI_CONFIG_CLASS);
+			if(pci_device_count < PCI_DEVICES_MAX)
+			{
+				pci_device_t * entry = &pci_devices[pci_device_count++];
+				entry->bus = bus;
+				entry->device = device;
+				entry->function = function;
+				entry->irq = pci_config_read32(bus, device, function, PCI_CONFIG_INTERRUPT) & 0xFF;
+				entry->id = id;
+				entry->class = class;
+			}
+			if((class >> 16) == PCI_CLASS_BRIDGE)
+			{
+				// an unconfigured bridge has no secondary bus yet, firmware numbers the buses downwards
+				uint8_t secondary = pci_config_read32(bus, device, function, PCI_CONFIG_BRIDGE_BUSES) >> 8;
+				if(secondary > bus)
+				{
+					pci_scan_bus(secondary);
+				}
+			}
+			if(function == 0 && ((pci_config_read32(bus, device, function, PCI_CONFIG_HEADER_TYPE) >> 16) & PCI_HEADER_MULTIFUNCTION) == 0)
+			{
+				break;
+			}
+		}
+	}
+}
+
+#if !HOST
+typedef struct acpi_header_t
+{
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem[6];
+	char oem_table[8];
+	uint32_t oem_revision;
+	uint32_t creator;
+	uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+// one per PCI segment group in the MCFG table, after its header and 8 reserved bytes
+typedef struct acpi_mcfg_entry_t
+{
+	uint64_t base;
+	uint16_t segment;
+	uint8_t bus_first;
+	uint8_t bus_last;
+	uint32_t reserved;
+} __attribute__((packed)) acpi_mcfg_entry_t;
+
+/* Maps a physical range above the identity mapped memory at the same virtual address, in whole large pages */
+static inline bool pci_map(uint64_t physical, size_t size, unsigned flags)
+{
+	if(physical + size <= VM_IDENTITY_SIZE)
+	{
+		return true;
+	}
+	if(physical > (size_t)-1 - size - VM_LARGE_PAGE_SIZE)
+	{
+		return false;
+	}
+	size_t start = physical & ~(size_t)(VM_LARGE_PAGE_SIZE - 1);
+	size_t end = (physical + size + VM_LARGE_PAGE_SIZE - 1) & ~(size_t)(VM_LARGE_PAGE_SIZE - 1);
+	return vm_map(&vm_kernel_space, start, start, end - start, flags | VM_GLOBAL);
+}
+
+static inline bool acpi_checksum(const void * data, size_t size)
+{
+	uint8_t sum = 0;
+	for(size_t i = 0; i < size; i++)
+	{
+		sum += ((const uint8_t *)data)[i];
+	}
+	return sum == 0;
+}
+
+/* Maps and checks the table at a physical address, NULL if it is not a valid one */
+static inline const acpi_header_t * acpi_table(uint32_t address)
+{
+	const acpi_header_t * table = (const acpi_header_t *)(size_t)address;
+	if(!pci_map(address, sizeof(acpi_header_t), 0) || table->length < sizeof(acpi_header_t) || table->length > ACPI_TABLE_MAX
+		|| !pci_map(address, table->length, 0) || !acpi_checksum(table, table->length))
+	{
+		return NULL;
+	}
+	return table;
+}
+
+/* The RSDT through the root pointer, which SeaBIOS and most other firmware put in the BIOS ROM area. The first KiB of the extended BIOS data area, where the rest may put it, is not searched. */
+static inline const acpi_header_t * acpi_find_rsdt(void)
+{
+	for(size_t address = 0xE0000; address < 0x100000; address += 16)
+	{
+		// the ACPI 1.0 part of the root pointer: signature, checksum, OEM, revision and the RSDT address
+		if(memcmp((const void *)address, "RSD PTR ", 8) == 0 && acpi_checksum((const void *)address, 20))
+		{
+			return acpi_table(*(const uint32_t *)(address + 16));
+		}
+	}
+	return NULL;
+}
+
+static inline void pci_init_ecam(void)
+{
+	const acpi_header_t * rsdt = acpi_find_rsdt();
+	if(rsdt == NULL)
+	{
+		return;
+	}
+	const uint32_t * tables = (const uint32_t *)(rsdt + 1);
+	for(size_t i = 0; i < (rsdt->length - sizeof(acpi_header_t)) / 4; i++)
+	{
+		const acpi_header_t * mcfg = acpi_table(tables[i]);
+		if(mcfg == NULL || memcmp(mcfg->signature, "MCFG", 4) != 0)
+		{
+			continue;
+		}
+		const acpi_mcfg_entry_t * entry = (const acpi_mcfg_entry_t *)((const uint8_t *)(mcfg + 1) + 8);
+		for(; (const uint8_t *)(entry + 1) <= (const uint8_t *)mcfg + mcfg->length; entry++)
+		{
+			if(entry->segment != 0)
+			{
+				continue;
+			}
+			unsigned buses = entry->bus_last - entry->bus_first + 1;
+			buses = buses < PCI_ECAM_BUSES ? buses : PCI_ECAM_BUSES;
+			// the base is that of bus 0 even when the range starts further on
+			uint64_t base = entry->base + (uint64_t)entry->bus_first * PCI_ECAM_BUS_SIZE;
+			if(pci_map(base, buses * PCI_ECAM_BUS_SIZE, VM_WRITE | VM_CACHE_DISABLE))
+			{
+				pci_ecam = base;
+				pci_ecam_bus_first = entry->bus_first;
+				pci_ecam_bus_end = entry->bus_first + buses;
+			}
+			return;
+		}
+	}
+}
+#endif
+
+static inline void pci_init(void)
+{
+#if !HOST
+	pci_init_ecam();
+#endif
+	pci_scan_bus(0);
+}
+#endif
+
+enum
+{
+	// dimensions of the VGA text buffer
+	SCREEN_WIDTH = 80,
+	SCREEN_HEIGHT = 25
+};
+
+static uint8_t screen_x = 0, screen_y = 0, screen_attribute = 0x07;
+// dimensions of the active console in characters
+static uint8_t screen_width = SCREEN_WIDTH, screen_height = SCREEN_HEIGHT;
+
+#if HOST
+// stands in for the VGA text buffer
+static uint16_t host_vram[SCREEN_WIDTH * SCREEN_HEIGHT];
+uint16_t * const screen_buffer = host_vram;
+#elif OS86
+uint16_t far * const screen_buffer = (uint16_t far *)MK_FP(0xB800, 0);
+#elif OS286
+uint16_t far * const screen_buffer = (uint16_t far *)MK_FP(0x0018, 0);
+#else
+uint16_t * const screen_buffer = (uint16_t *)0x000B8000;
+#endif
+
+
+#if FBCON
+# if !(OS386 || OS64)
+#  error The framebuffer console is only available for the 32-bit and 64-bit targets
+# endif
+
+/* Framebuffer console on the Bochs/QEMU display adapter, programmed through its dispi registers without any BIOS or GPU support */
+
+#define PORT_DISPI_INDEX 0x01CE
+#define PORT_DISPI_DATA  0x01CF
+
+#define PORT_VGA_DAC_WRITE_INDEX 0x3C8
+#define PORT_VGA_DAC_DATA        0x3C9
+
+enum
+{
+	DISPI_INDEX_ID = 0,
+	DISPI_INDEX_XRES = 1,
+	DISPI_INDEX_YRES = 2,
+	DISPI_INDEX_BPP = 3,
+	DISPI_INDEX_ENABLE = 4,
+	DISPI_INDEX_VIRT_WIDTH = 6,
+	DISPI_INDEX_VIRT_HEIGHT = 7,
+	DISPI_INDEX_X_OFFSET = 8,
+	DISPI_INDEX_Y_OFFSET = 9,
+
+	DISPI_ID2 = 0xB0C2, // first revision with a linear framebuffer
+	DISPI_ID5 = 0xB0C5,
+
+	DISPI_ENABLED = 0x01,
+	DISPI_LFB_ENABLED = 0x40,
+};
+
+// used when no PCI display adapter reports where its framebuffer is
+#define DISPI_LFB_DEFAULT 0xE0000000
+
+#define PCI_ID_BOCHS_DISPLAY 0x11111234
+
+enum
+{
+	FBCON_GLYPH_WIDTH = 8,
+	FBCON_GLYPH_HEIGHT = 8,
+	FBCON_WIDTH = 1280,
+	FBCON_HEIGHT = 512,
+	FBCON_COLUMNS = FBCON_WIDTH / FBCON_GLYPH_WIDTH,
+	FBCON_ROWS = FBCON_HEIGHT / FBCON_GLYPH_HEIGHT,
+	// 8 bits per pixel, the 16 text attribute colors are loaded into the palette
+	FBCON_PITCH = FBCON_WIDTH,
+};
+
+// the back buffer does not fit into conventional memory, it is placed at 1 MiB
+static uint8_t * const fbcon_back_buffer = (uint8_t *)0x00100000;
+static uint8_t * fbcon_front_buffer;
+static bool fbcon_active;
+// FBCON_COLUMNS * FBCON_ROWS characters with their attributes, on the heap
+static uint16_t * fbcon_cells;
+// each possible glyph row expanded into masks for 8 pixels
+static uint32_t fbcon_row_masks[256][2];
+// the part of the back buffer not yet copied to the screen, in characters, empty when top > bottom
+static uint8_t fbcon_dirty_left, fbcon_dirty_right, fbcon_dirty_top, fbcon_dirty_bottom;
+static uint8_t fbcon_cursor_x, fbcon_cursor_y;
+
+static inline void dispi_write(uint16_t index, uint16_t value)
+{
+	outpw(PORT_DISPI_INDEX, index);
+	outpw(PORT_DISPI_DATA, value);
+}
+
+static inline uint16_t dispi_read(uint16_t index)
+{
+	outpw(PORT_DISPI_INDEX, index);
+	return inpw(PORT_DISPI_DATA);
+}
+
+// size must be a multiple of 4, the buffers may only overlap if dest is below src
+static inline void fbcon_copy(void * dest, const void * src, size_t size)
+{
+	size_t count = size / 4;
+	asm volatile("rep movsl"
+		: "+D"(dest), "+S"(src), "+c"(count)
+		:
+		: "memory");
+}
+
+static inline void fbcon_fill(void * dest, uint32_t value, size_t size)
+{
+	size_t count = size / 4;
+	asm volatile("rep stosl"
+		: "+D"(dest), "+c"(count)
+		: "a"(value)
+		: "memory");
+}
+
+static inline void fbcon_mark_dirty(uint8_t column, uint8_t row)
+{
+	if(column < fbcon_dirty_left)
+		fbcon_dirty_left = column;
+	if(column > fbcon_dirty_right)
+		fbcon_dirty_right = column;
+	if(row < fbcon_dirty_top)
+		fbcon_dirty_top = row;
+	if(row > fbcon_dirty_bottom)
+		fbcon_dirty_bottom = row;
+}
+
+static inline void fbcon_mark_all_dirty(void)
+{
+	fbcon_dirty_left = 0;
+	fbcon_dirty_right = FBCON_COLUMNS - 1;
+	fbcon_dirty_top = 0;
+	fbcon_dirty_bottom = FBCON_ROWS - 1;
+}
+
+static inline void fbcon_draw_cell(uint8_t column, uint8_t row)
+{
+	uint16_t cell = fbcon_cells[row * FBCON_COLUMNS + column];
+	uint8_t c = cell;
+	uint8_t attribute = cell >> 8;
+	const uint8_t * glyph = font8x8[' ' <= c && c <= '~' ? c - ' ' : 0];
+	uint32_t foreground = (attribute & 0x0F) * 0x01010101;
+	uint32_t background = (attribute >> 4) * 0x01010101;
+	uint32_t * pixels = (uint32_t *)(fbcon_back_buffer + row * FBCON_GLYPH_HEIGHT * FBCON_PITCH + column * FBCON_GLYPH_WIDTH);
+	for(int i = 0; i < FBCON_GLYPH_HEIGHT; i++)
+	{
+		const uint32_t * masks = fbcon_row_masks[glyph[i]];
+		pixels[0] = (masks[0] & foreground) | (~masks[0] & background);
+		pixels[1] = (masks[1] & foreground) | (~masks[1] & background);
+		pixels += FBCON_PITCH / sizeof(uint32_t);
+	}
+	fbcon_mark_dirty(column, row);
+}
+
+static inline void fbcon_set_cell(int offset, uint16_t value)
+{
+	fbcon_cells[offset] = value;
+	fbcon_draw_cell(offset % FBCON_COLUMNS, offset / FBCON_COLUMNS);
+}
+
+static inline void fbcon_scroll_lines(int count)
+{
+	if(count > FBCON_ROWS)
+	{
+		count = FBCON_ROWS;
+	}
+	size_t kept = FBCON_ROWS - count;
+	fbcon_copy(fbcon_cells, fbcon_cells + count * FBCON_COLUMNS, kept * FBCON_COLUMNS * sizeof(uint16_t));
+	fbcon_fill(fbcon_cells + kept * FBCON_COLUMNS, ((screen_attribute << 8) | ' ') * 0x00010001u, count * FBCON_COLUMNS * sizeof(uint16_t));
+	fbcon_copy(fbcon_back_buffer, fbcon_back_buffer + count * FBCON_GLYPH_HEIGHT * FBCON_PITCH, kept * FBCON_GLYPH_HEIGHT * FBCON_PITCH);
+	fbcon_fill(fbcon_back_buffer + kept * FBCON_GLYPH_HEIGHT * FBCON_PITCH, (screen_attribute >> 4) * 0x01010101, count * FBCON_GLYPH_HEIGHT * FBCON_PITCH);
+	fbcon_mark_all_dirty();
+}
+
+static inline void fbcon_flush(void)
+{
+	if(fbcon_dirty_top > fbcon_dirty_bottom)
+	{
+		return;
+	}
+
+	size_t offset = fbcon_dirty_top * FBCON_GLYPH_HEIGHT * FBCON_PITCH + fbcon_dirty_left * FBCON_GLYPH_WIDTH;
+	size_t width = (fbcon_dirty_right + 1 - fbcon_dirty_left) * FBCON_GLYPH_WIDTH;
+	size_t lines = (fbcon_dirty_bottom + 1 - fbcon_dirty_top) * FBCON_GLYPH_HEIGHT;
+	if(width == FBCON_PITCH)
+	{
+		// full lines are contiguous, copy them in a single block
+		fbcon_copy(fbcon_front_buffer + offset, fbcon_back_buffer + offset, lines * FBCON_PITCH);
+	}
+	else
+	{
+		for(size_t i = 0; i < lines; i++, offset += FBCON_PITCH)
+		{
+			fbcon_copy(fbcon_front_buffer + offset, fbcon_back_buffer + offset, width);
+		}
+	}
+
+	fbcon_dirty_left = fbcon_dirty_top = 0xFF;
+	fbcon_dirty_right = fbcon_dirty_bottom = 0;
+}
+
+static inline void fbcon_move_cursor(void)
+{
+	// the cursor is only drawn on the screen, flushing the cell under it removes it
+	fbcon_mark_dirty(fbcon_cursor_x, fbcon_cursor_y);
+	fbcon_flush();
+
+	fbcon_cursor_x = screen_x;
+	fbcon_cursor_y = screen_y;
+	uint8_t attribute = fbcon_cells[screen_y * FBCON_COLUMNS + screen_x] >> 8;
+	uint32_t * line = (uint32_t *)(fbcon_front_buffer + ((screen_y + 1) * FBCON_GLYPH_HEIGHT - 1) * FBCON_PITCH + screen_x * FBCON_GLYPH_WIDTH);
+	line[0] = line[1] = (attribute & 0x0F) * 0x01010101;
+}
+
+static inline bool fbcon_init(void)
+{
+	uint16_t id = dispi_read(DISPI_INDEX_ID);
+	if(id < DISPI_ID2 || id > DISPI_ID5)
+	{
+		return false;
+	}
+	fbcon_cells = vm_heap_alloc(FBCON_COLUMNS * FBCON_ROWS * sizeof(uint16_t));
+	if(fbcon_cells == NULL)
+	{
+		return false;
+	}
+
+	uint32_t framebuffer = DISPI_LFB_DEFAULT;
+	const pci_device_t * display = pci_find_id(PCI_ID_BOCHS_DISPLAY);
+	if(display != NULL)
+	{
+		framebuffer = pci_read(display, PCI_CONFIG_BAR0) & 0xFFFFFFF0;
+	}
+
+	dispi_write(DISPI_INDEX_ENABLE, 0);
+	dispi_write(DISPI_INDEX_XRES, FBCON_WIDTH);
+	dispi_write(DISPI_INDEX_YRES, FBCON_HEIGHT);
+	dispi_write(DISPI_INDEX_BPP, 8);
+	dispi_write(DISPI_INDEX_VIRT_WIDTH, FBCON_WIDTH);
+	dispi_write(DISPI_INDEX_VIRT_HEIGHT, FBCON_HEIGHT);
+	dispi_write(DISPI_INDEX_X_OFFSET, 0);
+	dispi_write(DISPI_INDEX_Y_OFFSET, 0);
+	dispi_write(DISPI_INDEX_ENABLE, DISPI_ENABLED | DISPI_LFB_ENABLED);
+
+	// only the first 16 MiB are mapped
+	vm_map(&vm_kernel_space, framebuffer, framebuffer, FBCON_PITCH * FBCON_HEIGHT, VM_WRITE | VM_GLOBAL);
+	fbcon_front_buffer = (uint8_t *)(size_t)framebuffer;
+
+	// load the CGA colors into the palette, the DAC takes 6-bit components
+	outp(PORT_VGA_DAC_WRITE_INDEX, 0);
+	for(int i = 0; i < 16; i++)
+	{
+		uint8_t intensity = i & 8 ? 21 : 0;
+		outp(PORT_VGA_DAC_DATA, (i & 4 ? 42 : 0) + intensity);
+		outp(PORT_VGA_DAC_DATA, (i == 6 ? 21 : i & 2 ? 42 : 0) + intensity);
+		outp(PORT_VGA_DAC_DATA, (i & 1 ? 42 : 0) + intensity);
+	}
+
+	for(int row = 0; row < 256; row++)
+	{
+		for(int i = 0; i < 4; i++)
+		{
+			fbcon_row_masks[row][0] |= row & (0x01 << i) ? 0xFFUL << (i * 8) : 0;
+			fbcon_row_masks[row][1] |= row & (0x10 << i) ? 0xFFUL << (i * 8) : 0;
+		}
+	}
+
+	fbcon_fill(fbcon_cells, ((screen_attribute << 8) | ' ') * 0x00010001u, FBCON_COLUMNS * FBCON_ROWS * sizeof(uint16_t));
+	fbcon_fill(fbcon_back_buffer, (screen_attribute >> 4) * 0x01010101, FBCON_PITCH * FBCON_HEIGHT);
+	fbcon_mark_all_dirty();
+
+	screen_width = FBCON_COLUMNS;
+	screen_height = FBCON_ROWS;
+	screen_x = screen_y = 0;
+	fbcon_active = true;
+	fbcon_move_cursor();
+	return true;
+}
+#endif
+
+static inline void screen_set_word(int offset, uint16_t value)
+{
+#if FBCON
+	if(fbcon_active)
+	{
+		fbcon_set_cell(offset, value);
+		return;
+	}
+#endif
+	screen_buffer[offset] = value;
+}
+
+static inline uint16_t screen_get_word(int offset)
+{
+#if FBCON
+	if(fbcon_active)
+	{
+		return fbcon_cells[offset];
+	}
+#endif
+	return screen_buffer[offset];
+}
+
+static inline void screen_scroll_lines(int count)
+{
+#if FBCON
+	if(fbcon_active)
+	{
+		fbcon_scroll_lines(count);
+		return;
+	}
+#endif
+	if(count > SCREEN_HEIGHT)
+	{
+		count = SCREEN_HEIGHT;
+	}
+#if OS86 || OS286
+	_fmemmove(screen_buffer, screen_buffer + SCREEN_WIDTH * count, SCREEN_WIDTH * (SCREEN_HEIGHT - count) * sizeof(uint16_t));
+#else
+	memmove(screen_buffer, screen_buffer + SCREEN_WIDTH * count, SCREEN_WIDTH * (SCREEN_HEIGHT - count) * sizeof(uint16_t));
+#endif
+	for(int i = 0; i < SCREEN_WIDTH * count; i++)
+	{
+		screen_buffer[i + SCREEN_WIDTH * (SCREEN_HEIGHT - count)] = (screen_attribute << 8) | ' ';
+	}
+}
+
+static inline void screen_move_cursor(void)
+{
+#if FBCON
+	if(fbcon_active)
+	{
+		fbcon_move_cursor();
+		return;
+	}
+#endif
+	uint16_t location = screen_y * SCREEN_WIDTH + screen_x;
+	outp(0x3D4, 0x0E);
+	outp(0x3D5, location >> 8);
+	outp(0x3D4, 0x0F);
+	outp(0x3D5, location);
+}
+
+// updates the buffer and the position without touching the hardware cursor
+static inline void screen_putchar_raw(int c)
+{
+	switch(c)
+	{
+	case '\b':
+		if(screen_x > 0)
+		{
+			screen_x--;
+		}
+		break;
+	case '\t':
+		screen_x = (screen_x + 8) & ~7;
+		break;
+	case '\n':
+		screen_x = 0;
+		screen_y++;
+		break;
+	default:
+		if(' ' <= c && c <= '~')
+		{
+			screen_set_word(screen_y * screen_width + screen_x, (screen_attribute << 8) + (uint8_t)c);
+			screen_x++;
+		}
+		break;
+	}
+	if(screen_x >= screen_width)
+	{
+		screen_y += screen_x / screen_width;
+		screen_x %= screen_width;
+	}
+	if(screen_y >= screen_height)
+	{
+		screen_scroll_lines(screen_y + 1 - screen_height);
+		screen_y = screen_height - 1;
+	}
+}
+
+static inline void screen_putchar(int c)
+{
+	screen_putchar_raw(c);
+	screen_move_cursor();
+}
+
+static inline void screen_write(const char far * text, size_t length)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		screen_putchar_raw((uint8_t)text[i]);
+	}
+	screen_move_cursor();
+}
+
+static inline void screen_putstr(const char far * text)
+{
+	for(int i = 0; text[i] != '\0'; i++)
+	{
+		screen_putchar_raw((uint8_t)text[i]);
+	}
+	screen_move_cursor();
+}
+
+static inline void screen_puthex(size_t value)
+{
+	char buffer[sizeof(value) * 2 + 1];
 	int ptr = sizeof(buffer);
 	buffer[--ptr] = '\0';
 	do
 	{
-		int d = value & 0xF;
-		buffer[--ptr] = d < 10 ? '0' + d : 'A' + d - 10;
-		value >>= 4;
-	} while(value != 0);
-	screen_putstr(&buffer[ptr]);
+		int d = value & 0xF;
+		buffer[--ptr] = d < 10 ? '0' + d : 'A' + d - 10;
+		value >>= 4;
+	} while(value != 0);
+	screen_putstr(&buffer[ptr]);
+}
+
+static inline void screen_putdec(ssize_t value)
+{
+	char buffer[sizeof(unsigned long) * 3 + 2];
+	char * end = buffer + sizeof(buffer) - 1;
+	*end = '\0';
+	// negating in unsigned arithmetic keeps the most negative value intact
+	char * text = kfmt_utoa(end, value < 0 ? -(unsigned long)value : (unsigned long)value);
+	if(value < 0)
+	{
+		*--text = '-';
+	}
+	screen_write(text, end - text);
+}
+
+/* Formats into a stack buffer and hands the result to the console in a single write, longer output is truncated */
+__attribute__((format(printf, 1, 2)))
+static inline void kprintf(const char * format, ...)
+{
+	char buffer[128];
+	va_list args;
+	va_start(args, format);
+	size_t length = kvsnprintf(buffer, sizeof buffer, format, args);
+	va_end(args);
+	length = length < sizeof buffer ? length : sizeof buffer - 1;
+	screen_write(buffer, length);
+	if(kprintf_mirror != NULL)
+	{
+		kprintf_mirror(buffer, length);
+	}
+}
+
+static volatile uint32_t timer_tick;
+// PIT input clocks per timer tick
+static uint16_t timer_interval;
+
+/* clock_read with interrupts already disabled */
+static inline uint32_t clock_read_locked(void)
+{
+	uint32_t tick = timer_tick;
+	outp(PORT_PIT_COMMAND, PIT_CHANNEL0 | PIT_ACCESS_LATCH);
+	uint16_t count = inp(PORT_PIT_DATA0);
+	count |= inp(PORT_PIT_DATA0) << 8;
+	// the counter may have wrapped around with the timer interrupt still pending
+	outp(PORT_PIC1_COMMAND, PIC_READ_IRR);
+	if((inp(PORT_PIC1_COMMAND) & 0x01) != 0 && count > timer_interval / 2)
+	{
+		tick++;
+	}
+	return tick * timer_interval + (timer_interval - count);
+}
+
+/* Returns the number of PIT input clocks (about 0.838 microseconds each) since the timer was started */
+static inline uint32_t clock_read(void)
+{
+	size_t flags = save_and_disable_interrupts();
+	uint32_t clocks = clock_read_locked();
+	restore_interrupts(flags);
+	return clocks;
+}
+
+/* Returns timer_tick, which 16-bit processors load in two halves that the timer interrupt must not come between */
+static inline uint32_t timer_tick_read(void)
+{
+#if OS86 || OS286
+	size_t flags = save_and_disable_interrupts();
+	uint32_t tick = timer_tick;
+	restore_interrupts(flags);
+	return tick;
+#else
+	return timer_tick;
+#endif
+}
+
+static inline uint32_t clock_to_microseconds(uint32_t clocks)
+{
+	// 1000000 / 1193182 is approximately 838 / 1000, split to avoid overflowing 32 bits
+	return clocks / 1000 * 838 + clocks % 1000 * 838 / 1000;
+}
+
+static inline void timer_interrupt_handler(registers_t * registers)
+{
+	(void) registers;
+
+	timer_tick ++;
+
+	screen_x = screen_width - 1;
+	screen_y = 0;
+	screen_attribute = 0x0F;
+	screen_putchar("/-\\|"[timer_tick & 3]);
+}
+
+#if IRQTRACE
+/*
+ * Interrupt latency tracer
+ *
+ * Built with -DIRQTRACE=1, every change of the interrupt flag is timestamped: the explicit ones in the
+ * disable_interrupts family, and the implicit ones through an interrupt gate on the way into interrupt_handler and
+ * through the IRET on the way out. A window runs from the first change to IF=0 until IF=1 again, nested disables
+ * only extend it. The IRQTRACE_WINDOWS longest are kept with the addresses where they began and ended, which are
+ * those of the callers of cli and sti, or the interrupted address for a window opened by an interrupt, and F9 lists
+ * them.
+ *
+ * Times are PIT clocks from clock_read_locked, which leaves the interrupt flag alone so that the tracer does not
+ * trace itself. The stretch from the boot to the first sti is not measured, nor what the BIOS and boot.asm do on
+ * their own.
+ */
+
+enum
+{
+	IRQTRACE_WINDOWS = 8,
+	// the vector of a window opened by cli
+	IRQTRACE_NO_VECTOR = -1,
+};
+
+typedef struct irqtrace_window_t
+{
+	uint32_t clocks;
+	size_t start;
+	size_t end;
+	int16_t vector;
+} irqtrace_window_t;
+
+typedef struct irqtrace_stats_t
+{
+	uint32_t windows;
+	uint32_t total;
+} irqtrace_stats_t;
+
+static bool irqtrace_off;
+// the open window, clocks holding the time it began
+static irqtrace_window_t irqtrace_current;
+static irqtrace_stats_t irqtrace_stats;
+// longest first, the unused ones are zero
+static irqtrace_window_t irqtrace_windows[IRQTRACE_WINDOWS];
+
+static inline void irqtrace_begin(size_t address, int16_t vector)
+{
+	irqtrace_off = true;
+	irqtrace_current.clocks = clock_read_locked();
+	irqtrace_current.start = address;
+	irqtrace_current.vector = vector;
+}
+
+static inline void irqtrace_end(size_t address)
+{
+	if(!irqtrace_off)
+	{
+		return;
+	}
+	irqtrace_off = false;
+	uint32_t clocks = clock_read_locked() - irqtrace_current.clocks;
+	irqtrace_stats.windows++;
+	irqtrace_stats.total += clocks;
+	if(clocks <= irqtrace_windows[IRQTRACE_WINDOWS - 1].clocks)
+	{
+		return;
+	}
+	int i;
+	for(i = IRQTRACE_WINDOWS - 1; i > 0 && irqtrace_windows[i - 1].clocks < clocks; i--)
+	{
+		irqtrace_windows[i] = irqtrace_windows[i - 1];
+	}
+	irqtrace_windows[i] = irqtrace_current;
+	irqtrace_windows[i].clocks = clocks;
+	irqtrace_windows[i].end = address;
+}
+
+// out of line so that the return address lies in the function that changed the flag
+static void irqtrace_disable(void)
+{
+	if(!irqtrace_off)
+	{
+		irqtrace_begin((size_t)__builtin_return_address(0), IRQTRACE_NO_VECTOR);
+	}
+}
+
+static void irqtrace_enable(void)
+{
+	irqtrace_end((size_t)__builtin_return_address(0));
+}
+
+static inline size_t irqtrace_interrupted_address(const registers_t * registers)
+{
+#if OS64
+	return registers->rip;
+#elif OS386
+	return registers->eip;
+#else
+	return registers->ip;
+#endif
+}
+
+static inline void irqtrace_interrupt_entry(const registers_t * registers)
+{
+	// an exception can come with interrupts off already
+	if(irqtrace_off)
+	{
+		return;
+	}
+	irqtrace_begin(irqtrace_interrupted_address(registers), registers->interrupt_number);
+	if(registers->interrupt_number == IRQ0)
+	{
+		// the counter has wrapped around, but timer_tick only counts it once the handler has run
+		irqtrace_current.clocks += timer_interval;
+	}
+}
+
+static inline void irqtrace_interrupt_exit(const registers_t * registers)
+{
+#if OS64
+	size_t flags = registers->rflags;
+#elif OS386
+	size_t flags = registers->eflags;
+#else
+	size_t flags = registers->flags;
+#endif
+	if((flags & FLAGS_IF) != 0)
+	{
+		irqtrace_end(irqtrace_interrupted_address(registers));
+	}
+}
+
+static inline size_t irqtrace_format_window(char * buffer, size_t size, const irqtrace_window_t * window)
+{
+	size_t length = ksnprintf(buffer, size, "us=%lu start=0x%lx end=0x%lx",
+		(unsigned long)clock_to_microseconds(window->clocks), (unsigned long)window->start, (unsigned long)window->end);
+	if(window->vector != IRQTRACE_NO_VECTOR && length < size)
+	{
+		length += ksnprintf(buffer + length, size - length, " interrupt=0x%x", window->vector);
+	}
+	return length;
+}
+
+static inline void irqtrace_report(void)
+{
+	kprintf("interrupts off: windows=%lu total=%luus\n", (unsigned long)irqtrace_stats.windows,
+		(unsigned long)clock_to_microseconds(irqtrace_stats.total));
+	for(int i = 0; i < IRQTRACE_WINDOWS && irqtrace_windows[i].clocks != 0; i++)
+	{
+		char buffer[80];
+		irqtrace_format_window(buffer, sizeof buffer, &irqtrace_windows[i]);
+		kprintf(" %s\n", buffer);
+	}
+}
+#else
+# define irqtrace_interrupt_entry(__registers) ((void) 0)
+# define irqtrace_interrupt_exit(__registers) ((void) 0)
+#endif
+
+/*
+ * Timers
+ *
+ * Software timers on a hierarchical timing wheel of TIMER_LEVELS levels with TIMER_SLOTS slots each, where a slot of
+ * level n spans TIMER_SLOTS^n ticks. A timer goes into the lowest level whose range reaches its expiry, to the slot
+ * given by a shift and a mask of the expiry, and slots are doubly linked lists, so that adding and cancelling a timer
+ * take constant time whatever the number of timers. Every time the level 0 index wraps around, the next slot of
+ * level 1 is cascaded: its timers are put in again relative to the new time and end up one level lower, and so on up
+ * the levels. The level 0 slot of a tick holds exactly the timers expiring then. Expiries beyond the reach of the
+ * wheel are put in the last slot within it, and go around again.
+ *
+ * The timer interrupt only counts ticks. timer_run, called from the main loop, catches the kernel wheel up with
+ * timer_tick and runs the callbacks of the timers that expire on the way, with interrupts enabled. The callbacks may
+ * add timers again, but no timer may be touched from an interrupt handler.
+ */
+
+enum
+{
+	TIMER_LEVELS = 4,
+	TIMER_SLOT_BITS = 6,
+	TIMER_SLOTS = 1 << TIMER_SLOT_BITS,
+	TIMER_SLOT_MASK = TIMER_SLOTS - 1,
+};
+
+// the furthest expiry the wheel reaches, in ticks from the present
+#define TIMER_MAX_DELTA ((1UL << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1)
+
+typedef struct timer_t timer_t;
+
+struct timer_t
+{
+	timer_t * next;
+	// the pointer to this timer in its slot or in the timer before it, NULL while it is not pending
+	timer_t ** link;
+	uint32_t expires;
+	void (* callback)(timer_t * timer);
+};
+
+typedef struct timer_stats_t
+{
+	uint32_t pending;
+	uint32_t expired;
+	// timers moved down a level
+	uint32_t cascaded;
+} timer_stats_t;
+
+typedef struct timer_wheel_t
+{
+	// the next tick to process, the timers of all ticks before it have expired
+	uint32_t now;
+	timer_stats_t stats;
+	timer_t * slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel_t;
+
+// driven by timer_tick
+static timer_wheel_t timers;
+
+static inline void timer_init(timer_t * timer, void (* callback)(timer_t * timer))
+{
+	timer->next = NULL;
+	timer->link = NULL;
+	timer->expires = 0;
+	timer->callback = callback;
+}
+
+static inline bool timer_pending(const timer_t * timer)
+{
+	return timer->link != NULL;
+}
+
+static inline void timer_unlink(timer_t * timer)
+{
+	*timer->link = timer->next;
+	if(timer->next != NULL)
+	{
+		timer->next->link = timer->link;
+	}
+	timer->next = NULL;
+	timer->link = NULL;
+}
+
+static inline void timer_wheel_insert(timer_wheel_t * wheel, timer_t * timer)
+{
+	uint32_t expires = timer->expires;
+	uint32_t delta = expires - wheel->now;
+	timer_t ** slot;
+	if((int32_t)delta < 0)
+	{
+		// already due, expires with the next tick processed
+		slot = &wheel->slots[0][wheel->now & TIMER_SLOT_MASK];
+	}
+	else
+	{
+		if(delta > TIMER_MAX_DELTA)
+		{
+			delta = TIMER_MAX_DELTA;
+			expires = wheel->now + delta;
+		}
+		int level = 0;
+		while(delta >= (uint32_t)TIMER_SLOTS << (level * TIMER_SLOT_BITS))
+		{
+			level++;
+		}
+		slot = &wheel->slots[level][(expires >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK];
+	}
+	timer->next = *slot;
+	if(*slot != NULL)
+	{
+		(*slot)->link = &timer->next;
+	}
+	*slot = timer;
+	timer->link = slot;
+}
+
+/* Sets a timer to expire at a tick, moving it if it is already pending. Returns whether it was. */
+static inline bool timer_wheel_add(timer_wheel_t * wheel, timer_t * timer, uint32_t expires)
+{
+	bool pending = timer_pending(timer);
+	if(pending)
+	{
+		timer_unlink(timer);
+	}
+	else
+	{
+		wheel->stats.pending++;
+	}
+	timer->expires = expires;
+	timer_wheel_insert(wheel, timer);
+	return pending;
+}
+
+/* Stops a timer, returns whether it was pending */
+static inline bool timer_wheel_cancel(timer_wheel_t * wheel, timer_t * timer)
+{
+	if(!timer_pending(timer))
+	{
+		return false;
+	}
+	timer_unlink(timer);
+	wheel->stats.pending--;
+	return true;
+}
+
+/* Puts the timers of the current slot of a level in again one level lower, returns the index of the slot */
+static inline unsigned timer_wheel_cascade(timer_wheel_t * wheel, int level)
+{
+	unsigned index = (wheel->now >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+	timer_t * timer = wheel->slots[level][index];
+	wheel->slots[level][index] = NULL;
+	while(timer != NULL)
+	{
+		timer_t * next = timer->next;
+		timer_wheel_insert(wheel, timer);
+		wheel->stats.cascaded++;
+		timer = next;
+	}
+	return index;
+}
+
+/* Processes the ticks up to and including until and runs the callbacks of the timers expiring in them */
+static inline void timer_wheel_run(timer_wheel_t * wheel, uint32_t until)
+{
+	while((int32_t)(until - wheel->now) >= 0)
+	{
+		if(wheel->stats.pending == 0)
+		{
+			// every slot is empty, there is nothing to cascade or expire on the way
+			wheel->now = until + 1;
+			break;
+		}
+		if((wheel->now & TIMER_SLOT_MASK) == 0)
+		{
+			for(int level = 1; level < TIMER_LEVELS && timer_wheel_cascade(wheel, level) == 0; level++)
+				;
+		}
+
+		// taken off the wheel first, timers added by the callbacks for the present go to the next tick
+		timer_t * expired = wheel->slots[0][wheel->now & TIMER_SLOT_MASK];
+		wheel->slots[0][wheel->now & TIMER_SLOT_MASK] = NULL;
+		if(expired != NULL)
+		{
+			expired->link = &expired;
+		}
+		wheel->now++;
+		// one at a time from the head, a callback may also cancel the timers after its own
+		while(expired != NULL)
+		{
+			timer_t * timer = expired;
+			timer_unlink(timer);
+			wheel->stats.pending--;
+			wheel->stats.expired++;
+			timer->callback(timer);
+		}
+	}
+}
+
+/* Starts a timer that expires in ticks timer ticks */
+static inline void timer_add(timer_t * timer, uint32_t ticks)
+{
+	timer_wheel_add(&timers, timer, timer_tick_read() + ticks);
+}
+
+/* Like timer_add, also returns whether the timer was pending and has been moved */
+static inline bool timer_modify(timer_t * timer, uint32_t ticks)
+{
+	return timer_wheel_add(&timers, timer, timer_tick_read() + ticks);
+}
+
+static inline bool timer_cancel(timer_t * timer)
+{
+	return timer_wheel_cancel(&timers, timer);
+}
+
+/* Runs the timers that have expired since the last call */
+static inline void timer_run(void)
+{
+	timer_wheel_run(&timers, timer_tick_read());
+}
+
+static const struct
+{
+	char normal;
+	char shifted;
+} keyboard_scancode_table[256] =
+{
+	[0x01] = { '\33', '\33' },
+	[0x02] = { '1', '!' },
+	[0x03] = { '2', '@' },
+	[0x04] = { '3', '#' },
+	[0x05] = { '4', '$' },
+	[0x06] = { '5', '%' },
+	[0x07] = { '6', '^' },
+	[0x08] = { '7', '&' },
+	[0x09] = { '8', '*' },
+	[0x0A] = { '9', '(' },
+	[0x0B] = { '0', ')' },
+	[0x0C] = { '-', '_' },
+	[0x0D] = { '=', '+' },
+	[0x0E] = { '\b', '\b' },
+	[0x0F] = { '\t', '\t' },
+	[0x10] = { 'q', 'Q' },
+	[0x11] = { 'w', 'W' },
+	[0x12] = { 'e', 'E' },
+	[0x13] = { 'r', 'R' },
+	[0x14] = { 't', 'T' },
+	[0x15] = { 'y', 'Y' },
+	[0x16] = { 'u', 'U' },
+	[0x17] = { 'i', 'I' },
+	[0x18] = { 'o', 'O' },
+	[0x19] = { 'p', 'P' },
+	[0x1A] = { '[', '{' },
+	[0x1B] = { ']', '}' },
+	[0x1C] = { '\n', '\n' },
+
+	[0x1E] = { 'a', 'A' },
+	[0x1F] = { 's', 'S' },
+	[0x20] = { 'd', 'D' },
+	[0x21] = { 'f', 'F' },
+	[0x22] = { 'g', 'G' },
+	[0x23] = { 'h', 'H' },
+	[0x24] = { 'j', 'J' },
+	[0x25] = { 'k', 'K' },
+	[0x26] = { 'l', 'L' },
+	[0x27] = { ';', ':' },
+	[0x28] = { '\'', '"' },
+	[0x29] = { '`', '~' },
+
+	[0x2B] = { '\\', '|' },
+	[0x2C] = { 'z', 'Z' },
+	[0x2D] = { 'x', 'X' },
+	[0x2E] = { 'c', 'C' },
+	[0x2F] = { 'v', 'V' },
+	[0x30] = { 'b', 'B' },
+	[0x31] = { 'n', 'N' },
+	[0x32] = { 'm', 'M' },
+	[0x33] = { ',', '<' },
+	[0x34] = { '.', '>' },
+	[0x35] = { '/', '?' },
+
+	[0x39] = { ' ', ' ' },
+};
+
+enum
+{
+	INPUT_FLAG_RELEASE = 0x01,
+	INPUT_FLAG_EXTENDED = 0x02,
+
+	INPUT_MODIFIER_SHIFT = 0x01,
+	INPUT_MODIFIER_CTRL = 0x02,
+	INPUT_MODIFIER_ALT = 0x04,
+	INPUT_MODIFIER_CAPS_LOCK = 0x08,
+
+	// keycodes are scancodes without the release bit, with bit 7 set for keys sent after an 0xE0 prefix
+	KEYCODE_EXTENDED = 0x80,
+	KEYCODE_CTRL = 0x1D,
+	KEYCODE_LEFT_SHIFT = 0x2A,
+	KEYCODE_RIGHT_SHIFT = 0x36,
+	KEYCODE_ALT = 0x38,
+	KEYCODE_CAPS_LOCK = 0x3A,
+	KEYCODE_F9 = 0x43,
+	KEYCODE_F10 = 0x44,
+	KEYCODE_F11 = 0x57,
+	KEYCODE_F12 = 0x58,
+	KEYCODE_KEYPAD_ENTER = KEYCODE_EXTENDED | 0x1C,
+	KEYCODE_KEYPAD_SLASH = KEYCODE_EXTENDED | 0x35,
+};
+
+typedef struct input_event_t
+{
+	uint32_t timestamp; // clock_read() when the interrupt arrived
+	uint8_t scancode; // as received, without the 0xE0 prefix
+	uint8_t keycode;
+	uint8_t modifiers; // INPUT_MODIFIER_* after the event took effect
+	uint8_t flags; // INPUT_FLAG_*
+} input_event_t;
+
+#define KEYBOARD_BUFFER_SIZE 32
+DEFINE_RING(input_ring, input_event_t, KEYBOARD_BUFFER_SIZE)
+
+// filled by the keyboard interrupt, drained by the main loop
+static input_ring_t keyboard_buffer;
+static uint8_t keyboard_modifiers;
+static bool keyboard_extended_prefix;
+
+static inline uint8_t keyboard_modifier_for(uint8_t keycode)
+{
+	switch(keycode & ~KEYCODE_EXTENDED)
+	{
+	case KEYCODE_LEFT_SHIFT:
+	case KEYCODE_RIGHT_SHIFT:
+		// 0xE0 0x2A is sent around some extended keys as a fake shift
+		return keycode & KEYCODE_EXTENDED ? 0 : INPUT_MODIFIER_SHIFT;
+	case KEYCODE_CTRL:
+		return INPUT_MODIFIER_CTRL;
+	case KEYCODE_ALT:
+		return INPUT_MODIFIER_ALT;
+	default:
+		return 0;
+	}
+}
+
+static inline void keyboard_interrupt_handler(registers_t * registers)
+{
+	(void) registers;
+
+	input_event_t event;
+	event.timestamp = clock_read();
+	event.scancode = inp(PORT_PS2_DATA);
+
+	screen_x = screen_width - 2;
+	screen_y = 1;
+	screen_attribute = 0x2F;
+	screen_puthex(event.scancode);
+
+	if(event.scancode == 0xE0)
+	{
+		keyboard_extended_prefix = true;
+		return;
+	}
+
+	event.keycode = event.scancode & 0x7F;
+	event.flags = event.scancode & 0x80 ? INPUT_FLAG_RELEASE : 0;
+	if(keyboard_extended_prefix)
+	{
+		event.keycode |= KEYCODE_EXTENDED;
+		event.flags |= INPUT_FLAG_EXTENDED;
+		keyboard_extended_prefix = false;
+	}
+
+	uint8_t modifier = keyboard_modifier_for(event.keycode);
+	if((event.flags & INPUT_FLAG_RELEASE) != 0)
+	{
+		keyboard_modifiers &= ~modifier;
+	}
+	else
+	{
+		keyboard_modifiers |= modifier;
+		if(event.keycode == KEYCODE_CAPS_LOCK)
+		{
+			keyboard_modifiers ^= INPUT_MODIFIER_CAPS_LOCK;
+		}
+	}
+	event.modifiers = keyboard_modifiers;
+
+	input_ring_push(&keyboard_buffer, event);
+}
+
+/*
+ * Block devices
+ *
+ * Disk drivers register their disks here and everything above them goes through block_read and block_write, which
+ * work on BLOCK_SIZE blocks kept in a buffer cache. Buffers are found through a hash of device and block number and
+ * kept on an LRU list, a hit moves the buffer to the front and a miss takes the one at the back.
+ *
+ * Blocks missing from the cache that follow each other in one call are fetched with a single device request of up to
+ * BLOCK_MERGE_MAX blocks through a staging buffer. A miss at the block where the previous device read of a device ended
+ * is taken as sequential access and the request is extended past the blocks asked for by a read-ahead window, which
+ * doubles on every sequential miss and halves whenever read-ahead blocks are evicted without having been used. Runs of
+ * BLOCK_MERGE_MAX missing blocks are read straight into the buffer of the caller instead, so that large reads stream
+ * from the device without a copy and without pushing everything else out of the cache. Buffers the driver cannot
+ * reach, past the buffer_limit of the device, take the staging buffer and a copy.
+ *
+ * Writes only copy into the cache. Dirty buffers are kept in a queue sorted by device and block number, block_sync
+ * writes them back in a single ascending sweep over it and merges adjacent blocks into one request. That happens when
+ * a dirty buffer is about to be reused and when too many are dirty.
+ *
+ * The buffers lie in free memory outside the kernel image: below the boot sector for the 16-bit versions, where near
+ * pointers reach them, and after the framebuffer console back buffer for the others. The in-memory copy of the FAT
+ * follows them.
+ */
+
+enum
+{
+	BLOCK_SIZE = 512,
+#if OS86 || OS286
+	BLOCK_BUFFERS = 32,
+	BLOCK_MERGE_MAX = 8,
+	BLOCK_HASH_SIZE = 64,
+#else
+	BLOCK_BUFFERS = 176,
+	BLOCK_MERGE_MAX = 64,
+	BLOCK_HASH_SIZE = 256,
+#endif
+	BLOCK_DIRTY_LIMIT = BLOCK_BUFFERS / 2,
+	BLOCK_READAHEAD_MIN = 4,
+	BLOCK_DEVICES_MAX = 4,
+	BLOCK_NONE = 0xFFFF,
+	BLOCK_NO_DEVICE = 0xFF,
+
+	BLOCK_FLAG_DIRTY = 0x01,
+	// read ahead and not asked for yet
+	BLOCK_FLAG_READAHEAD = 0x02,
+};
+
+#if OS86 || OS286
+// from the end of the BIOS data area up to the boot sector, the staging buffer follows the cache buffers
+# define BLOCK_CACHE_ADDRESS 0x1000
+#elif !HOST
+# define BLOCK_CACHE_ADDRESS 0x001A0000
+#endif
+
+typedef struct block_device_t block_device_t;
+
+/* Transfers count blocks starting at block, count never exceeds BLOCK_MERGE_MAX */
+typedef bool (* block_transfer_t)(block_device_t * device, uint32_t block, uint16_t count, void * buffer, bool write);
+
+typedef struct block_stats_t
+{
+	// blocks asked for by callers
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t readahead_blocks;
+	uint32_t readahead_hits;
+	// requests passed to the driver
+	uint32_t device_reads;
+	uint32_t device_writes;
+} block_stats_t;
+
+struct block_device_t
+{
+	const char * name;
+	uint32_t blocks;
+	block_transfer_t transfer;
+	bool read_only;
+	// direct reads into the buffer of a caller have to end below this address, 0 if the driver reaches any buffer
+	size_t buffer_limit;
+	// for the driver
+	void * context;
+	// where the last device read ended, and the number of blocks to read ahead on the next sequential miss
+	uint32_t next_block;
+	uint16_t readahead;
+	block_stats_t stats;
+};
+
+typedef struct block_buffer_t
+{
+	uint32_t block;
+	// index in block_devices, BLOCK_NO_DEVICE for unused buffers
+	uint8_t device;
+	uint8_t flags;
+	uint16_t hash_next;
+	uint16_t lru_previous;
+	uint16_t lru_next;
+} block_buffer_t;
+
+static block_device_t block_devices[BLOCK_DEVICES_MAX];
+static uint8_t block_device_count;
+
+static block_buffer_t block_buffers[BLOCK_BUFFERS];
+static uint16_t block_hash[BLOCK_HASH_SIZE];
+// most recently used first
+static uint16_t block_lru_first, block_lru_last;
+// buffer indices, sorted by device and block number
+static uint16_t block_dirty_queue[BLOCK_BUFFERS];
+static uint16_t block_dirty_count;
+
+#if HOST
+static uint8_t block_cache[BLOCK_BUFFERS][BLOCK_SIZE];
+static uint8_t block_staging[BLOCK_MERGE_MAX * BLOCK_SIZE];
+#else
+static uint8_t (* const block_cache)[BLOCK_SIZE] = (uint8_t (*)[BLOCK_SIZE])BLOCK_CACHE_ADDRESS;
+static uint8_t * const block_staging = (uint8_t *)BLOCK_CACHE_ADDRESS + BLOCK_BUFFERS * BLOCK_SIZE;
+#endif
+
+static inline unsigned block_hash_of(uint8_t device, uint32_t block)
+{
+	return (block ^ (uint32_t)device << 5) & (BLOCK_HASH_SIZE - 1);
+}
+
+static inline uint16_t block_lookup(uint8_t device, uint32_t block)
+{
+	uint16_t index = block_hash[block_hash_of(device, block)];
+	while(index != BLOCK_NONE && (block_buffers[index].block != block || block_buffers[index].device != device))
+	{
+		index = block_buffers[index].hash_next;
+	}
+	return index;
+}
+
+static inline void block_hash_insert(uint16_t index)
+{
+	uint16_t * head = &block_hash[block_hash_of(block_buffers[index].device, block_buffers[index].block)];
+	block_buffers[index].hash_next = *head;
+	*head = index;
+}
+
+static inline void block_hash_remove(uint16_t index)
+{
+	uint16_t * link = &block_hash[block_hash_of(block_buffers[index].device, block_buffers[index].block)];
+	while(*link != index)
+	{
+		link = &block_buffers[*link].hash_next;
+	}
+	*link = block_buffers[index].hash_next;
+}
+
+static inline void block_lru_remove(uint16_t index)
+{
+	block_buffer_t * buffer = &block_buffers[index];
+	if(buffer->lru_previous != BLOCK_NONE)
+		block_buffers[buffer->lru_previous].lru_next = buffer->lru_next;
+	else
+		block_lru_first = buffer->lru_next;
+	if(buffer->lru_next != BLOCK_NONE)
+		block_buffers[buffer->lru_next].lru_previous = buffer->lru_previous;
+	else
+		block_lru_last = buffer->lru_previous;
+}
+
+static inline void block_lru_push_front(uint16_t index)
+{
+	block_buffers[index].lru_previous = BLOCK_NONE;
+	block_buffers[index].lru_next = block_lru_first;
+	if(block_lru_first != BLOCK_NONE)
+		block_buffers[block_lru_first].lru_previous = index;
+	else
+		block_lru_last = index;
+	block_lru_first = index;
+}
+
+static inline void block_lru_push_back(uint16_t index)
+{
+	block_buffers[index].lru_next = BLOCK_NONE;
+	block_buffers[index].lru_previous = block_lru_last;
+	if(block_lru_last != BLOCK_NONE)
+		block_buffers[block_lru_last].lru_next = index;
+	else
+		block_lru_first = index;
+	block_lru_last = index;
+}
+
+static inline void block_touch(uint16_t index)
+{
+	if(block_lru_first != index)
+	{
+		block_lru_remove(index);
+		block_lru_push_front(index);
+	}
+}
+
+static inline bool block_queue_before(uint16_t a, uint16_t b)
+{
+	return block_buffers[a].device < block_buffers[b].device
+		|| (block_buffers[a].device == block_buffers[b].device && block_buffers[a].block < block_buffers[b].block);
+}
+
+static inline void block_mark_dirty(uint16_t index)
+{
+	if((block_buffers[index].flags & BLOCK_FLAG_DIRTY) != 0)
+	{
+		return;
+	}
+	block_buffers[index].flags |= BLOCK_FLAG_DIRTY;
+	// writes mostly come in ascending order, so the search starts from the end
+	uint16_t position = block_dirty_count++;
+	while(position > 0 && block_queue_before(index, block_dirty_queue[position - 1]))
+	{
+		block_dirty_queue[position] = block_dirty_queue[position - 1];
+		position--;
+	}
+	block_dirty_queue[position] = index;
+}
+
+/* Writes back all dirty buffers, returns false if any of the writes failed, their buffers stay dirty */
+static inline bool block_sync(void)
+{
+	uint16_t kept = 0;
+	uint16_t position = 0;
+	while(position < block_dirty_count)
+	{
+		uint16_t first = block_dirty_queue[position];
+		block_device_t * device = &block_devices[block_buffers[first].device];
+		uint16_t count = 1;
+		while(position + count < block_dirty_count && count < BLOCK_MERGE_MAX)
+		{
+			block_buffer_t * next = &block_buffers[block_dirty_queue[position + count]];
+			if(next->device != block_buffers[first].device || next->block != block_buffers[first].block + count)
+				break;
+			count++;
+		}
+
+		bool success;
+		if(count == 1)
+		{
+			success = device->transfer(device, block_buffers[first].block, 1, block_cache[first], true);
+		}
+		else
+		{
+			for(uint16_t i = 0; i < count; i++)
+			{
+				memcpy(block_staging + i * BLOCK_SIZE, block_cache[block_dirty_queue[position + i]], BLOCK_SIZE);
+			}
+			success = device->transfer(device, block_buffers[first].block, count, block_staging, true);
+		}
+		device->stats.device_writes++;
+
+		for(uint16_t i = 0; i < count; i++, position++)
+		{
+			if(success)
+				block_buffers[block_dirty_queue[position]].flags &= ~BLOCK_FLAG_DIRTY;
+			else
+				block_dirty_queue[kept++] = block_dirty_queue[position];
+		}
+	}
+	block_dirty_count = kept;
+	return kept == 0;
+}
+
+/* Takes the least recently used buffer off the LRU list and the hash, writing back dirty buffers first */
+static inline uint16_t block_take_buffer(void)
+{
+	uint16_t index = block_lru_last;
+	if((block_buffers[index].flags & BLOCK_FLAG_DIRTY) != 0)
+	{
+		block_sync();
+		// if that failed, the data is lost with the buffer
+		if((block_buffers[index].flags & BLOCK_FLAG_DIRTY) != 0)
+		{
+			block_buffers[index].flags &= ~BLOCK_FLAG_DIRTY;
+			uint16_t position = 0;
+			while(block_dirty_queue[position] != index)
+				position++;
+			block_dirty_count--;
+			memmove(&block_dirty_queue[position], &block_dirty_queue[position + 1], (block_dirty_count - position) * sizeof block_dirty_queue[0]);
+		}
+	}
+	block_lru_remove(index);
+	block_buffer_t * buffer = &block_buffers[index];
+	if(buffer->device != BLOCK_NO_DEVICE)
+	{
+		if((buffer->flags & BLOCK_FLAG_READAHEAD) != 0)
+		{
+			// read ahead for nothing, the window was too large
+			block_devices[buffer->device].readahead /= 2;
+		}
+		block_hash_remove(index);
+		buffer->device = BLOCK_NO_DEVICE;
+	}
+	buffer->flags = 0;
+	return index;
+}
+
+/* Puts a buffer taken with block_take_buffer into the cache, or back to the end of the LRU list without a device */
+static inline void block_give_buffer(uint16_t index, uint8_t device, uint32_t block, uint8_t flags)
+{
+	block_buffers[index].device = device;
+	block_buffers[index].block = block;
+	block_buffers[index].flags = flags;
+	if(device == BLOCK_NO_DEVICE)
+	{
+		block_lru_push_back(index);
+		return;
+	}
+	block_hash_insert(index);
+	block_lru_push_front(index);
+}
+
+/* Reads the missing blocks from block on into the cache with one device request, along with read-ahead */
+static inline bool block_fill(uint8_t number, uint32_t block, uint16_t count)
+{
+	block_device_t * device = &block_devices[number];
+	uint16_t wanted = count;
+	if(block == device->next_block)
+	{
+		device->readahead = device->readahead == 0 ? BLOCK_READAHEAD_MIN
+			: device->readahead < BLOCK_MERGE_MAX ? device->readahead * 2 : BLOCK_MERGE_MAX;
+		while(count < wanted + device->readahead && count < BLOCK_MERGE_MAX
+		&& block + count < device->blocks && block_lookup(number, block + count) == BLOCK_NONE)
+		{
+			count++;
+		}
+	}
+	else
+	{
+		device->readahead = 0;
+	}
+
+	uint16_t indices[BLOCK_MERGE_MAX];
+	for(uint16_t i = 0; i < count; i++)
+	{
+		indices[i] = block_take_buffer();
+	}
+	bool success = device->transfer(device, block, count, block_staging, false);
+	device->stats.device_reads++;
+	for(uint16_t i = 0; i < count; i++)
+	{
+		if(!success)
+		{
+			block_give_buffer(indices[i], BLOCK_NO_DEVICE, 0, 0);
+			continue;
+		}
+		memcpy(block_cache[indices[i]], block_staging + i * BLOCK_SIZE, BLOCK_SIZE);
+		block_give_buffer(indices[i], number, block + i, i < wanted ? 0 : BLOCK_FLAG_READAHEAD);
+	}
+	if(success)
+	{
+		device->next_block = block + count;
+		device->stats.readahead_blocks += count - wanted;
+	}
+	return success;
+}
+
+static inline bool block_check(const block_device_t * device, uint32_t block, uint32_t count)
+{
+	return device != NULL && block <= device->blocks && count <= device->blocks - block;
+}
+
+static inline bool block_read(block_device_t * device, uint32_t block, uint32_t count, void * buffer)
+{
+	if(!block_check(device, block, count))
+	{
+		return false;
+	}
+	uint8_t number = device - block_devices;
+	uint8_t * destination = buffer;
+	while(count > 0)
+	{
+		uint16_t index = block_lookup(number, block);
+		if(index == BLOCK_NONE)
+		{
+			// the blocks missing in a row go in one request
+			uint16_t missing = 1;
+			while(missing < count && missing < BLOCK_MERGE_MAX && block_lookup(number, block + missing) == BLOCK_NONE)
+			{
+				missing++;
+			}
+			device->stats.misses += missing;
+			if(missing == BLOCK_MERGE_MAX)
+			{
+				// none of them are in the cache, so none can be dirty there either
+				bool direct = device->buffer_limit == 0
+					|| ((size_t)destination < device->buffer_limit && device->buffer_limit - (size_t)destination >= (size_t)missing * BLOCK_SIZE);
+				if(!device->transfer(device, block, missing, direct ? destination : block_staging, false))
+				{
+					return false;
+				}
+				if(!direct)
+				{
+					memcpy(destination, block_staging, missing * BLOCK_SIZE);
+				}
+				device->stats.device_reads++;
+				device->stats.reads += missing;
+				device->next_block = block + missing;
+				destination += missing * BLOCK_SIZE;
+				block += missing;
+				count -= missing;
+				continue;
+			}
+			if(!block_fill(number, block, missing))
+			{
+				return false;
+			}
+			// the staging buffer still holds them, looking them up again would count them as hits as well
+			memcpy(destination, block_staging, missing * BLOCK_SIZE);
+			device->stats.reads += missing;
+			destination += missing * BLOCK_SIZE;
+			block += missing;
+			count -= missing;
+			continue;
+		}
+		else
+		{
+			device->stats.hits++;
+			if((block_buffers[index].flags & BLOCK_FLAG_READAHEAD) != 0)
+			{
+				block_buffers[index].flags &= ~BLOCK_FLAG_READAHEAD;
+				device->stats.readahead_hits++;
+			}
+			block_touch(index);
+		}
+		memcpy(destination, block_cache[index], BLOCK_SIZE);
+		device->stats.reads++;
+		destination += BLOCK_SIZE;
+		block++;
+		count--;
+	}
+	return true;
+}
+
+static inline bool block_write(block_device_t * device, uint32_t block, uint32_t count, const void * buffer)
+{
+	if(!block_check(device, block, count) || device->read_only)
+	{
+		return false;
+	}
+	uint8_t number = device - block_devices;
+	const uint8_t * source = buffer;
+	while(count > 0)
+	{
+		// whole blocks are overwritten, nothing has to be read first
+		uint16_t index = block_lookup(number, block);
+		if(index == BLOCK_NONE)
+		{
+			index = block_take_buffer();
+			block_give_buffer(index, number, block, 0);
+		}
+		else
+		{
+			block_buffers[index].flags &= ~BLOCK_FLAG_READAHEAD;
+			block_touch(index);
+		}
+		memcpy(block_cache[index], source, BLOCK_SIZE);
+		block_mark_dirty(index);
+		device->stats.writes++;
+		source += BLOCK_SIZE;
+		block++;
+		count--;
+	}
+	if(block_dirty_count > BLOCK_DIRTY_LIMIT)
+	{
+		return block_sync();
+	}
+	return true;
+}
+
+static inline block_device_t * block_register(const char * name, uint32_t blocks, block_transfer_t transfer, bool read_only, void * context)
+{
+	if(block_device_count == BLOCK_DEVICES_MAX)
+	{
+		return NULL;
+	}
+	block_device_t * device = &block_devices[block_device_count++];
+	device->name = name;
+	device->blocks = blocks;
+	device->transfer = transfer;
+	device->read_only = read_only;
+	device->buffer_limit = 0;
+	device->context = context;
+	device->next_block = 0;
+	device->readahead = 0;
+	return device;
+}
+
+static inline block_device_t * block_find(const char * name)
+{
+	for(uint8_t i = 0; i < block_device_count; i++)
+	{
+		if(strcmp(block_devices[i].name, name) == 0)
+		{
+			return &block_devices[i];
+		}
+	}
+	return NULL;
+}
+
+static inline void block_init(void)
+{
+	for(unsigned i = 0; i < BLOCK_HASH_SIZE; i++)
+	{
+		block_hash[i] = BLOCK_NONE;
+	}
+	block_lru_first = block_lru_last = BLOCK_NONE;
+	for(uint16_t i = 0; i < BLOCK_BUFFERS; i++)
+	{
+		block_give_buffer(i, BLOCK_NO_DEVICE, 0, 0);
+	}
+}
+
+static inline uint32_t block_percent(uint32_t part, uint32_t total)
+{
+	if(total == 0)
+		return 0;
+	// without overflowing the multiplication
+	return total < 0x01000000 ? part * 100 / total : part / (total / 100);
+}
+
+/* One line of statistics, operations saved are the requests a driver would have seen for single blocks without the cache */
+static inline size_t block_format_stats(char * buffer, size_t size, const block_device_t * device)
+{
+	const block_stats_t * stats = &device->stats;
+	return ksnprintf(buffer, size, "%s: reads=%lu writes=%lu hit_rate=%lu%% readahead=%lu/%lu device_ops=%lu saved=%lu",
+		device->name,
+		(unsigned long)stats->reads,
+		(unsigned long)stats->writes,
+		(unsigned long)block_percent(stats->hits, stats->hits + stats->misses),
+		(unsigned long)stats->readahead_hits,
+		(unsigned long)stats->readahead_blocks,
+		(unsigned long)(stats->device_reads + stats->device_writes),
+		(unsigned long)(stats->reads + stats->writes - stats->device_reads - stats->device_writes));
+}
+
+static inline void block_report(void)
+{
+	char buffer[128];
+	for(uint8_t i = 0; i < block_device_count; i++)
+	{
+		block_format_stats(buffer, sizeof buffer, &block_devices[i]);
+		kprintf("%s\n", buffer);
+	}
+}
+
+#if OS86
+/*
+ * Unreal mode
+ *
+ * Real mode reaches memory through 64 KiB segments and ends at 1 MiB. On a 386 or later, unreal_enter in boot.asm
+ * switches to protected mode just long enough to load the data segment registers with a flat 4 GiB segment and goes
+ * back to real mode. Loading a segment register in real mode only changes its base, so the limit stays and 32-bit
+ * offsets from segment 0 then reach all of memory, while 16-bit code, the interrupt handlers and the BIOS keep working
+ * as before. unreal_copy moves blocks between linear addresses that way, four bytes per step with a single string
+ * instruction, instead of normalizing far pointers for every 64 KiB.
+ *
+ * The BIOS may switch modes itself and come back with 64 KiB limits, unreal mode is entered again before the next
+ * copy after any BIOS call. The 8086 and the 286 copy through far pointers instead, below 1 MiB only.
+ */
+
+// the end of the memory real mode can address without unreal mode
+#define UNREAL_REAL_MODE_END 0x100000UL
+
+enum
+{
+	// the boot sector signature, which is compared with its alias at 1 MiB to find out whether A20 is enabled
+	UNREAL_A20_PROBE = 0x7DFE,
+	// the largest step of the far pointer copies
+	UNREAL_FAR_STEP = 0x8000,
+};
+
+typedef struct unreal_stats_t
+{
+	uint32_t copies;
+	// times unreal mode had to be entered again after a BIOS call
+	uint32_t reloads;
+} unreal_stats_t;
+
+// in boot.asm
+extern void unreal_enter(void);
+extern void unreal_movs(uint32_t destination, uint32_t source, uint32_t size);
+
+static bool unreal_available;
+// set by every BIOS call
+static bool unreal_stale;
+static unreal_stats_t unreal_stats;
+
+/* Whether the processor is a 386 or later: the 8086 keeps bits 12 to 15 of FLAGS set, the 286 clears them in real mode */
+static inline bool unreal_cpu_386(void)
+{
+	uint16_t flags;
+	asm volatile(
+		"pushfw\n\t"
+		"pushfw\n\t"
+		"popw\t%0\n\t"
+		"andw\t$0x0FFF, %0\n\t"
+		"orw\t$0x7000, %0\n\t"
+		"pushw\t%0\n\t"
+		"popfw\n\t"
+		"pushfw\n\t"
+		"popw\t%0\n\t"
+		"popfw"
+		: "=r"(flags) : : "cc");
+	return (flags & 0xF000) == 0x7000;
+}
+
+/* Whether the address lines above 1 MiB work, otherwise FFFF:x + 0x10 wraps around to 0:x */
+static inline bool unreal_a20_enabled(void)
+{
+	volatile uint16_t far * low = (volatile uint16_t far *)MK_FP(0, UNREAL_A20_PROBE);
+	volatile uint16_t far * high = (volatile uint16_t far *)MK_FP(0xFFFF, UNREAL_A20_PROBE + 0x10);
+	uint16_t saved = *low;
+	*low = ~*high;
+	bool enabled = *high != *low;
+	*low = saved;
+	return enabled;
+}
+
+/* Enables A20 if the BIOS has not done so and enters unreal mode, must be called with interrupts disabled */
+static inline void unreal_init(void)
+{
+	if(!unreal_cpu_386())
+	{
+		return;
+	}
+	if(!unreal_a20_enabled())
+	{
+		outp(PORT_SYSTEM_CONTROL_A, inp(PORT_SYSTEM_CONTROL_A) | SYSTEM_CONTROL_A_A20);
+		if(!unreal_a20_enabled())
+		{
+			return;
+		}
+	}
+	unreal_enter();
+	unreal_available = true;
+}
+
+/* Copies size bytes between linear addresses, forwards. Returns false if one of the ranges is out of reach. */
+static inline bool unreal_copy(uint32_t destination, uint32_t source, uint32_t size)
+{
+	unreal_stats.copies++;
+	if(unreal_available)
+	{
+		if(unreal_stale)
+		{
+			unreal_stale = false;
+			unreal_enter();
+			unreal_stats.reloads++;
+		}
+		unreal_movs(destination, source, size);
+		return true;
+	}
+
+	if(destination >= UNREAL_REAL_MODE_END || UNREAL_REAL_MODE_END - destination < size
+	|| source >= UNREAL_REAL_MODE_END || UNREAL_REAL_MODE_END - source < size)
+	{
+		return false;
+	}
+	while(size > 0)
+	{
+		uint16_t count = size < UNREAL_FAR_STEP ? size : UNREAL_FAR_STEP;
+		_fmemcpy(MK_FP(destination >> 4, destination & 0xF), MK_FP(source >> 4, source & 0xF), count);
+		destination += count;
+		source += count;
+		size -= count;
+	}
+	return true;
+}
+#endif
+
+#if OS86
+/*
+ * BIOS disks
+ *
+ * The real mode build has no disk drivers of its own and goes through INT 13h, one request per track like the boot
+ * sector. kmain puts its own handlers on every interrupt vector, the BIOS entry point is saved before that and called
+ * with a far call after pushing the flags. The BIOS floppy code waits for its IRQ 6 handler to set a flag in the BIOS
+ * data area, which the kernel handler has to do in its place.
+ */
+
+enum
+{
+	BIOS_DISK_RESET = 0x00,
+	BIOS_DISK_READ = 0x02,
+	BIOS_DISK_WRITE = 0x03,
+	BIOS_DISK_PARAMETERS = 0x08,
+	BIOS_DISK_ATTEMPTS = 3,
+
+	BIOS_DISK_FLOPPY = 0x00,
+	BIOS_DISK_HARD_DISK = 0x80,
+};
+
+#define BDA_FLOPPY_RECALIBRATE_STATUS 0x043E
+#define BDA_FLOPPY_INTERRUPT          0x80
+
+typedef struct bios_disk_t
+{
+	uint8_t drive;
+	uint8_t heads;
+	uint8_t sectors_per_track;
+} bios_disk_t;
+
+// offset and segment of the BIOS INT 13h handler
+static uint32_t bios_disk_vector;
+static bios_disk_t bios_disks[2];
+
+static inline void bios_disk_interrupt_handler(registers_t * registers)
+{
+	(void) registers;
+
+	*(volatile uint8_t *)MK_FP(0, BDA_FLOPPY_RECALIBRATE_STATUS) |= BDA_FLOPPY_INTERRUPT;
+}
+
+/* Calls INT 13h, returns the status in AH, 0 on success */
+static inline uint8_t bios_disk_call(uint16_t * ax, uint16_t * cx, uint16_t * dx, void * buffer)
+{
+	uint16_t bx = (size_t)buffer;
+	__asm__ volatile(
+		// the parameter function changes ES:DI
+		"pushw\t%%es\n\t"
+		"pushfw\n\t"
+		"lcallw\t*%4\n\t"
+		"popw\t%%es\n\t"
+		"jnc\t1f\n\t"
+		"testb\t%%ah, %%ah\n\t"
+		"jnz\t2f\n\t"
+		"movb\t$0xFF, %%ah\n\t"
+		"jmp\t2f\n"
+		"1:\n\t"
+		"movb\t$0, %%ah\n"
+		"2:"
+		: "+a"(*ax), "+b"(bx), "+c"(*cx), "+d"(*dx)
+		: "m"(bios_disk_vector)
+		: "si", "di", "cc", "memory");
+	// the BIOS may have left protected mode with 64 KiB segment limits
+	unreal_stale = true;
+	return *ax >> 8;
+}
+
+static bool bios_disk_transfer(block_device_t * device, uint32_t block, uint16_t count, void * buffer, bool write)
+{
+	const bios_disk_t * disk = device->context;
+	uint8_t * pointer = buffer;
+	while(count > 0)
+	{
+		uint16_t sector = block % disk->sectors_per_track;
+		uint32_t track = block / disk->sectors_per_track;
+		uint16_t head = track % disk->heads;
+		uint16_t cylinder = track / disk->heads;
+		uint16_t sectors = disk->sectors_per_track - sector;
+		if(sectors > count)
+		{
+			sectors = count;
+		}
+
+		int attempt = 0;
+		for(;;)
+		{
+			uint16_t ax = (write ? BIOS_DISK_WRITE : BIOS_DISK_READ) << 8 | sectors;
+			uint16_t cx = (cylinder & 0xFF) << 8 | (cylinder >> 2 & 0xC0) | (sector + 1);
+			uint16_t dx = head << 8 | disk->drive;
+			if(bios_disk_call(&ax, &cx, &dx, pointer) == 0)
+				break;
+			if(++attempt == BIOS_DISK_ATTEMPTS)
+				return false;
+			ax = BIOS_DISK_RESET << 8;
+			dx = disk->drive;
+			bios_disk_call(&ax, &cx, &dx, NULL);
+		}
+
+		pointer += sectors * BLOCK_SIZE;
+		block += sectors;
+		count -= sectors;
+	}
+	return true;
+}
+
+static inline void bios_disk_register(bios_disk_t * disk, uint8_t drive, const char * name)
+{
+	uint16_t ax = BIOS_DISK_PARAMETERS << 8;
+	uint16_t cx = 0;
+	uint16_t dx = drive;
+	if(bios_disk_call(&ax, &cx, &dx, NULL) != 0 || (cx & 0x3F) == 0)
+	{
+		return;
+	}
+	disk->drive = drive;
+	disk->heads = (dx >> 8) + 1;
+	disk->sectors_per_track = cx & 0x3F;
+	uint16_t cylinders = ((cx >> 8) | (cx & 0xC0) << 2) + 1;
+	block_register(name, (uint32_t)cylinders * disk->heads * disk->sectors_per_track, bios_disk_transfer, false, disk);
+}
+
+static inline void bios_disk_init(void)
+{
+	bios_disk_register(&bios_disks[0], BIOS_DISK_FLOPPY, "fd0");
+	bios_disk_register(&bios_disks[1], BIOS_DISK_HARD_DISK, "hd0");
+}
+#endif
+
+#if HOST
+// a floppy image loaded by host.c, NULL without one
+extern const uint8_t * host_floppy;
+extern uint32_t host_floppy_blocks;
+
+static bool host_floppy_transfer(block_device_t * device, uint32_t block, uint16_t count, void * buffer, bool write)
+{
+	(void) device;
+
+	if(write)
+	{
+		return false;
+	}
+	memcpy(buffer, host_floppy + block * BLOCK_SIZE, count * BLOCK_SIZE);
+	return true;
+}
+
+/* Stands in for the floppy driver, the image becomes a read only fd0 */
+static inline void host_floppy_init(void)
+{
+	if(host_floppy != NULL)
+	{
+		block_register("fd0", host_floppy_blocks, host_floppy_transfer, true, NULL);
+	}
+}
+#endif
+
+#if !OS86 && !HOST
+/*
+ * Floppy disk
+ *
+ * The 82077 controller in drive 0, a 1.44 MB disk, transfers through ISA DMA channel 2 and completions through IRQ6.
+ * Reads always fetch a whole cylinder, both tracks of it in a single multi-track command, straight into a slot of the
+ * cylinder cache, and requests are copied out of the cache. The slots lie between the framebuffer console back buffer
+ * and the page frames, below 16 MiB as ISA DMA requires and three to each 64 KiB so that none crosses a DMA boundary.
+ * The 286 copies from them through a window of the segment allocator. The motor stops on a timer once the drive has
+ * been idle for a while.
+ *
+ * The real mode build still has the BIOS for disk access. The disk is registered as block device fd0, read only.
+ */
+
+enum
+{
+	FLOPPY_SECTOR_SIZE = 512,
+	FLOPPY_SECTORS_PER_TRACK = 18,
+	FLOPPY_HEADS = 2,
+	FLOPPY_CYLINDERS = 80,
+	FLOPPY_SECTORS_PER_CYLINDER = FLOPPY_SECTORS_PER_TRACK * FLOPPY_HEADS,
+	FLOPPY_SECTORS = FLOPPY_SECTORS_PER_CYLINDER * FLOPPY_CYLINDERS,
+	FLOPPY_CYLINDER_SIZE = FLOPPY_SECTORS_PER_CYLINDER * FLOPPY_SECTOR_SIZE,
+
+	FLOPPY_CACHE_SLOTS = 12,
+	FLOPPY_SLOTS_PER_64K = 3,
+	FLOPPY_ATTEMPTS = 3,
+	// timer ticks the motor keeps turning after the last read, like the BIOS does
+	FLOPPY_MOTOR_IDLE = 40,
+
+	// the type of the first drive in the upper nibble
+	CMOS_FLOPPY_TYPES = 0x10,
+	CMOS_FLOPPY_1440K = 0x4,
+
+	FDC_DOR_DRIVE0 = 0x00,
+	FDC_DOR_NOT_RESET = 0x04,
+	FDC_DOR_DMA_IRQ = 0x08,
+	FDC_DOR_MOTOR0 = 0x10,
+
+	FDC_MSR_DIO = 0x40, // set when the controller has data for the processor
+	FDC_MSR_RQM = 0x80,
+
+	FDC_CCR_500KBPS = 0x00,
+
+	FDC_COMMAND_SPECIFY = 0x03,
+	FDC_COMMAND_READ_DATA = 0x06,
+	FDC_COMMAND_RECALIBRATE = 0x07,
+	FDC_COMMAND_SENSE_INTERRUPT = 0x08,
+	FDC_COMMAND_SEEK = 0x0F,
+	FDC_COMMAND_MFM = 0x40,
+	FDC_COMMAND_MULTI_TRACK = 0x80,
+
+	FDC_ST0_INTERRUPT_CODE = 0xC0,
+	FDC_ST0_ABNORMAL = 0x40,
+	FDC_ST1_END_OF_CYLINDER = 0x80,
+
+	// 512 byte sectors, gap length for 3.5" 1.44 MB disks
+	FDC_SECTOR_SIZE_CODE = 2,
+	FDC_GAP_LENGTH = 0x1B,
+};
+
+#define FLOPPY_CACHE_ADDRESS 0x001C0000
+// PIT clocks to wait for the controller, and for the motor to come up to speed
+#define FLOPPY_TIMEOUT (PIT_FREQUENCY / 2)
+#define FLOPPY_SPIN_UP (PIT_FREQUENCY * 3 / 10)
+
+typedef struct floppy_slot_t
+{
+	// -1 if the slot is empty
+	int8_t cylinder;
+	uint16_t last_used;
+} floppy_slot_t;
+
+static bool floppy_present;
+static bool floppy_motor_on;
+static timer_t floppy_motor_timer;
+static volatile bool floppy_interrupt_received;
+// where the head is, -1 if unknown
+static int8_t floppy_cylinder = -1;
+static floppy_slot_t floppy_slots[FLOPPY_CACHE_SLOTS];
+static uint16_t floppy_use_counter;
+static uint32_t floppy_cache_hits, floppy_cache_misses;
+
+static inline void floppy_interrupt_handler(registers_t * registers)
+{
+	(void) registers;
+
+	floppy_interrupt_received = true;
+}
+
+static inline uint32_t floppy_slot_address(unsigned slot)
+{
+	return FLOPPY_CACHE_ADDRESS + (uint32_t)(slot / FLOPPY_SLOTS_PER_64K) * 0x10000 + (slot % FLOPPY_SLOTS_PER_64K) * FLOPPY_CYLINDER_SIZE;
+}
+
+static inline const uint8_t far * floppy_slot_data(unsigned slot)
+{
+#if OS286
+	return (const uint8_t far *)segment_window(floppy_slot_address(slot), FLOPPY_CYLINDER_SIZE);
+#else
+	return (const uint8_t *)(size_t)floppy_slot_address(slot);
+#endif
+}
+
+static inline void dma2_start_write(uint32_t address, uint16_t size)
+{
+	outp(PORT_DMA_MASK, DMA_MASK_ON | 2);
+	outp(PORT_DMA_FLIP_FLOP, 0xFF);
+	outp(PORT_DMA2_ADDRESS, address & 0xFF);
+	outp(PORT_DMA2_ADDRESS, (address >> 8) & 0xFF);
+	outp(PORT_DMA2_PAGE, address >> 16);
+	outp(PORT_DMA_FLIP_FLOP, 0xFF);
+	outp(PORT_DMA2_COUNT, (size - 1) & 0xFF);
+	outp(PORT_DMA2_COUNT, (size - 1) >> 8);
+	outp(PORT_DMA_MODE, DMA_MODE_SINGLE | DMA_MODE_WRITE | 2);
+	outp(PORT_DMA_MASK, 2);
+}
+
+static inline bool floppy_wait_ready(uint8_t direction)
+{
+	uint32_t start = clock_read();
+	for(;;)
+	{
+		uint8_t status = inp(PORT_FDC_MAIN_STATUS);
+		if((status & FDC_MSR_RQM) != 0)
+		{
+			return (status & FDC_MSR_DIO) == direction;
+		}
+		if(clock_read() - start > FLOPPY_TIMEOUT)
+		{
+			return false;
+		}
+	}
+}
+
+static inline bool floppy_send(const uint8_t * bytes, int count)
+{
+	for(int i = 0; i < count; i++)
+	{
+		if(!floppy_wait_ready(0))
+		{
+			return false;
+		}
+		outp(PORT_FDC_FIFO, bytes[i]);
+	}
+	return true;
+}
+
+static inline bool floppy_receive(uint8_t * bytes, int count)
+{
+	for(int i = 0; i < count; i++)
+	{
+		if(!floppy_wait_ready(FDC_MSR_DIO))
+		{
+			return false;
+		}
+		bytes[i] = inp(PORT_FDC_FIFO);
+	}
+	return true;
+}
+
+static inline bool floppy_wait_interrupt(void)
+{
+	uint32_t start = clock_read();
+	while(!floppy_interrupt_received)
+	{
+		if(clock_read() - start > FLOPPY_TIMEOUT)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Sends a command that completes with an interrupt, the interrupt flag is cleared before the first byte goes out */
+static inline bool floppy_command(const uint8_t * bytes, int count)
+{
+	floppy_interrupt_received = false;
+	return floppy_send(bytes, count) && floppy_wait_interrupt();
+}
+
+static inline bool floppy_sense_interrupt(uint8_t * st0, uint8_t * cylinder)
+{
+	uint8_t command = FDC_COMMAND_SENSE_INTERRUPT;
+	uint8_t result[2];
+	if(!floppy_send(&command, 1) || !floppy_receive(result, 2))
+	{
+		return false;
+	}
+	*st0 = result[0];
+	*cylinder = result[1];
+	return true;
+}
+
+static inline bool floppy_seek(uint8_t cylinder)
+{
+	uint8_t st0, position;
+	if(cylinder == 0)
+	{
+		const uint8_t command[] = { FDC_COMMAND_RECALIBRATE, 0 };
+		if(!floppy_command(command, sizeof command))
+			return false;
+	}
+	else
+	{
+		const uint8_t command[] = { FDC_COMMAND_SEEK, 0, cylinder };
+		if(!floppy_command(command, sizeof command))
+			return false;
+	}
+	if(!floppy_sense_interrupt(&st0, &position) || (st0 & FDC_ST0_INTERRUPT_CODE) != 0 || position != cylinder)
+	{
+		floppy_cylinder = -1;
+		return false;
+	}
+	floppy_cylinder = cylinder;
+	return true;
+}
+
+static inline bool floppy_reset(void)
+{
+	outp(PORT_FDC_DIGITAL_OUTPUT, 0);
+	io_wait();
+	floppy_interrupt_received = false;
+	outp(PORT_FDC_DIGITAL_OUTPUT, FDC_DOR_DRIVE0 | FDC_DOR_NOT_RESET | FDC_DOR_DMA_IRQ | (floppy_motor_on ? FDC_DOR_MOTOR0 : 0));
+	if(!floppy_wait_interrupt())
+	{
+		return false;
+	}
+	// one status per drive after a reset
+	for(int i = 0; i < 4; i++)
+	{
+		uint8_t st0, cylinder;
+		if(!floppy_sense_interrupt(&st0, &cylinder))
+			return false;
+	}
+	outp(PORT_FDC_CONFIG_CONTROL, FDC_CCR_500KBPS);
+	// 3 ms step rate, 240 ms head unload, 2 ms head load and DMA mode
+	const uint8_t specify[] = { FDC_COMMAND_SPECIFY, 0xDF, 0x02 };
+	if(!floppy_send(specify, sizeof specify))
+	{
+		return false;
+	}
+	floppy_cylinder = -1;
+	return true;
+}
+
+static inline void floppy_start_motor(void)
+{
+	if(floppy_motor_on)
+	{
+		return;
+	}
+	floppy_motor_on = true;
+	outp(PORT_FDC_DIGITAL_OUTPUT, FDC_DOR_DRIVE0 | FDC_DOR_NOT_RESET | FDC_DOR_DMA_IRQ | FDC_DOR_MOTOR0);
+	uint32_t start = clock_read();
+	while(clock_read() - start < FLOPPY_SPIN_UP)
+		;
+}
+
+static void floppy_stop_motor(timer_t * timer)
+{
+	(void) timer;
+
+	floppy_motor_on = false;
+	outp(PORT_FDC_DIGITAL_OUTPUT, FDC_DOR_DRIVE0 | FDC_DOR_NOT_RESET | FDC_DOR_DMA_IRQ);
+}
+
+/* Reads both tracks of a cylinder into a cache slot */
+static inline bool floppy_read_cylinder(unsigned slot, uint8_t cylinder)
+{
+	floppy_start_motor();
+	// timers only run from the main loop, not before the read is over
+	timer_modify(&floppy_motor_timer, FLOPPY_MOTOR_IDLE);
+	for(int attempt = 0; attempt < FLOPPY_ATTEMPTS; attempt++)
+	{
+		if(floppy_cylinder != cylinder && !floppy_seek(cylinder))
+		{
+			floppy_reset();
+			continue;
+		}
+
+		dma2_start_write(floppy_slot_address(slot), FLOPPY_CYLINDER_SIZE);
+		const uint8_t command[] =
+		{
+			FDC_COMMAND_READ_DATA | FDC_COMMAND_MFM | FDC_COMMAND_MULTI_TRACK,
+			0, // head 0, drive 0
+			cylinder, 0, 1,
+			FDC_SECTOR_SIZE_CODE, FLOPPY_SECTORS_PER_TRACK, FDC_GAP_LENGTH, 0xFF
+		};
+		uint8_t result[7];
+		if(!floppy_command(command, sizeof command) || !floppy_receive(result, sizeof result))
+		{
+			floppy_reset();
+			continue;
+		}
+		// the last sector of the cylinder may be reported as running into its end together with the terminal count
+		if((result[0] & FDC_ST0_INTERRUPT_CODE) == 0
+		|| ((result[0] & FDC_ST0_INTERRUPT_CODE) == FDC_ST0_ABNORMAL && result[1] == FDC_ST1_END_OF_CYLINDER && result[2] == 0))
+		{
+			return true;
+		}
+		// recalibrate before trying again
+		floppy_seek(0);
+	}
+	return false;
+}
+
+/* Finds the cache slot holding a cylinder, reading it into the least recently used slot on a miss. Returns -1 on errors. */
+static inline int floppy_cache_get(uint8_t cylinder)
+{
+	unsigned victim = 0;
+	for(unsigned slot = 0; slot < FLOPPY_CACHE_SLOTS; slot++)
+	{
+		if(floppy_slots[slot].cylinder == cylinder)
+		{
+			floppy_slots[slot].last_used = ++floppy_use_counter;
+			floppy_cache_hits++;
+			return slot;
+		}
+		// empty slots first, then the oldest, compared by age since the counter may wrap around
+		if(floppy_slots[victim].cylinder >= 0 && (floppy_slots[slot].cylinder < 0
+		|| (uint16_t)(floppy_use_counter - floppy_slots[slot].last_used) > (uint16_t)(floppy_use_counter - floppy_slots[victim].last_used)))
+		{
+			victim = slot;
+		}
+	}
+
+	floppy_cache_misses++;
+	floppy_slots[victim].cylinder = -1;
+	if(!floppy_read_cylinder(victim, cylinder))
+	{
+		return -1;
+	}
+	floppy_slots[victim].cylinder = cylinder;
+	floppy_slots[victim].last_used = ++floppy_use_counter;
+	return victim;
+}
+
+static inline void floppy_cache_invalidate(void)
+{
+	for(unsigned slot = 0; slot < FLOPPY_CACHE_SLOTS; slot++)
+	{
+		floppy_slots[slot].cylinder = -1;
+	}
+}
+
+/* Reads count sectors starting at lba, returns false on errors or if the range goes past the end of the disk */
+static inline bool floppy_read(uint32_t lba, uint16_t count, void * buffer)
+{
+	if(!floppy_present || lba > FLOPPY_SECTORS || count > FLOPPY_SECTORS - lba)
+	{
+		return false;
+	}
+	uint8_t * destination = buffer;
+	while(count > 0)
+	{
+		uint8_t cylinder = lba / FLOPPY_SECTORS_PER_CYLINDER;
+		uint16_t first = lba % FLOPPY_SECTORS_PER_CYLINDER;
+		uint16_t sectors = FLOPPY_SECTORS_PER_CYLINDER - first;
+		if(sectors > count)
+		{
+			sectors = count;
+		}
+		int slot = floppy_cache_get(cylinder);
+		if(slot < 0)
+		{
+			return false;
+		}
+		size_t size = (size_t)sectors * FLOPPY_SECTOR_SIZE;
+#if OS286
+		_fmemcpy(destination, floppy_slot_data(slot) + first * FLOPPY_SECTOR_SIZE, size);
+#else
+		memcpy(destination, floppy_slot_data(slot) + first * FLOPPY_SECTOR_SIZE, size);
+#endif
+		destination += size;
+		lba += sectors;
+		count -= sectors;
+	}
+	return true;
+}
+
+static bool floppy_block_transfer(block_device_t * device, uint32_t block, uint16_t count, void * buffer, bool write)
+{
+	(void) device;
+
+	return !write && floppy_read(block, count, buffer);
+}
+
+static inline void floppy_init(void)
+{
+	floppy_cache_invalidate();
+	timer_init(&floppy_motor_timer, floppy_stop_motor);
+	outp(PORT_CMOS_INDEX, CMOS_FLOPPY_TYPES);
+	if((inp(PORT_CMOS_DATA) >> 4) != CMOS_FLOPPY_1440K)
+	{
+		return;
+	}
+	floppy_present = floppy_reset();
+	if(floppy_present)
+	{
+		block_register("fd0", FLOPPY_SECTORS, floppy_block_transfer, true, NULL);
+	}
+}
+#endif
+
+#if !OS86 && !HOST
+/*
+ * ATA disk
+ *
+ * The master drive on the primary channel, typically the -hda image under QEMU. Transfers are in LBA mode, with the
+ * 48-bit commands when the range needs them, and complete through IRQ14: the processor sleeps in HLT until the
+ * interrupt handler has read the status, instead of spinning on the status register.
+ *
+ * PIO transfers use READ/WRITE MULTIPLE, which raise one interrupt per block of sectors, each block moved with a
+ * single REP INSW/INSD or OUTSW/OUTSD. On the 32-bit and 64-bit targets, a PCI IDE controller capable of bus
+ * mastering is used for DMA instead: the buffer is described by a PRD table and the drive only interrupts at the end.
+ */
+
+enum
+{
+	ATA_SECTOR_SIZE = 512,
+	// per command, the sector count register of the 28-bit commands takes 0 for 256
+	ATA_MAX_SECTORS = 256,
+	// timer ticks
+	ATA_TIMEOUT = 20,
+
+	ATA_STATUS_ERR = 0x01,
+	ATA_STATUS_DRQ = 0x08,
+	ATA_STATUS_DF = 0x20,
+	ATA_STATUS_DRDY = 0x40,
+	ATA_STATUS_BSY = 0x80,
+
+	ATA_DRIVE_LBA = 0xE0, // LBA addressing, master drive, with the obsolete bits set
+
+	ATA_COMMAND_READ_SECTORS = 0x20,
+	ATA_COMMAND_READ_SECTORS_EXT = 0x24,
+	ATA_COMMAND_READ_DMA_EXT = 0x25,
+	ATA_COMMAND_READ_MULTIPLE_EXT = 0x29,
+	ATA_COMMAND_WRITE_SECTORS = 0x30,
+	ATA_COMMAND_WRITE_SECTORS_EXT = 0x34,
+	ATA_COMMAND_WRITE_DMA_EXT = 0x35,
+	ATA_COMMAND_WRITE_MULTIPLE_EXT = 0x39,
+	ATA_COMMAND_READ_MULTIPLE = 0xC4,
+	ATA_COMMAND_WRITE_MULTIPLE = 0xC5,
+	ATA_COMMAND_SET_MULTIPLE = 0xC6,
+	ATA_COMMAND_READ_DMA = 0xC8,
+	ATA_COMMAND_WRITE_DMA = 0xCA,
+	ATA_COMMAND_FLUSH_CACHE = 0xE7,
+	ATA_COMMAND_FLUSH_CACHE_EXT = 0xEA,
+	ATA_COMMAND_IDENTIFY = 0xEC,
+
+	// word offsets in the IDENTIFY data
+	ATA_IDENTIFY_MULTIPLE_MAX = 47,
+	ATA_IDENTIFY_SECTORS = 60,
+	ATA_IDENTIFY_CAPABILITIES = 49,
+	ATA_IDENTIFY_COMMAND_SETS = 83,
+	ATA_IDENTIFY_SECTORS_48 = 100,
+
+	ATA_CAPABILITY_DMA = 0x0100,
+	ATA_COMMAND_SET_LBA48 = 0x0400,
+};
+
+typedef enum ata_mode_t
+{
+	ATA_MODE_PIO,
+	ATA_MODE_DMA,
+} ata_mode_t;
+
+static bool ata_present;
+static bool ata_lba48;
+// sectors per interrupt of READ/WRITE MULTIPLE, 0 if the drive only transfers single sectors
+static uint8_t ata_multiple;
+static uint32_t ata_sectors;
+static volatile bool ata_interrupt_received;
+static volatile uint8_t ata_interrupt_status;
+
+#if OS386 || OS64
+enum
+{
+	PCI_CLASS_IDE = 0x0101,
+	PCI_IDE_BUS_MASTER = 0x80, // in the programming interface
+
+	// register offsets from the bus master base, the primary channel comes first
+	ATA_BM_COMMAND = 0,
+	ATA_BM_STATUS = 2,
+	ATA_BM_PRD_TABLE = 4,
+
+	ATA_BM_COMMAND_START = 0x01,
+	ATA_BM_COMMAND_TO_MEMORY = 0x08,
+	ATA_BM_STATUS_ERROR = 0x02,
+	ATA_BM_STATUS_INTERRUPT = 0x04,
+
+	// a transfer of ATA_MAX_SECTORS crosses at most two 64 KiB boundaries
+	ATA_PRD_ENTRIES = 4,
+	ATA_PRD_LAST = 0x8000,
+};
+
+typedef struct ata_prd_t
+{
+	uint32_t address;
+	uint16_t size; // 0 for 64 KiB
+	uint16_t flags;
+} ata_prd_t;
+
+// may not cross a 64 KiB boundary, which the alignment to its own size ensures
+static ata_prd_t ata_prd_table[ATA_PRD_ENTRIES] __attribute__((aligned(sizeof(ata_prd_t) * ATA_PRD_ENTRIES)));
+// I/O port of the bus master registers, 0 without a usable controller
+static uint16_t ata_bus_master;
+#endif
+
+static inline void ata_interrupt_handler(registers_t * registers)
+{
+	(void) registers;
+
+	// reading the status register acknowledges the interrupt
+	ata_interrupt_status = inp(PORT_ATA1_COMMAND);
+#if OS386 || OS64
+	if(ata_bus_master != 0)
+	{
+		outp(ata_bus_master + ATA_BM_STATUS, inp(ata_bus_master + ATA_BM_STATUS) | ATA_BM_STATUS_INTERRUPT);
+	}
+#endif
+	ata_interrupt_received = true;
+}
+
+/* Sleeps until the interrupt handler reports the drive, must be called with interrupts enabled */
+static inline bool ata_wait_interrupt(void)
+{
+	uint32_t start = timer_tick;
+	for(;;)
+	{
+		disable_interrupts();
+		if(ata_interrupt_received)
+		{
+			enable_interrupts();
+			return (ata_interrupt_status & (ATA_STATUS_ERR | ATA_STATUS_DF)) == 0;
+		}
+		if(timer_tick - start > ATA_TIMEOUT)
+		{
+			enable_interrupts();
+			return false;
+		}
+		// STI takes effect after the next instruction, the interrupt cannot arrive between the check and HLT
+		irqtrace_enable();
+		asm volatile("sti\n\thlt" : : : "memory");
+	}
+}
+
+/* Polls the alternate status, which does not acknowledge interrupts, until the bits in mask read as value */
+static inline bool ata_poll(uint8_t mask, uint8_t value)
+{
+	uint32_t start = timer_tick;
+	for(;;)
+	{
+		uint8_t status = inp(PORT_ATA1_CONTROL);
+		if((status & ATA_STATUS_BSY) == 0 && (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) != 0)
+		{
+			return false;
+		}
+		if((status & mask) == value)
+		{
+			return true;
+		}
+		if(timer_tick - start > ATA_TIMEOUT)
+		{
+			return false;
+		}
+	}
+}
+
+/* Issues a command, switching to its 48-bit variant if one is given and the range needs it */
+static inline bool ata_command(uint8_t command, uint8_t command48, uint32_t lba, uint16_t count)
+{
+	if(!ata_poll(ATA_STATUS_BSY | ATA_STATUS_DRDY, ATA_STATUS_DRDY))
+	{
+		return false;
+	}
+
+	bool lba48 = command48 != 0 && ata_lba48 && (count > ATA_MAX_SECTORS || lba + count > 0x0FFFFFFF);
+	ata_interrupt_received = false;
+	if(lba48)
+	{
+		outp(PORT_ATA1_DRIVE, ATA_DRIVE_LBA);
+		// the high bytes go first, each register keeps the previous value written to it
+		outp(PORT_ATA1_SECTOR_COUNT, count >> 8);
+		outp(PORT_ATA1_LBA_LOW, lba >> 24);
+		outp(PORT_ATA1_LBA_MID, 0);
+		outp(PORT_ATA1_LBA_HIGH, 0);
+		command = command48;
+	}
+	else
+	{
+		outp(PORT_ATA1_DRIVE, ATA_DRIVE_LBA | ((lba >> 24) & 0x0F));
+	}
+	outp(PORT_ATA1_SECTOR_COUNT, count & 0xFF);
+	outp(PORT_ATA1_LBA_LOW, lba & 0xFF);
+	outp(PORT_ATA1_LBA_MID, (lba >> 8) & 0xFF);
+	outp(PORT_ATA1_LBA_HIGH, (lba >> 16) & 0xFF);
+	outp(PORT_ATA1_COMMAND, command);
+	return true;
+}
+
+static inline void ata_read_block(void * buffer, uint16_t sectors)
+{
+#if OS386 || OS64
+	inpsl(PORT_ATA1_DATA, buffer, sectors * (ATA_SECTOR_SIZE / 4));
+#else
+	inpsw(PORT_ATA1_DATA, buffer, sectors * (ATA_SECTOR_SIZE / 2));
+#endif
+}
+
+static inline void ata_write_block(const void * buffer, uint16_t sectors)
+{
+#if OS386 || OS64
+	outpsl(PORT_ATA1_DATA, buffer, sectors * (ATA_SECTOR_SIZE / 4));
+#else
+	outpsw(PORT_ATA1_DATA, buffer, sectors * (ATA_SECTOR_SIZE / 2));
+#endif
+}
+
+/* Transfers up to ATA_MAX_SECTORS through the data port, one interrupt per block */
+static inline bool ata_transfer_pio(uint32_t lba, uint16_t count, void * buffer, bool write)
+{
+	uint8_t block = ata_multiple != 0 ? ata_multiple : 1;
+	uint8_t command, command48;
+	if(ata_multiple != 0)
+	{
+		command = write ? ATA_COMMAND_WRITE_MULTIPLE : ATA_COMMAND_READ_MULTIPLE;
+		command48 = write ? ATA_COMMAND_WRITE_MULTIPLE_EXT : ATA_COMMAND_READ_MULTIPLE_EXT;
+	}
+	else
+	{
+		command = write ? ATA_COMMAND_WRITE_SECTORS : ATA_COMMAND_READ_SECTORS;
+		command48 = write ? ATA_COMMAND_WRITE_SECTORS_EXT : ATA_COMMAND_READ_SECTORS_EXT;
+	}
+	if(!ata_command(command, command48, lba, count))
+	{
+		return false;
+	}
+
+	uint8_t * pointer = buffer;
+	// the drive asks for the first block to write without an interrupt
+	if(write && !ata_poll(ATA_STATUS_BSY | ATA_STATUS_DRQ, ATA_STATUS_DRQ))
+	{
+		return false;
+	}
+	while(count > 0)
+	{
+		uint16_t sectors = count < block ? count : block;
+		if(write)
+		{
+			ata_interrupt_received = false;
+			ata_write_block(pointer, sectors);
+			if(!ata_wait_interrupt())
+				return false;
+		}
+		else
+		{
+			if(!ata_wait_interrupt())
+				return false;
+			// the interrupt for the next block can only come once this one has been read
+			ata_interrupt_received = false;
+			ata_read_block(pointer, sectors);
+		}
+		pointer += sectors * ATA_SECTOR_SIZE;
+		count -= sectors;
+	}
+	return true;
+}
+
+#if OS386 || OS64
+/* Transfers up to ATA_MAX_SECTORS by bus mastering, the buffer has to be in the identity mapped memory */
+static inline bool ata_transfer_dma(uint32_t lba, uint16_t count, void * buffer, bool write)
+{
+	size_t address = (size_t)buffer;
+	size_t end = address + (size_t)count * ATA_SECTOR_SIZE;
+	if(ata_bus_master == 0 || end > VM_IDENTITY_SIZE)
+	{
+		return false;
+	}
+	int entries = 0;
+	while(address < end)
+	{
+		size_t boundary = (address | 0xFFFF) + 1;
+		size_t size = (boundary < end ? boundary : end) - address;
+		ata_prd_table[entries].address = address;
+		ata_prd_table[entries].size = size;
+		ata_prd_table[entries].flags = 0;
+		entries++;
+		address += size;
+	}
+	ata_prd_table[entries - 1].flags = ATA_PRD_LAST;
+
+	outp(ata_bus_master + ATA_BM_COMMAND, 0);
+	outpl(ata_bus_master + ATA_BM_PRD_TABLE, (size_t)ata_prd_table);
+	// the error and interrupt bits are cleared by writing them back
+	outp(ata_bus_master + ATA_BM_STATUS, ATA_BM_STATUS_ERROR | ATA_BM_STATUS_INTERRUPT);
+	outp(ata_bus_master + ATA_BM_COMMAND, write ? 0 : ATA_BM_COMMAND_TO_MEMORY);
+	if(!ata_command(write ? ATA_COMMAND_WRITE_DMA : ATA_COMMAND_READ_DMA, write ? ATA_COMMAND_WRITE_DMA_EXT : ATA_COMMAND_READ_DMA_EXT, lba, count))
+	{
+		return false;
+	}
+	outp(ata_bus_master + ATA_BM_COMMAND, (write ? 0 : ATA_BM_COMMAND_TO_MEMORY) | ATA_BM_COMMAND_START);
+	bool success = ata_wait_interrupt();
+	outp(ata_bus_master + ATA_BM_COMMAND, 0);
+	return success && (inp(ata_bus_master + ATA_BM_STATUS) & ATA_BM_STATUS_ERROR) == 0;
+}
+#endif
+
+static inline bool ata_transfer(ata_mode_t mode, uint32_t lba, uint32_t count, void * buffer, bool write)
+{
+	if(!ata_present || lba > ata_sectors || count > ata_sectors - lba)
+	{
+		return false;
+	}
+#if OS286
+	// no bus master DMA without PCI configuration access
+	(void) mode;
+#endif
+	uint8_t * pointer = buffer;
+	while(count > 0)
+	{
+		uint16_t sectors = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+		bool success;
+#if OS386 || OS64
+		if(mode == ATA_MODE_DMA)
+			success = ata_transfer_dma(lba, sectors, pointer, write);
+		else
+#endif
+			success = ata_transfer_pio(lba, sectors, pointer, write);
+		if(!success)
+		{
+			return false;
+		}
+		pointer += (size_t)sectors * ATA_SECTOR_SIZE;
+		lba += sectors;
+		count -= sectors;
+	}
+	return true;
+}
+
+/* The mode for a buffer, DMA whenever the controller and the buffer allow it */
+static inline ata_mode_t ata_mode_for(const void * buffer, uint32_t count)
+{
+#if OS386 || OS64
+	if(ata_bus_master != 0 && (size_t)buffer + count * ATA_SECTOR_SIZE <= VM_IDENTITY_SIZE)
+	{
+		return ATA_MODE_DMA;
+	}
+#else
+	(void) buffer;
+	(void) count;
+#endif
+	return ATA_MODE_PIO;
+}
+
+static inline bool ata_read(uint32_t lba, uint32_t count, void * buffer)
+{
+	return ata_transfer(ata_mode_for(buffer, count), lba, count, buffer, false);
+}
+
+static inline bool ata_write(uint32_t lba, uint32_t count, const void * buffer)
+{
+	return ata_transfer(ata_mode_for(buffer, count), lba, count, (void *)buffer, true);
+}
+
+/* Makes sure the data written so far is on the medium, not only in the cache of the drive */
+static inline bool ata_flush(void)
+{
+	return ata_present
+		&& ata_command(ata_lba48 ? ATA_COMMAND_FLUSH_CACHE_EXT : ATA_COMMAND_FLUSH_CACHE, 0, 0, 0)
+		&& ata_wait_interrupt();
+}
+
+static bool ata_block_transfer(block_device_t * device, uint32_t block, uint16_t count, void * buffer, bool write)
+{
+	(void) device;
+
+	return write ? ata_write(block, count, buffer) : ata_read(block, count, buffer);
+}
+
+#if OS386 || OS64
+static inline void ata_init_bus_master(void)
+{
+	const pci_device_t * controller = pci_find_class((uint32_t)PCI_CLASS_IDE << 16 | PCI_IDE_BUS_MASTER << 8, 0xFFFF0000 | PCI_IDE_BUS_MASTER << 8);
+	if(controller == NULL)
+	{
+		return;
+	}
+	uint32_t bar4 = pci_read(controller, PCI_CONFIG_BAR4);
+	// an I/O space BAR
+	if((bar4 & 1) == 0 || (bar4 & 0xFFFC) == 0)
+	{
+		return;
+	}
+	pci_enable(controller, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+	ata_bus_master = bar4 & 0xFFFC;
+}
+#endif
+
+static inline void ata_init(void)
+{
+	// nothing answers on a floating bus
+	if(inp(PORT_ATA1_COMMAND) == 0xFF)
+	{
+		return;
+	}
+	// interrupts enabled
+	outp(PORT_ATA1_CONTROL, 0);
+	outp(PORT_ATA1_DRIVE, ATA_DRIVE_LBA);
+	if(!ata_poll(ATA_STATUS_BSY, 0))
+	{
+		return;
+	}
+
+	static uint16_t identify[ATA_SECTOR_SIZE / 2];
+	ata_interrupt_received = false;
+	outp(PORT_ATA1_COMMAND, ATA_COMMAND_IDENTIFY);
+	// ATAPI devices and missing drives abort the command
+	if(inp(PORT_ATA1_CONTROL) == 0 || !ata_wait_interrupt())
+	{
+		return;
+	}
+	ata_interrupt_received = false;
+	inpsw(PORT_ATA1_DATA, identify, ATA_SECTOR_SIZE / 2);
+
+	ata_lba48 = (identify[ATA_IDENTIFY_COMMAND_SETS] & ATA_COMMAND_SET_LBA48) != 0;
+	if(ata_lba48 && (identify[ATA_IDENTIFY_SECTORS_48 + 2] != 0 || identify[ATA_IDENTIFY_SECTORS_48 + 3] != 0))
+	{
+		// the 32-bit block numbers used here reach 2 TiB
+		ata_sectors = 0xFFFFFFFF;
+	}
+	else if(ata_lba48)
+	{
+		ata_sectors = identify[ATA_IDENTIFY_SECTORS_48] | (uint32_t)identify[ATA_IDENTIFY_SECTORS_48 + 1] << 16;
+	}
+	else
+	{
+		ata_sectors = identify[ATA_IDENTIFY_SECTORS] | (uint32_t)identify[ATA_IDENTIFY_SECTORS + 1] << 16;
+	}
+	ata_present = true;
+
+	uint8_t multiple = identify[ATA_IDENTIFY_MULTIPLE_MAX] & 0xFF;
+	if(multiple != 0 && ata_command(ATA_COMMAND_SET_MULTIPLE, 0, 0, multiple) && ata_wait_interrupt())
+	{
+		ata_multiple = multiple;
+	}
+
+#if OS386 || OS64
+	if((identify[ATA_IDENTIFY_CAPABILITIES] & ATA_CAPABILITY_DMA) != 0)
+	{
+		ata_init_bus_master();
+	}
+#endif
+	block_register("hd0", ata_sectors, ata_block_transfer, false, NULL);
+}
+#endif
+
+#if (OS386 || OS64) && !HOST
+/*
+ * virtio
+ *
+ * The legacy interface of the transitional virtio PCI devices that QEMU attaches by default: registers in an I/O BAR
+ * and split virtqueues, each in consecutive frames. A request is a chain of descriptors, the buffers the device reads
+ * first and then those it writes, and buffers have to be in the identity mapped memory.
+ *
+ * virtq_add only puts chains in the available ring, virtq_notify then makes a whole batch of them available at once
+ * and notifies the device, unless it said it is still going through the ring anyway. Completions are waited for on
+ * the interrupt, or polled with the interrupt suppressed, which saves the round trip through the interrupt
+ * controller on short requests.
+ */
+
+enum
+{
+	// legacy registers in the I/O BAR, the device configuration follows them when MSI-X is off
+	VIRTIO_DEVICE_FEATURES = 0x00,
+	VIRTIO_DRIVER_FEATURES = 0x04,
+	VIRTIO_QUEUE_ADDRESS = 0x08, // in 4 KiB pages
+	VIRTIO_QUEUE_SIZE = 0x0C,
+	VIRTIO_QUEUE_SELECT = 0x0E,
+	VIRTIO_QUEUE_NOTIFY = 0x10,
+	VIRTIO_DEVICE_STATUS = 0x12,
+	VIRTIO_ISR_STATUS = 0x13, // reading it acknowledges the interrupt
+	VIRTIO_DEVICE_CONFIG = 0x14,
+
+	VIRTIO_STATUS_ACKNOWLEDGE = 0x01,
+	VIRTIO_STATUS_DRIVER = 0x02,
+	VIRTIO_STATUS_DRIVER_OK = 0x04,
+	VIRTIO_STATUS_FAILED = 0x80,
+
+	// the legacy layout puts the used ring on the next page boundary after the available ring
+	VIRTQ_ALIGN = 0x1000,
+	VIRTQ_SIZE_MAX = 1024,
+	VIRTQ_DESC_F_NEXT = 1,
+	VIRTQ_DESC_F_WRITE = 2, // written by the device
+	VIRTQ_AVAIL_F_NO_INTERRUPT = 1,
+	VIRTQ_USED_F_NO_NOTIFY = 1,
+
+	// timer ticks
+	VIRTIO_TIMEOUT = 20,
+};
+
+typedef struct virtq_desc_t
+{
+	uint64_t address;
+	uint32_t size;
+	uint16_t flags;
+	uint16_t next;
+} virtq_desc_t;
+
+typedef struct virtq_avail_t
+{
+	uint16_t flags;
+	volatile uint16_t index;
+	uint16_t ring[];
+} virtq_avail_t;
+
+typedef struct virtq_used_t
+{
+	volatile uint16_t flags;
+	volatile uint16_t index;
+	struct
+	{
+		uint32_t id;
+		uint32_t size;
+	} ring[];
+} virtq_used_t;
+
+typedef struct virtio_segment_t
+{
+	void * buffer;
+	uint32_t size;
+} virtio_segment_t;
+
+typedef struct virtq_t
+{
+	// I/O port of the device and the number of the queue
+	uint16_t port;
+	uint16_t number;
+	uint16_t size;
+	virtq_desc_t * descriptors;
+	virtq_avail_t * avail;
+	virtq_used_t * used;
+	// unused descriptors are chained through their next fields
+	uint16_t free_head;
+	uint16_t free_count;
+	// used ring entries already taken off
+	uint16_t used_seen;
+	// chains added but not made available yet, and those the device has not given back
+	uint16_t pending;
+	uint16_t in_flight;
+	uint32_t notifications;
+} virtq_t;
+
+/* Also orders the stores to the rings before the load of the used ring flags, which x86 does not do by itself */
+static inline void virtio_fence(void)
+{
+	uint32_t dummy = 0;
+	asm volatile("lock; orl\t$0, %0" : "+m"(dummy) : : "memory");
+}
+
+/* Resets the device, goes through the handshake and accepts the features it has out of those given, returns its I/O port or 0 */
+static inline uint16_t virtio_reset(const pci_device_t * device, uint32_t features, uint32_t * accepted)
+{
+	uint32_t bar0 = pci_read(device, PCI_CONFIG_BAR0);
+	if((bar0 & 1) == 0)
+	{
+		return 0;
+	}
+	uint16_t port = bar0 & 0xFFFC;
+	pci_enable(device, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+	outp(port + VIRTIO_DEVICE_STATUS, 0);
+	outp(port + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	outp(port + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+	*accepted = inpl(port + VIRTIO_DEVICE_FEATURES) & features;
+	outpl(port + VIRTIO_DRIVER_FEATURES, *accepted);
+	return port;
+}
+
+static inline void virtio_ready(uint16_t port, bool success)
+{
+	outp(port + VIRTIO_DEVICE_STATUS, success ? VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK : VIRTIO_STATUS_FAILED);
+}
+
+/* Sets up queue number of the device, whose size the device decides, false if it is unusable or there is no memory */
+static inline bool virtq_init(virtq_t * queue, uint16_t port, uint16_t number, uint16_t size_min)
+{
+	outpw(port + VIRTIO_QUEUE_SELECT, number);
+	uint16_t size = inpw(port + VIRTIO_QUEUE_SIZE);
+	if(size < size_min || size > VIRTQ_SIZE_MAX || (size & (size - 1)) != 0)
+	{
+		return false;
+	}
+	size_t used_offset = ((size_t)size * (sizeof(virtq_desc_t) + 2) + 4 + VIRTQ_ALIGN - 1) & ~(size_t)(VIRTQ_ALIGN - 1);
+	size_t memory = vm_frames_alloc((used_offset + 4 + (size_t)size * 8 + VM_PAGE_SIZE - 1) / VM_PAGE_SIZE);
+	if(memory == 0)
+	{
+		return false;
+	}
+	queue->port = port;
+	queue->number = number;
+	queue->size = size;
+	queue->descriptors = (virtq_desc_t *)memory;
+	queue->avail = (virtq_avail_t *)(memory + size * sizeof(virtq_desc_t));
+	queue->used = (virtq_used_t *)(memory + used_offset);
+	for(uint16_t i = 0; i < size; i++)
+	{
+		queue->descriptors[i].next = i + 1;
+	}
+	queue->free_count = size;
+	outpl(port + VIRTIO_QUEUE_ADDRESS, memory / VIRTQ_ALIGN);
+	return true;
+}
+
+/* Adds a chain of the out segments the device reads followed by the in ones it writes, returns its head descriptor or -1 if the queue is full */
+static inline int virtq_add(virtq_t * queue, const virtio_segment_t * segments, unsigned out, unsigned in)
+{
+	unsigned count = out + in;
+	if(count == 0 || count > queue->free_count)
+	{
+		return -1;
+	}
+	uint16_t head = queue->free_head;
+	uint16_t index = head;
+	virtq_desc_t * descriptor = NULL;
+	for(unsigned i = 0; i < count; i++)
+	{
+		descriptor = &queue->descriptors[index];
+		descriptor->address = (size_t)segments[i].buffer;
+		descriptor->size = segments[i].size;
+		descriptor->flags = (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0) | (i >= out ? VIRTQ_DESC_F_WRITE : 0);
+		index = descriptor->next;
+	}
+	queue->free_head = index;
+	queue->free_count -= count;
+	queue->avail->ring[(uint16_t)(queue->avail->index + queue->pending) & (queue->size - 1)] = head;
+	queue->pending++;
+	return head;
+}
+
+/* Makes the added chains available and notifies the device if it asks for it */
+static inline void virtq_notify(virtq_t * queue, bool interrupt)
+{
+	if(queue->pending == 0)
+	{
+		return;
+	}
+	queue->avail->flags = interrupt ? 0 : VIRTQ_AVAIL_F_NO_INTERRUPT;
+	ring_barrier();
+	queue->avail->index += queue->pending;
+	queue->in_flight += queue->pending;
+	queue->pending = 0;
+	virtio_fence();
+	if((queue->used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0)
+	{
+		outpw(queue->port + VIRTIO_QUEUE_NOTIFY, queue->number);
+		queue->notifications++;
+	}
+}
+
+/* Takes the next chain the device is done with off the used ring and frees its descriptors, false if there is none */
+static inline bool virtq_next(virtq_t * queue, uint16_t * head, uint32_t * size)
+{
+	if(queue->used_seen == queue->used->index)
+	{
+		return false;
+	}
+	ring_barrier();
+	*head = queue->used->ring[queue->used_seen & (queue->size - 1)].id;
+	*size = queue->used->ring[queue->used_seen & (queue->size - 1)].size;
+	uint16_t last = *head;
+	uint16_t count = 1;
+	while((queue->descriptors[last].flags & VIRTQ_DESC_F_NEXT) != 0)
+	{
+		last = queue->descriptors[last].next;
+		count++;
+	}
+	queue->descriptors[last].next = queue->free_head;
+	queue->free_head = *head;
+	queue->free_count += count;
+	queue->used_seen++;
+	queue->in_flight--;
+	return true;
+}
+
+/* Sleeps until the device gives a chain back if interrupt is set, false once VIRTIO_TIMEOUT ticks have passed since start */
+static inline bool virtq_wait(virtq_t * queue, bool interrupt, uint32_t start)
+{
+	if(timer_tick - start > VIRTIO_TIMEOUT)
+	{
+		return false;
+	}
+	if(interrupt)
+	{
+		disable_interrupts();
+		if(queue->used_seen == queue->used->index)
+		{
+			// STI takes effect after the next instruction, the interrupt cannot arrive between the check and HLT
+			irqtrace_enable();
+			asm volatile("sti\n\thlt" : : : "memory");
+		}
+		enable_interrupts();
+	}
+	return true;
+}
+
+/*
+ * virtio block device
+ *
+ * The single request queue of a virtio-blk device, as attached by -drive if=virtio. A request is a chain of its
+ * header, the data in as many segments as the device takes, and the status byte the device writes back.
+ * virtio_blk_submit queues requests and virtio_blk_complete sends them off as one batch and waits for all of them.
+ */
+
+enum
+{
+	PCI_ID_VIRTIO_BLK = 0x10011AF4,
+
+	// in the device configuration
+	VIRTIO_BLK_CAPACITY = VIRTIO_DEVICE_CONFIG + 0x00, // 64-bit, in sectors
+	VIRTIO_BLK_SIZE_MAX = VIRTIO_DEVICE_CONFIG + 0x08,
+	VIRTIO_BLK_SEG_MAX = VIRTIO_DEVICE_CONFIG + 0x0C,
+
+	VIRTIO_BLK_F_SIZE_MAX = 1 << 1,
+	VIRTIO_BLK_F_SEG_MAX = 1 << 2,
+	VIRTIO_BLK_F_RO = 1 << 5,
+
+	VIRTIO_BLK_T_IN = 0,
+	VIRTIO_BLK_T_OUT = 1,
+	VIRTIO_BLK_S_OK = 0,
+	VIRTIO_BLK_SECTOR_SIZE = 512,
+	// data segments per request, the header and the status take two more descriptors
+	VIRTIO_BLK_SEGMENTS = 16,
+	VIRTIO_BLK_REQUEST_MAX = 0x10000,
+};
+
+// indexed by the head descriptor of its chain
+typedef struct virtio_blk_request_t
+{
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+	volatile uint8_t status;
+} virtio_blk_request_t;
+
+typedef struct virtio_blk_stats_t
+{
+	uint32_t requests;
+	uint32_t interrupts;
+} virtio_blk_stats_t;
+
+// I/O port of the registers, 0 without a device
+static uint16_t virtio_blk_port;
+static uint8_t virtio_blk_irq;
+static bool virtio_blk_read_only;
+static uint32_t virtio_blk_capacity;
+// per segment and per request, as announced by the device
+static uint32_t virtio_blk_size_max;
+static uint16_t virtio_blk_seg_max;
+// completions are polled instead of waited for on the interrupt
+static bool virtio_blk_polling;
+static virtio_blk_stats_t virtio_blk_stats;
+static virtq_t virtio_blk_queue;
+static virtio_blk_request_t * virtio_blk_requests;
+static bool virtio_blk_error;
+// set when a request timed out, the device is reset and takes no further requests
+static bool virtio_blk_failed;
+
+static inline void virtio_blk_interrupt_handler(registers_t * registers)
+{
+	(void) registers;
+
+	if((inp(virtio_blk_port + VIRTIO_ISR_STATUS) & 1) != 0)
+	{
+		virtio_blk_stats.interrupts++;
+	}
+}
+
+/* Queues one request, false if the queue has no room for its descriptors */
+static inline bool virtio_blk_submit(uint32_t sector, const virtio_segment_t * segments, unsigned count, bool write)
+{
+	if(virtio_blk_failed || count > VIRTIO_BLK_SEGMENTS || count + 2 > virtio_blk_queue.free_count)
+	{
+		return false;
+	}
+	// the request structure goes with the head descriptor, which is the next free one
+	virtio_blk_request_t * request = &virtio_blk_requests[virtio_blk_queue.free_head];
+	request->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	request->reserved = 0;
+	request->sector = sector;
+	request->status = 0xFF;
+
+	virtio_segment_t chain[VIRTIO_BLK_SEGMENTS + 2];
+	chain[0].buffer = request;
+	// the header is everything before the status
+	chain[0].size = (size_t)&request->status - (size_t)request;
+	memcpy(&chain[1], segments, count * sizeof(virtio_segment_t));
+	chain[count + 1].buffer = (void *)&request->status;
+	chain[count + 1].size = 1;
+	virtq_add(&virtio_blk_queue, chain, write ? count + 1 : 1, write ? 1 : count + 1);
+	virtio_blk_stats.requests++;
+	return true;
+}
+
+/* Sends the queued requests off and waits for all of them, must be called with interrupts enabled. Returns false if any failed. */
+static inline bool virtio_blk_complete(void)
+{
+	virtq_notify(&virtio_blk_queue, !virtio_blk_polling);
+	uint32_t start = timer_tick;
+	while(virtio_blk_queue.in_flight != 0)
+	{
+		uint16_t head;
+		uint32_t size;
+		if(virtq_next(&virtio_blk_queue, &head, &size))
+		{
+			if(virtio_blk_requests[head].status != VIRTIO_BLK_S_OK)
+			{
+				virtio_blk_error = true;
+			}
+		}
+		else if(!virtq_wait(&virtio_blk_queue, !virtio_blk_polling, start))
+		{
+			// the reset stops the device from using the buffers of the requests still in flight, before they go back
+			// to their owners, and nothing is left on the queue for a later call to take for its own
+			outp(virtio_blk_port + VIRTIO_DEVICE_STATUS, 0);
+			virtio_blk_failed = true;
+			virtio_blk_error = false;
+			return false;
+		}
+	}
+	bool success = !virtio_blk_error;
+	virtio_blk_error = false;
+	return success;
+}
+
+static inline bool virtio_blk_transfer(uint32_t sector, uint32_t count, void * buffer, bool write)
+{
+	if(virtio_blk_port == 0 || virtio_blk_failed || sector > virtio_blk_capacity || count > virtio_blk_capacity - sector
+		|| (size_t)buffer + (size_t)count * VIRTIO_BLK_SECTOR_SIZE > VM_IDENTITY_SIZE || (write && virtio_blk_read_only))
+	{
+		return false;
+	}
+	uint8_t * pointer = buffer;
+	while(count > 0)
+	{
+		// a request as long as the segments allow, the device takes any size for them without VIRTIO_BLK_F_SIZE_MAX
+		virtio_segment_t segments[VIRTIO_BLK_SEGMENTS];
+		uint32_t request = count < VIRTIO_BLK_REQUEST_MAX / VIRTIO_BLK_SECTOR_SIZE ? count * VIRTIO_BLK_SECTOR_SIZE : VIRTIO_BLK_REQUEST_MAX;
+		unsigned used = 0;
+		uint32_t size = 0;
+		while(used < virtio_blk_seg_max && size < request)
+		{
+			uint32_t left = request - size;
+			segments[used].buffer = pointer + size;
+			segments[used].size = left < virtio_blk_size_max ? left : virtio_blk_size_max;
+			size += segments[used].size;
+			used++;
+		}
+		if(!virtio_blk_submit(sector, segments, used, write))
+		{
+			// the queue is full, the batch so far goes first
+			if(!virtio_blk_complete())
+				return false;
+			continue;
+		}
+		pointer += size;
+		sector += size / VIRTIO_BLK_SECTOR_SIZE;
+		count -= size / VIRTIO_BLK_SECTOR_SIZE;
+	}
+	return virtio_blk_complete();
+}
+
+static bool virtio_blk_block_transfer(block_device_t * device, uint32_t block, uint16_t count, void * buffer, bool write)
+{
+	(void) device;
+
+	return virtio_blk_transfer(block, count, buffer, write);
+}
+
+static inline void virtio_blk_init(void)
+{
+	const pci_device_t * pci = pci_find_id(PCI_ID_VIRTIO_BLK);
+	uint32_t features;
+	uint16_t port = pci != NULL ? virtio_reset(pci, VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO, &features) : 0;
+	if(port == 0)
+	{
+		return;
+	}
+	size_t requests = 0;
+	if(virtq_init(&virtio_blk_queue, port, 0, VIRTIO_BLK_SEGMENTS + 2))
+	{
+		requests = vm_frames_alloc((virtio_blk_queue.size * sizeof(virtio_blk_request_t) + VM_PAGE_SIZE - 1) / VM_PAGE_SIZE);
+	}
+	if(requests == 0)
+	{
+		virtio_ready(port, false);
+		return;
+	}
+	virtio_blk_requests = (virtio_blk_request_t *)requests;
+
+	// the 32-bit block numbers used here reach 2 TiB
+	virtio_blk_capacity = inpl(port + VIRTIO_BLK_CAPACITY + 4) != 0 ? 0xFFFFFFFF : inpl(port + VIRTIO_BLK_CAPACITY);
+	virtio_blk_size_max = VIRTIO_BLK_REQUEST_MAX;
+	if((features & VIRTIO_BLK_F_SIZE_MAX) != 0 && inpl(port + VIRTIO_BLK_SIZE_MAX) >= VIRTIO_BLK_SECTOR_SIZE)
+	{
+		virtio_blk_size_max = inpl(port + VIRTIO_BLK_SIZE_MAX) & ~(uint32_t)(VIRTIO_BLK_SECTOR_SIZE - 1);
+	}
+	virtio_blk_seg_max = 1;
+	if((features & VIRTIO_BLK_F_SEG_MAX) != 0 && inpl(port + VIRTIO_BLK_SEG_MAX) != 0)
+	{
+		uint32_t seg_max = inpl(port + VIRTIO_BLK_SEG_MAX);
+		virtio_blk_seg_max = seg_max < VIRTIO_BLK_SEGMENTS ? seg_max : VIRTIO_BLK_SEGMENTS;
+	}
+	virtio_blk_read_only = (features & VIRTIO_BLK_F_RO) != 0;
+	virtio_blk_irq = pci->irq < 16 ? pci->irq : 0;
+	virtio_blk_port = port;
+	virtio_ready(port, true);
+
+	block_device_t * device = block_register("vda", virtio_blk_capacity, virtio_blk_block_transfer, virtio_blk_read_only, NULL);
+	if(device != NULL)
+	{
+		device->buffer_limit = VM_IDENTITY_SIZE;
+	}
+}
+
+/*
+ * virtio console
+ *
+ * Port 0 of a virtio-serial device (-device virtio-serial-pci -device virtconsole,chardev=...), a channel to a file or
+ * socket on the host that is not limited by the emulation of a UART. Output goes into a ring of pages, and the part
+ * written since the last submission is handed to the device where it is, in one or two segments depending on where
+ * the ring wraps. A submission goes out once a line is complete or VIRTIO_CONSOLE_BATCH bytes have piled up, the space
+ * comes back when the device returns it, which it does in order. Input arrives in a few pages posted to the receive
+ * queue. Both queues are polled, the device never interrupts.
+ */
+
+enum
+{
+	PCI_ID_VIRTIO_CONSOLE = 0x10031AF4,
+
+	VIRTIO_CONSOLE_RECEIVE_QUEUE = 0,
+	VIRTIO_CONSOLE_TRANSMIT_QUEUE = 1,
+
+	// a power of two
+	VIRTIO_CONSOLE_RING_SIZE = 0x10000,
+	VIRTIO_CONSOLE_BATCH = 0x1000,
+	// transmit submissions in flight
+	VIRTIO_CONSOLE_SUBMISSIONS = 16,
+	VIRTIO_CONSOLE_RECEIVE_BUFFERS = 4,
+	VIRTIO_CONSOLE_POLLS = 0x100000,
+};
+
+typedef struct virtio_console_stats_t
+{
+	uint32_t bytes;
+	uint32_t submissions;
+	uint32_t dropped;
+} virtio_console_stats_t;
+
+// I/O port of the registers, 0 without a device
+static uint16_t virtio_console_port;
+static virtq_t virtio_console_receive, virtio_console_transmit;
+static uint8_t * virtio_console_ring;
+// running positions in the ring: the end of the output, of what has been submitted and of what the device gave back
+static uint32_t virtio_console_head, virtio_console_submitted, virtio_console_tail;
+// where the submissions in flight end, oldest first
+static uint32_t virtio_console_ends[VIRTIO_CONSOLE_SUBMISSIONS];
+static uint8_t virtio_console_ends_first;
+// receive buffers of a page each, by the head descriptor they were posted with
+static uint8_t * virtio_console_input;
+static uint16_t virtio_console_input_heads[VIRTIO_CONSOLE_RECEIVE_BUFFERS];
+// the received buffer being read, VIRTIO_CONSOLE_RECEIVE_BUFFERS if none
+static unsigned virtio_console_reading = VIRTIO_CONSOLE_RECEIVE_BUFFERS;
+static uint32_t virtio_console_read_offset, virtio_console_read_size;
+static virtio_console_stats_t virtio_console_stats;
+
+/* Takes the finished submissions back, their space in the ring can be written again */
+static inline void virtio_console_reclaim(void)
+{
+	uint16_t head;
+	uint32_t size;
+	while(virtq_next(&virtio_console_transmit, &head, &size))
+	{
+		virtio_console_tail = virtio_console_ends[virtio_console_ends_first];
+		virtio_console_ends_first = (virtio_console_ends_first + 1) % VIRTIO_CONSOLE_SUBMISSIONS;
+	}
+}
+
+/* Hands the output written since the last submission to the device */
+static inline void virtio_console_flush(void)
+{
+	virtio_console_reclaim();
+	uint32_t length = virtio_console_head - virtio_console_submitted;
+	if(length == 0 || virtio_console_transmit.in_flight >= VIRTIO_CONSOLE_SUBMISSIONS)
+	{
+		return;
+	}
+	uint32_t offset = virtio_console_submitted & (VIRTIO_CONSOLE_RING_SIZE - 1);
+	uint32_t first = VIRTIO_CONSOLE_RING_SIZE - offset < length ? VIRTIO_CONSOLE_RING_SIZE - offset : length;
+	virtio_segment_t segments[2] =
+	{
+		{ virtio_console_ring + offset, first },
+		{ virtio_console_ring, length - first },
+	};
+	unsigned slot = (virtio_console_ends_first + virtio_console_transmit.in_flight) % VIRTIO_CONSOLE_SUBMISSIONS;
+	if(virtq_add(&virtio_console_transmit, segments, first < length ? 2 : 1, 0) < 0)
+	{
+		return;
+	}
+	virtio_console_ends[slot] = virtio_console_head;
+	virtio_console_submitted = virtio_console_head;
+	virtio_console_stats.submissions++;
+	virtq_notify(&virtio_console_transmit, false);
+}
+
+/* Waits for the device to give back output, false if it does not within VIRTIO_TIMEOUT or VIRTIO_CONSOLE_POLLS */
+static inline bool virtio_console_drain(void)
+{
+	virtio_console_flush();
+	uint32_t start = timer_tick;
+	uint32_t tail = virtio_console_tail;
+	// the timer stands still when the caller runs with interrupts disabled
+	for(uint32_t polls = 0; virtio_console_transmit.in_flight != 0 && polls < VIRTIO_CONSOLE_POLLS; polls++)
+	{
+		virtio_console_reclaim();
+		if(virtio_console_tail != tail)
+		{
+			return true;
+		}
+		if(!virtq_wait(&virtio_console_transmit, false, start))
+		{
+			return false;
+		}
+	}
+	return virtio_console_tail != tail;
+}
+
+static inline void virtio_console_write(const char * text, size_t length)
+{
+	if(virtio_console_port == 0 || length == 0)
+	{
+		return;
+	}
+	bool line = text[length - 1] == '\n';
+	while(length > 0)
+	{
+		virtio_console_reclaim();
+		uint32_t space = VIRTIO_CONSOLE_RING_SIZE - (virtio_console_head - virtio_console_tail);
+		if(space == 0)
+		{
+			if(!virtio_console_drain())
+			{
+				// the host is not reading, the output is lost rather than blocking the kernel
+				virtio_console_stats.dropped += length;
+				return;
+			}
+			continue;
+		}
+		uint32_t offset = virtio_console_head & (VIRTIO_CONSOLE_RING_SIZE - 1);
+		uint32_t size = length < space ? length : space;
+		size = size < VIRTIO_CONSOLE_RING_SIZE - offset ? size : VIRTIO_CONSOLE_RING_SIZE - offset;
+		memcpy(virtio_console_ring + offset, text, size);
+		virtio_console_head += size;
+		virtio_console_stats.bytes += size;
+		text += size;
+		length -= size;
+		if(virtio_console_head - virtio_console_submitted >= VIRTIO_CONSOLE_BATCH)
+		{
+			virtio_console_flush();
+		}
+	}
+	if(line)
+	{
+		virtio_console_flush();
+	}
+}
+
+static inline void virtio_console_post(unsigned buffer)
+{
+	virtio_segment_t segment = { virtio_console_input + buffer * VM_PAGE_SIZE, VM_PAGE_SIZE };
+	virtio_console_input_heads[buffer] = virtq_add(&virtio_console_receive, &segment, 0, 1);
+	virtq_notify(&virtio_console_receive, false);
+}
+
+/* Copies out up to size bytes of what the host has sent, returns how many */
+static inline size_t virtio_console_read(void * buffer, size_t size)
+{
+	size_t done = 0;
+	while(virtio_console_port != 0 && done < size)
+	{
+		if(virtio_console_reading == VIRTIO_CONSOLE_RECEIVE_BUFFERS)
+		{
+			uint16_t head;
+			if(!virtq_next(&virtio_console_receive, &head, &virtio_console_read_size))
+			{
+				break;
+			}
+			virtio_console_reading = 0;
+			while(virtio_console_reading < VIRTIO_CONSOLE_RECEIVE_BUFFERS - 1 && virtio_console_input_heads[virtio_console_reading] != head)
+			{
+				virtio_console_reading++;
+			}
+			virtio_console_read_offset = 0;
+		}
+		size_t count = virtio_console_read_size - virtio_console_read_offset;
+		count = count < size - done ? count : size - done;
+		memcpy((uint8_t *)buffer + done, virtio_console_input + virtio_console_reading * VM_PAGE_SIZE + virtio_console_read_offset, count);
+		done += count;
+		virtio_console_read_offset += count;
+		if(virtio_console_read_offset == virtio_console_read_size)
+		{
+			virtio_console_post(virtio_console_reading);
+			virtio_console_reading = VIRTIO_CONSOLE_RECEIVE_BUFFERS;
+		}
+	}
+	return done;
+}
+
+static inline void virtio_console_init(void)
+{
+	const pci_device_t * pci = pci_find_id(PCI_ID_VIRTIO_CONSOLE);
+	uint32_t features;
+	// without VIRTIO_CONSOLE_F_MULTIPORT, the first two queues are port 0 and the device connects it by itself
+	uint16_t port = pci != NULL ? virtio_reset(pci, 0, &features) : 0;
+	if(port == 0)
+	{
+		return;
+	}
+	size_t memory = 0;
+	if(virtq_init(&virtio_console_receive, port, VIRTIO_CONSOLE_RECEIVE_QUEUE, VIRTIO_CONSOLE_RECEIVE_BUFFERS)
+		&& virtq_init(&virtio_console_transmit, port, VIRTIO_CONSOLE_TRANSMIT_QUEUE, VIRTIO_CONSOLE_SUBMISSIONS * 2))
+	{
+		memory = vm_frames_alloc(VIRTIO_CONSOLE_RING_SIZE / VM_PAGE_SIZE + VIRTIO_CONSOLE_RECEIVE_BUFFERS);
+	}
+	if(memory == 0)
+	{
+		virtio_ready(port, false);
+		return;
+	}
+	virtio_console_ring = (uint8_t *)memory;
+	virtio_console_input = (uint8_t *)memory + VIRTIO_CONSOLE_RING_SIZE;
+	virtio_console_port = port;
+	virtio_ready(port, true);
+	for(unsigned buffer = 0; buffer < VIRTIO_CONSOLE_RECEIVE_BUFFERS; buffer++)
+	{
+		virtio_console_post(buffer);
+	}
+	kprintf_mirror = virtio_console_write;
+}
+#endif
+
+void interrupt_handler(registers_t * registers)
+{
+	irqtrace_interrupt_entry(registers);
+
+	if(IRQ8 <= registers->interrupt_number && registers->interrupt_number < IRQ8 + 8)
+	{
+		outp(PORT_PIC2_COMMAND, PIC_EOI);
+		outp(PORT_PIC1_COMMAND, PIC_EOI);
+	}
+	else if(IRQ0 <= registers->interrupt_number && registers->interrupt_number < IRQ0 + 8)
+	{
+		outp(PORT_PIC1_COMMAND, PIC_EOI);
+	}
+
+#if (OS386 || OS64) && !HOST
+	// a first access to the heap, the instruction is retried with the page in place
+	if(registers->interrupt_number == 0x0E && vm_fault(registers->error_code))
+	{
+		irqtrace_interrupt_exit(registers);
+		return;
+	}
+#endif
+#if OS64 && !HOST
+	// the first SIMD instruction of a region whose context does not own the registers
+	if(registers->interrupt_number == 0x07 && fpu_switch())
+	{
+		irqtrace_interrupt_exit(registers);
+		return;
+	}
+#endif
+
+	uint8_t old_screen_x = screen_x;
+	uint8_t old_screen_y = screen_y;
+	uint8_t old_screen_attribute = screen_attribute;
+
+	screen_x = 0;
+	screen_y = screen_height - 1;
+	screen_attribute = 0x4E;
+
+	screen_putstr("Interrupt 0x");
+	screen_puthex(registers->interrupt_number);
+#if !OS86
+	screen_putstr(" with error code ");
+	screen_puthex(registers->error_code);
+#endif
+	screen_putstr(" called from 0x");
+#if OS64
+	screen_puthex(registers->rip);
+#elif OS386
+	screen_puthex(registers->eip);
+#else
+	screen_puthex(registers->ip);
+#endif
+
+#if (OS386 || OS64) && !HOST
+	// PCI interrupt lines are routed by the firmware and can be shared with the devices below
+	if(virtio_blk_irq != 0 && registers->interrupt_number == IRQ0 + (unsigned)virtio_blk_irq)
+	{
+		virtio_blk_interrupt_handler(registers);
+	}
+#endif
+
+	switch(registers->interrupt_number)
+	{
+	case IRQ0 + 0: // timer interrupt
+		timer_interrupt_handler(registers);
+		break;
+	case IRQ0 + 1: // keyboard interrupt
+		keyboard_interrupt_handler(registers);
+		break;
+#if !OS86 && !HOST
+	case IRQ0 + 6: // floppy disk controller
+		floppy_interrupt_handler(registers);
+		break;
+	case IRQ8 + 6: // primary ATA channel
+		ata_interrupt_handler(registers);
+		break;
+#elif OS86
+	case IRQ0 + 6: // floppy disk controller, for the BIOS
+		bios_disk_interrupt_handler(registers);
+		break;
+#endif
+	}
+
+	screen_x = old_screen_x;
+	screen_y = old_screen_y;
+	screen_attribute = old_screen_attribute;
+
+	screen_move_cursor();
+	irqtrace_interrupt_exit(registers);
+}
+
+/*
+ * CRC-32C
+ *
+ * The Castagnoli CRC, reflected, with the initial value and the result inverted like the CRC-32 of zlib: crc32c takes
+ * the result of the previous part, 0 to start with. makeboot.py stores one over the kernel after the boot sector in
+ * the boot information block and one over the initrd archive after its header in the header, and the kernel checks
+ * both while starting, before anything has changed its data.
+ *
+ * The 386 and x86-64 kernels use the CRC32 instruction of SSE4.2 when they have it, which works on general purpose
+ * registers and does not need a SIMD region. Otherwise the 32-bit and 64-bit kernels go through 8 bytes at a time
+ * with 8 tables (slicing-by-8), the 16-bit kernels a byte at a time with the first one of them.
+ */
+
+#define CRC32C_POLYNOMIAL 0x82F63B78UL
+
+#if OS86 || OS286
+# define CRC32C_TABLES 1
+#else
+# define CRC32C_TABLES 8
+#endif
+
+typedef uint32_t __attribute__((may_alias)) crc32c_word_t;
+
+static uint32_t crc32c_tables[CRC32C_TABLES][256];
+#if OS386 || OS64
+static bool crc32c_sse42;
+#endif
+
+static inline void crc32c_init(void)
+{
+	for(unsigned i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for(int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ ((crc & 1) != 0 ? CRC32C_POLYNOMIAL : 0);
+		}
+		crc32c_tables[0][i] = crc;
+	}
+	// table n gives the CRC of a byte followed by n zero bytes
+	for(int table = 1; table < CRC32C_TABLES; table++)
+	{
+		for(unsigned i = 0; i < 256; i++)
+		{
+			uint32_t crc = crc32c_tables[table - 1][i];
+			crc32c_tables[table][i] = (crc >> 8) ^ crc32c_tables[0][crc & 0xFF];
+		}
+	}
+#if OS386 || OS64
+	crc32c_sse42 = cpu_has_cpuid() && cpuid(0, 0).eax >= 1 && (cpuid(1, 0).ecx & CPUID_1_ECX_SSE42) != 0;
+#endif
+}
+
+/* Without the inversions, crc is the running value */
+static inline uint32_t crc32c_table(uint32_t crc, const uint8_t far * data, size_t size)
+{
+#if CRC32C_TABLES == 8
+	for(; size >= 8; size -= 8, data += 8)
+	{
+		uint32_t low = *(const crc32c_word_t *)data ^ crc;
+		uint32_t high = *(const crc32c_word_t *)(data + 4);
+		crc = crc32c_tables[7][low & 0xFF] ^ crc32c_tables[6][(low >> 8) & 0xFF]
+			^ crc32c_tables[5][(low >> 16) & 0xFF] ^ crc32c_tables[4][low >> 24]
+			^ crc32c_tables[3][high & 0xFF] ^ crc32c_tables[2][(high >> 8) & 0xFF]
+			^ crc32c_tables[1][(high >> 16) & 0xFF] ^ crc32c_tables[0][high >> 24];
+	}
+#endif
+	for(; size != 0; size--, data++)
+	{
+		crc = (crc >> 8) ^ crc32c_tables[0][(crc ^ *data) & 0xFF];
+	}
+	return crc;
+}
+
+#if OS386 || OS64
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_instruction(uint32_t crc, const uint8_t * data, size_t size)
+{
+# if OS64
+	for(; size >= 8; size -= 8, data += 8)
+	{
+		crc = __builtin_ia32_crc32di(crc, *(const uint64_t __attribute__((may_alias)) *)data);
+	}
+# else
+	for(; size >= 4; size -= 4, data += 4)
+	{
+		crc = __builtin_ia32_crc32si(crc, *(const crc32c_word_t *)data);
+	}
+# endif
+	for(; size != 0; size--, data++)
+	{
+		crc = __builtin_ia32_crc32qi(crc, *data);
+	}
+	return crc;
+}
+#endif
+
+static inline uint32_t crc32c(uint32_t crc, const void far * data, size_t size)
+{
+#if OS386 || OS64
+	if(crc32c_sse42)
+	{
+		return ~crc32c_instruction(~crc, data, size);
+	}
+#endif
+	return ~crc32c_table(~crc, data, size);
+}
+
+typedef enum checksum_t
+{
+	// makeboot.py did not compute one, or the kernel was not loaded by the boot sector
+	CHECKSUM_NONE,
+	CHECKSUM_VALID,
+	CHECKSUM_MISMATCH,
+} checksum_t;
+
+#if BENCH
+static const char * const checksum_names[] = { "none", "valid", "mismatch" };
+#endif
+
+static checksum_t image_checksum;
+
+#if !HOST
+// set by makeboot.py in the boot sector, over the sectors after it up to image_end
+extern const uint32_t image_crc32c;
+extern const uint8_t image_end[];
+
+/* Has to run before anything writes to the data of the kernel */
+static inline void image_check(void)
+{
+	if(image_crc32c == 0)
+	{
+		return;
+	}
+	const uint8_t * start = (const uint8_t *)0x7E00;
+	image_checksum = crc32c(0, start, image_end - start) == image_crc32c ? CHECKSUM_VALID : CHECKSUM_MISMATCH;
+}
+#endif
+
+/*
+ * Initial ramdisk
+ *
+ * makeboot.py appends an archive of files after the kernel on the disk, which the boot sector loads to INITRD_ADDRESS.
+ * Files are never copied out of it: a lookup hashes the name with FNV-1a, probes the prebuilt open addressing index
+ * and returns a pointer to the data where it was loaded. In real mode the data is paragraph aligned so that the
+ * pointer starts at offset 0 of its own segment, the 286 sees the archive through one selector per 64 KiB and
+ * makeboot.py keeps files smaller than that within a single window.
+ */
+
+#define INITRD_ADDRESS 0x20000
+#define INITRD_SEGMENT 0x2000
+
+#define INITRD_FNV_OFFSET 0x811C9DC5UL
+#define INITRD_FNV_PRIME  0x01000193UL
+
+enum
+{
+	INITRD_WINDOWS = 8,
+	INITRD_EMPTY = 0xFFFF,
+};
+
+typedef struct initrd_header_t
+{
+	char magic[4];
+	uint16_t file_count;
+	// slots in the hash index, a power of two with at least one of them empty
+	uint16_t index_size;
+	uint32_t size;
+	// CRC-32C of the archive after the header, 0 if there is none
+	uint32_t crc32c;
+} initrd_header_t;
+
+typedef struct initrd_entry_t
+{
+	uint32_t hash;
+	uint32_t offset;
+	uint32_t size;
+	uint16_t name_offset;
+	uint16_t name_length;
+} initrd_entry_t;
+
+typedef struct initrd_file_t
+{
+	const void far * data;
+	uint32_t size;
+} initrd_file_t;
+
+// set by makeboot.py in the boot sector
+extern uint16_t initrd_sectors;
+#if HOST
+extern const uint8_t * host_initrd;
+#endif
+
+// the archive up to the end of the names, which is always within the first 64 KiB
+static const uint8_t far * initrd_archive;
+static const uint16_t far * initrd_index;
+static const initrd_entry_t far * initrd_entries;
+static uint16_t initrd_index_mask;
+static uint16_t initrd_file_count;
+static checksum_t initrd_checksum;
+
+/* Points to an offset in the archive, in place */
+static inline const void far * initrd_pointer(uint32_t offset)
+{
+#if OS86
+	return MK_FP(INITRD_SEGMENT + (offset >> 4), offset & 0xF);
+#elif OS286
+	return MK_FP(SEL_INITRD + (offset >> 16) * 8, offset & 0xFFFF);
+#else
+	return initrd_archive + offset;
+#endif
+}
+
+static inline uint32_t initrd_hash(const char * name, size_t * length)
+{
+	uint32_t hash = INITRD_FNV_OFFSET;
+	size_t i;
+	for(i = 0; name[i] != '\0'; i++)
+	{
+		hash = (hash ^ (uint8_t)name[i]) * INITRD_FNV_PRIME;
+	}
+	*length = i;
+	return hash;
+}
+
+/* In pieces that stay within the segment of a far pointer */
+static inline uint32_t initrd_crc32c(uint32_t offset, uint32_t end)
+{
+	uint32_t crc = 0;
+	while(offset < end)
+	{
+		size_t size = 0x8000 - (offset & 0x7FFF);
+		if(size > end - offset)
+		{
+			size = end - offset;
+		}
+		crc = crc32c(crc, initrd_pointer(offset), size);
+		offset += size;
+	}
+	return crc;
+}
+
+static inline void initrd_init(void)
+{
+#if OS86
+	initrd_archive = (const uint8_t far *)MK_FP(INITRD_SEGMENT, 0);
+#elif OS286
+	for(int i = 0; i < INITRD_WINDOWS; i++)
+	{
+		descriptor_set_segment(&gdt[SEL_INITRD / 8 + i], INITRD_ADDRESS + ((uint32_t)i << 16), 0xFFFF, DESCRIPTOR_ACCESS_DATA | DESCRIPTOR_ACCESS_CPL0, DESCRIPTOR_FLAGS_16BIT);
+	}
+	initrd_archive = (const uint8_t far *)MK_FP(SEL_INITRD, 0);
+#elif HOST
+	initrd_archive = host_initrd;
+#else
+	initrd_archive = (const uint8_t *)INITRD_ADDRESS;
+#endif
+
+	if(initrd_sectors == 0)
+	{
+		return;
+	}
+	const initrd_header_t far * header = (const initrd_header_t far *)initrd_archive;
+	if(header->magic[0] != 'I' || header->magic[1] != 'R' || header->magic[2] != 'D' || header->magic[3] != '1'
+	|| header->size > (uint32_t)initrd_sectors * 512
+	|| header->index_size == 0 || (header->index_size & (header->index_size - 1)) != 0)
+	{
+		return;
+	}
+	if(header->crc32c != 0)
+	{
+		initrd_checksum = initrd_crc32c(sizeof *header, header->size) == header->crc32c ? CHECKSUM_VALID : CHECKSUM_MISMATCH;
+		if(initrd_checksum == CHECKSUM_MISMATCH)
+		{
+			return;
+		}
+	}
+	initrd_index = (const uint16_t far *)(header + 1);
+	initrd_entries = (const initrd_entry_t far *)(initrd_index + header->index_size);
+	initrd_index_mask = header->index_size - 1;
+	initrd_file_count = header->file_count;
+}
+
+/* Looks up a file by name, returns false if the archive does not have it */
+static inline bool initrd_find(const char * name, initrd_file_t * file)
+{
+	if(initrd_file_count == 0)
+	{
+		return false;
+	}
+
+	size_t length;
+	uint32_t hash = initrd_hash(name, &length);
+	for(uint16_t slot = hash & initrd_index_mask;; slot = (slot + 1) & initrd_index_mask)
+	{
+		uint16_t number = initrd_index[slot];
+		if(number == INITRD_EMPTY)
+		{
+			return false;
+		}
+		const initrd_entry_t far * entry = &initrd_entries[number];
+		if(entry->hash != hash || entry->name_length != length)
+		{
+			continue;
+		}
+		const char far * entry_name = (const char far *)(initrd_archive + entry->name_offset);
+		size_t i = 0;
+		while(i < length && entry_name[i] == name[i])
+		{
+			i++;
+		}
+		if(i == length)
+		{
+			file->data = initrd_pointer(entry->offset);
+			file->size = entry->size;
+			return true;
+		}
+	}
+}
+
+/*
+ * FAT12 file system
+ *
+ * Read only, mounted from the boot floppy, where makeboot.py puts the file system after the reserved sectors that hold
+ * the kernel and the initrd. The whole FAT is kept in memory after the block cache buffers. Opening a file walks its
+ * cluster chain once and records it as extents, runs of consecutive clusters, so reading maps file offsets to disk
+ * blocks without going back to the FAT and hands each run to the block layer as a single request. Chains with more
+ * than FAT_EXTENTS runs are followed through the FAT past the last recorded one.
+ *
+ * Paths are names in the root directory or in subdirectories below it, separated by slashes, matched in 8.3 form
+ * regardless of case.
+ */
+
+enum
+{
+	FAT_ENTRY_SIZE = 32,
+	FAT_ENTRIES_PER_BLOCK = BLOCK_SIZE / FAT_ENTRY_SIZE,
+	// large enough for 2.88 MB floppies
+	FAT_TABLE_SECTORS_MAX = 12,
+	FAT_EXTENTS = 8,
+	// FAT12 volumes have fewer clusters, FAT16 starts beyond this
+	FAT12_CLUSTERS_MAX = 4084,
+	FAT_CLUSTER_BAD = 0xFF7,
+	FAT_CLUSTER_END = 0xFF8,
+
+	FAT_ATTRIBUTE_VOLUME = 0x08,
+	FAT_ATTRIBUTE_DIRECTORY = 0x10,
+	FAT_ATTRIBUTE_LONG_NAME = 0x0F,
+	FAT_NAME_END = 0x00,
+	FAT_NAME_DELETED = 0xE5,
+};
+
+typedef struct fat_bpb_t
+{
+	uint8_t jump[3];
+	char oem[8];
+	uint16_t bytes_per_sector;
+	uint8_t sectors_per_cluster;
+	uint16_t reserved_sectors;
+	uint8_t fat_count;
+	uint16_t root_entries;
+	uint16_t total_sectors;
+	uint8_t media;
+	uint16_t fat_sectors;
+} __attribute__((packed)) fat_bpb_t;
+
+typedef struct fat_entry_t
+{
+	char name[11];
+	uint8_t attributes;
+	uint8_t reserved[10];
+	uint16_t time;
+	uint16_t date;
+	uint16_t cluster;
+	uint32_t size;
+} fat_entry_t;
+
+typedef struct fat_extent_t
+{
+	uint16_t cluster;
+	uint16_t count;
+} fat_extent_t;
+
+typedef struct fat_stat_t
+{
+	uint32_t size;
+	uint8_t attributes;
+	uint16_t time;
+	uint16_t date;
+	// runs of consecutive clusters, 1 for a file that is not fragmented
+	uint16_t extents;
+} fat_stat_t;
+
+typedef struct fat_file_t
+{
+	uint32_t size;
+	uint32_t position;
+	uint8_t attributes;
+	uint8_t extent_count;
+	fat_extent_t extents[FAT_EXTENTS];
+	// where the chain goes on after the recorded extents, 0 if they cover all of it
+	uint16_t more_cluster;
+	uint16_t more_index;
+} fat_file_t;
+
+static block_device_t * fat_device;
+static uint8_t fat_cluster_shift;
+static uint16_t fat_clusters;
+static uint16_t fat_root_entries;
+static uint32_t fat_root_start;
+static uint32_t fat_data_start;
+static uint16_t fat_root_files;
+// for directory entries and the partial blocks at the ends of reads
+static uint8_t fat_block[BLOCK_SIZE];
+
+#if HOST
+static uint8_t fat_table[FAT_TABLE_SECTORS_MAX * BLOCK_SIZE];
+#else
+static uint8_t * const fat_table = (uint8_t *)BLOCK_CACHE_ADDRESS + (BLOCK_BUFFERS + BLOCK_MERGE_MAX) * BLOCK_SIZE;
+#endif
+
+static inline uint16_t fat_next(uint16_t cluster)
+{
+	uint16_t value = fat_table[cluster + cluster / 2] | fat_table[cluster + cluster / 2 + 1] << 8;
+	return cluster & 1 ? value >> 4 : value & 0xFFF;
+}
+
+static inline bool fat_valid(uint16_t cluster)
+{
+	return 2 <= cluster && cluster < fat_clusters + 2;
+}
+
+/* The run of consecutive clusters starting at cluster, sets next to the cluster after it or 0 at the end of the chain */
+static inline uint16_t fat_run(uint16_t cluster, uint16_t * next)
+{
+	uint16_t count = 1;
+	for(;;)
+	{
+		uint16_t following = fat_next(cluster);
+		if(following != cluster + 1 || !fat_valid(following))
+		{
+			*next = fat_valid(following) ? following : 0;
+			return count;
+		}
+		cluster = following;
+		count++;
+	}
+}
+
+static inline void fat_file_init(fat_file_t * file, const fat_entry_t * entry)
+{
+	file->size = entry->size;
+	file->position = 0;
+	file->attributes = entry->attributes;
+	file->extent_count = 0;
+	file->more_cluster = 0;
+	file->more_index = 0;
+	uint16_t cluster = fat_valid(entry->cluster) ? entry->cluster : 0;
+	uint16_t index = 0;
+	while(cluster != 0 && file->extent_count < FAT_EXTENTS)
+	{
+		fat_extent_t * extent = &file->extents[file->extent_count++];
+		extent->cluster = cluster;
+		extent->count = fat_run(cluster, &cluster);
+		index += extent->count;
+	}
+	file->more_cluster = cluster;
+	file->more_index = index;
+}
+
+/* The disk block holding a block of a file and the number of consecutive blocks from there, false past the end of the chain or once it has run longer than the FAT, which only a cycle can do */
+static inline bool fat_map(const fat_file_t * file, uint32_t file_block, uint32_t * block, uint32_t * run)
+{
+	uint32_t cluster_index = file_block >> fat_cluster_shift;
+	uint16_t within = file_block & ((1 << fat_cluster_shift) - 1);
+	uint32_t index = 0;
+	uint16_t cluster = 0, count = 0;
+	for(uint8_t i = 0; i < file->extent_count; i++)
+	{
+		if(cluster_index < index + file->extents[i].count)
+		{
+			cluster = file->extents[i].cluster;
+			count = file->extents[i].count;
+			break;
+		}
+		index += file->extents[i].count;
+	}
+	if(count == 0)
+	{
+		// a fragmented file, on through the FAT
+		uint16_t next = file->more_cluster;
+		index = file->more_index;
+		while(next != 0 && index < fat_clusters)
+		{
+			cluster = next;
+			count = fat_run(cluster, &next);
+			if(cluster_index < index + count)
+				break;
+			index += count;
+			count = 0;
+		}
+		if(count == 0)
+		{
+			return false;
+		}
+	}
+	cluster += cluster_index - index;
+	count -= cluster_index - index;
+	*block = fat_data_start + ((uint32_t)(cluster - 2) << fat_cluster_shift) + within;
+	*run = ((uint32_t)count << fat_cluster_shift) - within;
+	return true;
+}
+
+static inline size_t fat_read(fat_file_t * file, void * buffer, size_t size)
+{
+	if(size > file->size - file->position)
+	{
+		size = file->size - file->position;
+	}
+	uint8_t * destination = buffer;
+	size_t done = 0;
+	while(done < size)
+	{
+		uint32_t block, run;
+		if(!fat_map(file, file->position / BLOCK_SIZE, &block, &run))
+		{
+			break;
+		}
+		uint16_t offset = file->position % BLOCK_SIZE;
+		size_t length;
+		if(offset == 0 && size - done >= BLOCK_SIZE)
+		{
+			// whole blocks go straight to the caller, as much of the run in one request as the buffer takes
+			uint32_t count = (size - done) / BLOCK_SIZE;
+			if(count > run)
+			{
+				count = run;
+			}
+			if(!block_read(fat_device, block, count, destination + done))
+			{
+				break;
+			}
+			length = count * BLOCK_SIZE;
+		}
+		else
+		{
+			if(!block_read(fat_device, block, 1, fat_block))
+			{
+				break;
+			}
+			length = BLOCK_SIZE - offset;
+			if(length > size - done)
+			{
+				length = size - done;
+			}
+			memcpy(destination + done, fat_block + offset, length);
+		}
+		done += length;
+		file->position += length;
+	}
+	return done;
+}
+
+static inline void fat_seek(fat_file_t * file, uint32_t position)
+{
+	file->position = position < file->size ? position : file->size;
+}
+
+/* Reads entry number index of a directory into fat_block, NULL for the root directory, returns NULL past the end */
+static inline const fat_entry_t * fat_directory_entry(const fat_file_t * directory, uint16_t index)
+{
+	uint32_t block, run;
+	if(directory == NULL)
+	{
+		if(index >= fat_root_entries)
+			return NULL;
+		block = fat_root_start + index / FAT_ENTRIES_PER_BLOCK;
+	}
+	else if(!fat_map(directory, index / FAT_ENTRIES_PER_BLOCK, &block, &run))
+	{
+		return NULL;
+	}
+	if(!block_read(fat_device, block, 1, fat_block))
+	{
+		return NULL;
+	}
+	return (const fat_entry_t *)fat_block + index % FAT_ENTRIES_PER_BLOCK;
+}
+
+/* Turns the first component of a path into an 8.3 directory entry name, returns the rest of the path or NULL */
+static inline const char * fat_path_name(const char * path, char name[11])
+{
+	memset(name, ' ', 11);
+	unsigned length = 0, limit = 8;
+	for(; *path != '\0' && *path != '/'; path++)
+	{
+		char c = *path;
+		if(c == '.' && limit == 8)
+		{
+			length = 8;
+			limit = 11;
+			continue;
+		}
+		if(length == limit)
+		{
+			return NULL;
+		}
+		name[length++] = 'a' <= c && c <= 'z' ? c - 'a' + 'A' : c;
+	}
+	return name[0] != ' ' ? path : NULL;
+}
+
+static inline bool fat_lookup(const char * path, fat_entry_t * found)
+{
+	if(fat_device == NULL)
+	{
+		return false;
+	}
+	fat_file_t directory;
+	bool root = true;
+	while(*path == '/')
+	{
+		path++;
+	}
+	for(;;)
+	{
+		char name[11];
+		path = fat_path_name(path, name);
+		if(path == NULL)
+		{
+			return false;
+		}
+		const fat_entry_t * entry;
+		for(uint16_t index = 0;; index++)
+		{
+			entry = fat_directory_entry(root ? NULL : &directory, index);
+			if(entry == NULL || (uint8_t)entry->name[0] == FAT_NAME_END || index == 0xFFFF)
+			{
+				return false;
+			}
+			if((uint8_t)entry->name[0] != FAT_NAME_DELETED && (entry->attributes & FAT_ATTRIBUTE_VOLUME) == 0
+			&& memcmp(entry->name, name, sizeof name) == 0)
+			{
+				break;
+			}
+		}
+		while(*path == '/')
+		{
+			path++;
+		}
+		if(*path == '\0')
+		{
+			*found = *entry;
+			return true;
+		}
+		if((entry->attributes & FAT_ATTRIBUTE_DIRECTORY) == 0)
+		{
+			return false;
+		}
+		fat_file_init(&directory, entry);
+		root = false;
+	}
+}
+
+static inline bool fat_open(const char * path, fat_file_t * file)
+{
+	fat_entry_t entry;
+	if(!fat_lookup(path, &entry))
+	{
+		return false;
+	}
+	fat_file_init(file, &entry);
+	return true;
+}
+
+static inline bool fat_stat(const char * path, fat_stat_t * stat)
+{
+	fat_entry_t entry;
+	if(!fat_lookup(path, &entry))
+	{
+		return false;
+	}
+	stat->size = entry.size;
+	stat->attributes = entry.attributes;
+	stat->time = entry.time;
+	stat->date = entry.date;
+	stat->extents = 0;
+	uint16_t cluster = fat_valid(entry.cluster) ? entry.cluster : 0;
+	uint32_t clusters = 0;
+	while(cluster != 0)
+	{
+		clusters += fat_run(cluster, &cluster);
+		stat->extents++;
+		// a chain longer than the FAT goes round in a cycle
+		if(clusters > fat_clusters)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static inline bool fat_mount(block_device_t * device)
+{
+	if(device == NULL || !block_read(device, 0, 1, fat_block))
+	{
+		return false;
+	}
+	const fat_bpb_t * bpb = (const fat_bpb_t *)fat_block;
+	uint8_t shift = 0;
+	while(shift < 8 && (1 << shift) != bpb->sectors_per_cluster)
+	{
+		shift++;
+	}
+	if(bpb->bytes_per_sector != BLOCK_SIZE || shift == 8 || bpb->fat_count == 0 || bpb->fat_sectors == 0
+	|| bpb->fat_sectors > FAT_TABLE_SECTORS_MAX || bpb->total_sectors > device->blocks)
+	{
+		return false;
+	}
+	uint32_t root_start = bpb->reserved_sectors + (uint32_t)bpb->fat_count * bpb->fat_sectors;
+	uint32_t data_start = root_start + (bpb->root_entries + FAT_ENTRIES_PER_BLOCK - 1) / FAT_ENTRIES_PER_BLOCK;
+	if(data_start >= bpb->total_sectors)
+	{
+		return false;
+	}
+	uint32_t clusters = (bpb->total_sectors - data_start) >> shift;
+	// the FAT has to hold an entry for every cluster
+	if(clusters > FAT12_CLUSTERS_MAX || (clusters + 2) * 3 / 2 + 1 > (uint32_t)bpb->fat_sectors * BLOCK_SIZE)
+	{
+		return false;
+	}
+	uint16_t fat_sectors = bpb->fat_sectors;
+	fat_cluster_shift = shift;
+	fat_clusters = clusters;
+	fat_root_entries = bpb->root_entries;
+	fat_root_start = root_start;
+	fat_data_start = data_start;
+	if(!block_read(device, bpb->reserved_sectors, fat_sectors, fat_table))
+	{
+		return false;
+	}
+	fat_device = device;
+
+	fat_root_files = 0;
+	for(uint16_t index = 0;; index++)
+	{
+		const fat_entry_t * entry = fat_directory_entry(NULL, index);
+		if(entry == NULL || (uint8_t)entry->name[0] == FAT_NAME_END)
+			break;
+		if((uint8_t)entry->name[0] != FAT_NAME_DELETED
+		&& (entry->attributes & (FAT_ATTRIBUTE_VOLUME | FAT_ATTRIBUTE_DIRECTORY)) == 0)
+			fat_root_files++;
+	}
+	return true;
+}
+
+#if (OS386 || OS64) && !HOST
+/*
+ * Kernel reload
+ *
+ * kexec starts another kernel image that is already in memory, without a reset and the BIOS, by acting as a Multiboot
+ * loader for it: the image gives the addresses to load it to and its entry point in its Multiboot header (boot.asm).
+ * The new kernel has to fit where this one is, between the boot sector and the initrd. The copy over the running
+ * kernel is done by kexec_trampoline, which is first moved below it to KEXEC_TRAMPOLINE. It turns paging off, and on
+ * x86-64 leaves long mode, before it copies, and the new kernel then sets up its own page tables and descriptors.
+ *
+ * The initrd stays where it is and is passed on as the module, and the command line gives the time stamp counter at
+ * the start of the reload, so that the new kernel can tell how long it took.
+ */
+
+enum
+{
+	KEXEC_TRAMPOLINE = 0x6000,
+	// the information structure for the new kernel, the module list and the command line follow it
+	KEXEC_INFO = 0x6800,
+	// the first and the last address the image may occupy
+	KEXEC_START = 0x7C00,
+	KEXEC_END = INITRD_ADDRESS,
+
+	MULTIBOOT_MAGIC = 0x1BADB002,
+	MULTIBOOT_ADDRESSES = 0x00010000,
+	// the header has to be 4 byte aligned within the first 8 KiB
+	MULTIBOOT_SEARCH = 0x2000,
+	// the largest image kexec takes, the headers ahead of the load address included
+	KEXEC_IMAGE_MAX = KEXEC_END - KEXEC_START + MULTIBOOT_SEARCH,
+	MULTIBOOT_HAS_MEMORY = 0x001,
+	MULTIBOOT_HAS_COMMAND_LINE = 0x004,
+	MULTIBOOT_HAS_MODULES = 0x008,
+};
+
+typedef struct multiboot_header_t
+{
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t checksum;
+	uint32_t header_address;
+	uint32_t load_address;
+	uint32_t load_end_address;
+	uint32_t bss_end_address;
+	uint32_t entry_address;
+} multiboot_header_t;
+
+typedef struct multiboot_info_t
+{
+	uint32_t flags;
+	uint32_t memory_lower;
+	uint32_t memory_upper;
+	uint32_t boot_device;
+	uint32_t command_line;
+	uint32_t module_count;
+	uint32_t modules;
+} multiboot_info_t;
+
+typedef struct multiboot_module_t
+{
+	uint32_t start;
+	uint32_t end;
+	uint32_t name;
+	uint32_t reserved;
+} multiboot_module_t;
+
+// the offsets are also used by kexec_trampoline
+typedef struct kexec_t
+{
+	uint32_t source;
+	uint32_t destination;
+	uint32_t size;
+	// bytes to clear after the image
+	uint32_t clear;
+	uint32_t entry;
+	uint32_t info;
+} kexec_t;
+
+extern const uint8_t kexec_trampoline[], kexec_trampoline_end[];
+// the command line from a Multiboot loader, empty when started from the boot sector
+extern const char multiboot_command_line[];
+
+static inline uint64_t kexec_read_tsc(void)
+{
+	if(!cpu_has_cpuid() || cpuid(0, 0).eax < 1 || (cpuid(1, 0).edx & CPUID_1_EDX_TSC) == 0)
+	{
+		return 0;
+	}
+	uint32_t low, high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return (uint64_t)high << 32 | low;
+}
+
+/* Whether this kernel was started by kexec, tsc then gives the time stamp counter at the start of the reload (or 0) */
+static inline bool kexec_reloaded(uint64_t * tsc)
+{
+	static const char key[] = "kexec=";
+	const char * text = multiboot_command_line;
+	size_t matched = 0;
+	for(; *text != '\0' && key[matched] != '\0'; text++)
+	{
+		// the key does not repeat its first character, a mismatch can only start over there
+		matched = *text == key[matched] ? matched + 1 : *text == key[0];
+	}
+	if(key[matched] != '\0')
+	{
+		return false;
+	}
+	*tsc = 0;
+	for(; ('0' <= *text && *text <= '9') || ('a' <= *text && *text <= 'f'); text++)
+	{
+		*tsc = *tsc << 4 | (uint64_t)(*text <= '9' ? *text - '0' : *text - 'a' + 10);
+	}
+	return true;
+}
+
+/* Stops the devices that could still write to memory or interrupt the new kernel */
+static inline void kexec_quiesce(void)
+{
+	disable_interrupts();
+	outp(PORT_PIC1_DATA, 0xFF);
+	outp(PORT_PIC2_DATA, 0xFF);
+	// a one-shot count that is never started
+	outp(PORT_PIT_COMMAND, PIT_CHANNEL0 | PIT_ACCESS_WORD);
+	if(virtio_blk_port != 0)
+	{
+		outp(virtio_blk_port + VIRTIO_DEVICE_STATUS, 0);
+	}
+	if(virtio_console_port != 0)
+	{
+		virtio_console_flush();
+		outp(virtio_console_port + VIRTIO_DEVICE_STATUS, 0);
+	}
+	vm_switch(&vm_kernel_space);
+}
+
+/* Starts the kernel image of size bytes at image, returns only if it is not one that can be started this way */
+static inline bool kexec(const void * image, size_t size)
+{
+	const multiboot_header_t * header = NULL;
+	for(size_t offset = 0; offset + sizeof(multiboot_header_t) <= size && offset < MULTIBOOT_SEARCH; offset += 4)
+	{
+		const multiboot_header_t * candidate = (const multiboot_header_t *)((const uint8_t *)image + offset);
+		if(candidate->magic == MULTIBOOT_MAGIC && candidate->magic + candidate->flags + candidate->checksum == 0)
+		{
+			header = candidate;
+			break;
+		}
+	}
+	if(header == NULL || (header->flags & MULTIBOOT_ADDRESSES) == 0)
+	{
+		return false;
+	}
+	// where the image starts in the buffer, from the header offset and the address the header is loaded to
+	size_t start = (size_t)((const uint8_t *)header - (const uint8_t *)image);
+	uint32_t load_end = header->load_end_address != 0 ? header->load_end_address : header->load_address + (uint32_t)size;
+	uint32_t bss_end = header->bss_end_address > load_end ? header->bss_end_address : load_end;
+	if(header->header_address < header->load_address || header->header_address - header->load_address > start
+	|| header->load_address < KEXEC_START || bss_end > KEXEC_END || load_end < header->load_address
+	|| load_end - header->load_address > size - (start - (header->header_address - header->load_address)))
+	{
+		return false;
+	}
+
+	uint64_t tsc = kexec_read_tsc();
+	kexec_t request =
+	{
+		.source = (uint32_t)(size_t)image + start - (header->header_address - header->load_address),
+		.destination = header->load_address,
+		.size = load_end - header->load_address,
+		.clear = bss_end - load_end,
+		.entry = header->entry_address,
+		.info = KEXEC_INFO,
+	};
+	multiboot_info_t * info = (multiboot_info_t *)KEXEC_INFO;
+	multiboot_module_t * module = (multiboot_module_t *)(info + 1);
+	char * command_line = (char *)(module + 1);
+	memset(info, 0, sizeof *info);
+	info->flags = MULTIBOOT_HAS_COMMAND_LINE;
+	info->command_line = (uint32_t)(size_t)command_line;
+	ksnprintf(command_line, 32, "kexec=%lx%08lx", (unsigned long)(tsc >> 32), (unsigned long)(uint32_t)tsc);
+	if(multiboot_memory != 0)
+	{
+		info->flags |= MULTIBOOT_HAS_MEMORY;
+		info->memory_lower = 640;
+		info->memory_upper = multiboot_memory - 1024;
+	}
+	if(initrd_sectors != 0)
+	{
+		info->flags |= MULTIBOOT_HAS_MODULES;
+		info->module_count = 1;
+		info->modules = (uint32_t)(size_t)module;
+		module->start = INITRD_ADDRESS;
+		module->end = INITRD_ADDRESS + (uint32_t)initrd_sectors * 512;
+		module->name = 0;
+	}
+
+	kexec_quiesce();
+	memcpy((void *)KEXEC_TRAMPOLINE, kexec_trampoline, kexec_trampoline_end - kexec_trampoline);
+	((void (*)(const kexec_t *))KEXEC_TRAMPOLINE)(&request);
+	// not reached
+	return false;
+}
+
+/* Starts the kernel image in a file of the initrd, or of the file system on the boot floppy */
+// frames above the running kernel that images from the FAT are read to, taken on the first use and kept for the next,
+// since vm_frames_alloc cannot give them back when the image turns out not to be bootable
+static void * kexec_buffer;
+
+static inline bool kexec_file(const char * name)
+{
+	initrd_file_t file;
+	if(initrd_find(name, &file))
+	{
+		return kexec(file.data, file.size);
+	}
+	fat_file_t fat_file;
+	if(!fat_open(name, &fat_file) || fat_file.size > KEXEC_IMAGE_MAX)
+	{
+		return false;
+	}
+	if(kexec_buffer == NULL)
+	{
+		kexec_buffer = (void *)vm_frames_alloc((KEXEC_IMAGE_MAX + VM_PAGE_SIZE - 1) / VM_PAGE_SIZE);
+	}
+	if(kexec_buffer == NULL || fat_read(&fat_file, kexec_buffer, fat_file.size) != fat_file.size)
+	{
+		return false;
+	}
+	return kexec(kexec_buffer, fat_file.size);
+}
+#endif
+
+#if OS86
+const char greeting[] = "Greetings! OS/86 running in real mode (8086)";
+#elif OS286
+const char greeting[] = "Greetings! OS/286 running in 16-bit protected mode (80286)";
+#elif OS386
+const char greeting[] = "Greetings! OS/386 running in 32-bit protected mode (80386)";
+#elif OS64
+const char greeting[] = "Greetings! OS/64 running in 64-bit long mode";
+#else
+# error Unknown target
+#endif
+
+/* Translates a key press into a character, returns -1 for releases and keys without one */
+static inline int keyboard_translate(const input_event_t * event)
+{
+	if((event->flags & INPUT_FLAG_RELEASE) != 0)
+	{
+		return -1;
+	}
+
+	switch(event->keycode)
+	{
+	case KEYCODE_KEYPAD_ENTER:
+		return '\n';
+	case KEYCODE_KEYPAD_SLASH:
+		return '/';
+	}
+	if((event->keycode & KEYCODE_EXTENDED) != 0)
+	{
+		return -1;
+	}
+
+	bool shifted = (event->modifiers & INPUT_MODIFIER_SHIFT) != 0;
+	char c = keyboard_scancode_table[event->keycode].normal;
+	if('a' <= c && c <= 'z' && (event->modifiers & INPUT_MODIFIER_CAPS_LOCK) != 0)
+	{
+		shifted = !shifted;
+	}
+	if(shifted)
+	{
+		c = keyboard_scancode_table[event->keycode].shifted;
+	}
+	return c != '\0' ? (uint8_t)c : -1;
+}
+
+static inline bool keyboard_kbhit(void)
+{
+	return !input_ring_empty(&keyboard_buffer);
+}
+
+static inline void keyboard_wait_event(input_event_t * event)
+{
+	while(!input_ring_pop(&keyboard_buffer, event))
+	{
+		timer_run();
+	}
+}
+
+static inline int keyboard_getch(void)
+{
+	input_event_t event;
+	int c;
+	do
+	{
+		keyboard_wait_event(&event);
+		c = keyboard_translate(&event);
+	} while(c < 0);
+	return c;
+}
+
+enum
+{
+	// power of two buckets of PIT clocks, the last one collects everything above
+	LATENCY_BUCKETS = 16,
+};
+
+typedef struct latency_stats_t
+{
+	uint32_t count;
+	uint32_t total;
+	uint32_t min;
+	uint32_t max;
+	uint16_t histogram[LATENCY_BUCKETS];
+} latency_stats_t;
+
+// time from the keyboard interrupt until the character is on the screen
+static latency_stats_t echo_latency;
+
+static inline void latency_record(latency_stats_t * stats, uint32_t clocks)
+{
+	if(stats->count == 0 || clocks < stats->min)
+		stats->min = clocks;
+	if(clocks > stats->max)
+		stats->max = clocks;
+	stats->count++;
+	stats->total += clocks;
+
+	int bucket = 0;
+	for(uint32_t rest = clocks >> 1; rest != 0 && bucket < LATENCY_BUCKETS - 1; rest >>= 1)
+	{
+		bucket++;
+	}
+	stats->histogram[bucket]++;
+}
+
+static inline void latency_report(const char * name, const latency_stats_t * stats)
+{
+	if(stats->count == 0)
+	{
+		kprintf("%s: no samples\n", name);
+		return;
+	}
+	kprintf("%s: n=%lu min=%luus avg=%luus max=%luus\n", name,
+		(unsigned long)stats->count,
+		(unsigned long)clock_to_microseconds(stats->min),
+		(unsigned long)clock_to_microseconds(stats->total / stats->count),
+		(unsigned long)clock_to_microseconds(stats->max));
+	for(int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		if(stats->histogram[bucket] != 0)
+		{
+			kprintf(" <%luus:%u", (unsigned long)clock_to_microseconds(2UL << bucket), stats->histogram[bucket]);
+		}
+	}
+	kprintf(" dropped=%u\n", keyboard_buffer.dropped);
+}
+
+static inline void test_scrolling(void)
+{
+	for(int i = 0; i < screen_height; i++)
+	{
+		screen_putstr("scroll test\n");
+	}
+
+	screen_puthex((size_t)0x1A2B3C4D);
+	screen_putdec(-12345);
+	kprintf("\n[%d] [%u] [%x] [%p] [%s] [%c] [%6d] [%-6d] [%06d]\n", -32768, 65535u, 0xBEEFu, (void *)greeting, "str", 'c', 42, 42, -42);
+#if !OS86
+	screen_putdec(sizeof(descriptor_t));
+#if OS64
+	screen_putdec(sizeof(descriptor64_t));
+#endif
+#endif
+}
+
+static inline void test_interrupts(void)
+{
+	asm volatile("int $0x03");
+	asm volatile("int $0x04");
+	asm volatile("int $0x80");
+}
+
+#if BENCH
+/*
+ * Microbenchmarks, built with -DBENCH=1 (make bench-8086 and so on). Every case runs a fixed number of operations per
+ * sample, the samples are summarized and written to COM1 as one line per case:
+ *
+ *	bench case=<name> ops=<operations per sample> min=<...> median=<...> mean=<...> max=<...>
+ *
+ * The times are per sample, in the unit given on the "bench begin" line: "tsc" for time stamp counter ticks when the
+ * processor has one, "pit" for PIT input clocks otherwise. Under QEMU with -icount both advance deterministically.
+ *
+ * The host build (make host) runs the same cases natively with many more operations per sample, so that they can be
+ * profiled with perf or valgrind.
+ */
+
+enum
+{
+	// a power of two so the mean needs no division
+	BENCH_SAMPLES = 16,
+#if OS86 || OS286
+	BENCH_BUFFER_SIZE = 1024,
+#else
+	BENCH_BUFFER_SIZE = 4096,
+#endif
+	// multiplies the operations per sample
+#if HOST
+	BENCH_SCALE = 4096,
+#else
+	BENCH_SCALE = 1,
+#endif
+};
+
+typedef struct bench_case_t
+{
+	const char * name;
+	void (* run)(void);
+	uint16_t operations;
+	// transferred per operation, the results then also give operations per second and throughput
+	uint32_t bytes;
+} bench_case_t;
+
+#if OS86
+static const char bench_target[] = "8086";
+#elif OS286
+static const char bench_target[] = "286";
+#elif OS386
+static const char bench_target[] = "386";
+#elif HOST
+static const char bench_target[] = "host";
+#elif OS64
+static const char bench_target[] = "x86-64";
+#endif
+
+#if OS386 || OS64
+static bool bench_use_tsc;
+#endif
+// bench_read ticks per second, 0 if unknown
+static uint32_t bench_frequency;
+
+static char bench_buffer[2][BENCH_BUFFER_SIZE];
+static char bench_text[64];
+static volatile int bench_sink;
+#if (OS386 || OS64) && !HOST
+// the time stamp counter on entry to kmain, the time since the reset spent in the firmware and the boot code
+static uint64_t bench_boot_tsc;
+
+static inline void bench_boot_mark(void)
+{
+	if(cpu_has_cpuid() && cpuid(0, 0).eax >= 1 && (cpuid(1, 0).edx & CPUID_1_EDX_TSC) != 0)
+	{
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		bench_boot_tsc = (uint64_t)high << 32 | low;
+	}
+}
+#endif
+
+static inline uint32_t bench_read(void)
+{
+#if OS386 || OS64
+	if(bench_use_tsc)
+	{
+		// only differences are used, the low half is enough
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		(void) high;
+		return low;
+	}
+#endif
+	return clock_read();
+}
+
+/* Events per second for count events taking ticks, both scaled down as needed to keep the product within 32 bits */
+static inline uint32_t bench_rate(uint32_t count, uint32_t ticks)
+{
+	uint32_t frequency = bench_frequency;
+	while(frequency != 0 && count > 0xFFFFFFFF / frequency)
+	{
+		frequency >>= 1;
+		ticks >>= 1;
+	}
+	return ticks != 0 ? count * frequency / ticks : 0;
+}
+
+static void bench_empty(void)
+{
+	asm volatile("" : : : "memory");
+}
+
+static void bench_memcpy_16(void)
+{
+	memcpy(bench_buffer[0], bench_buffer[1], 16);
+}
+
+static void bench_memcpy_256(void)
+{
+	memcpy(bench_buffer[0], bench_buffer[1], 256);
+}
+
+static void bench_memcpy_buffer(void)
+{
+	memcpy(bench_buffer[0], bench_buffer[1], BENCH_BUFFER_SIZE);
+}
+
+static void bench_memmove_overlap(void)
+{
+	memmove(bench_buffer[0] + 1, bench_buffer[0], BENCH_BUFFER_SIZE - 1);
+}
+
+static void bench_memset_buffer(void)
+{
+	memset(bench_buffer[0], 0, BENCH_BUFFER_SIZE);
+}
+
+static void bench_scroll(void)
+{
+	screen_scroll_lines(1);
+}
+
+static void bench_putchar(void)
+{
+	screen_x = 0;
+	screen_y = screen_height / 2;
+	screen_putchar('#');
+}
+
+/* Lines of text through the UART, looped back inside it so that none of it ends up in the results */
+static void bench_serial(void)
+{
+	outp(PORT_COM1_MODEM_CONTROL, UART_MODEM_CONTROL_LOOPBACK);
+	serial_write(bench_buffer[1], BENCH_BUFFER_SIZE);
+	outp(PORT_COM1_MODEM_CONTROL, 0);
+}
+
+static void bench_kprintf(void)
+{
+	ksnprintf(bench_text, sizeof bench_text, "%d %u %x %s %c", -12345, 54321u, 0xBEEFu, "bench", '!');
+}
+
+static void bench_input(void)
+{
+	input_event_t event = { 0 };
+	event.scancode = event.keycode = 0x1E; // 'a'
+	event.modifiers = INPUT_MODIFIER_SHIFT;
+	input_ring_push(&keyboard_buffer, event);
+	input_ring_pop(&keyboard_buffer, &event);
+	bench_sink = keyboard_translate(&event);
+}
+
+// only measures the miss path if the image was built without an initrd
+static void bench_initrd_find(void)
+{
+	initrd_file_t file;
+	bench_sink = initrd_find("LICENSE", &file) ? file.size : 0;
+}
+
+#if !HOST
+static void bench_interrupt(void)
+{
+	asm volatile("int $0x81");
+}
+#endif
+
+static void bench_descriptor(void)
+{
+	set_interrupt(0x81, KERNEL_SEGMENT, isr0x81, DESCRIPTOR_ACCESS_INTGATE);
+}
+
+#if OS86
+enum
+{
+	BENCH_UNREAL_SIZE = 0x8000,
+};
+
+// the copies above 1 MiB, and the end of the conventional memory the ones below may use
+#define BENCH_UNREAL_HIGH    0x100000UL
+#define BENCH_UNREAL_LOW_END 0x9F000UL
+
+// the source of the copies below 1 MiB, after the initrd, or 0 if the initrd leaves no room for them
+static uint32_t bench_unreal_low;
+
+// 32 KiB through far pointers, normalized between the runs of the string instructions
+static void bench_far_copy(void)
+{
+	if(bench_unreal_low != 0)
+	{
+		_fmemcpy(MK_FP((bench_unreal_low + BENCH_UNREAL_SIZE) >> 4, 0), MK_FP(bench_unreal_low >> 4, 0), BENCH_UNREAL_SIZE);
+	}
+}
+
+// the same copy with 32-bit offsets in unreal mode
+static void bench_unreal_copy(void)
+{
+	if(bench_unreal_low != 0)
+	{
+		unreal_copy(bench_unreal_low + BENCH_UNREAL_SIZE, bench_unreal_low, BENCH_UNREAL_SIZE);
+	}
+}
+
+// out of reach for real mode without unreal mode, a no-op then
+static void bench_unreal_high(void)
+{
+	unreal_copy(BENCH_UNREAL_HIGH + BENCH_UNREAL_SIZE, BENCH_UNREAL_HIGH, BENCH_UNREAL_SIZE);
+}
+#endif
+
+#if !OS86 && !HOST
+// the whole disk in buffer sized requests, each cylinder read once, time per 1440 KiB
+static void bench_floppy_sequential(void)
+{
+	floppy_cache_invalidate();
+	for(uint32_t lba = 0; lba < FLOPPY_SECTORS; lba += BENCH_BUFFER_SIZE / FLOPPY_SECTOR_SIZE)
+	{
+		floppy_read(lba, BENCH_BUFFER_SIZE / FLOPPY_SECTOR_SIZE, bench_buffer[0]);
+	}
+}
+
+static void bench_floppy_cached(void)
+{
+	floppy_read(FLOPPY_SECTORS_PER_TRACK, BENCH_BUFFER_SIZE / FLOPPY_SECTOR_SIZE, bench_buffer[0]);
+}
+
+enum
+{
+	// sectors per request, the sequential ones as large as the buffer allows
+#if OS386 || OS64
+	BENCH_DISK_SEQUENTIAL = 128,
+#else
+	BENCH_DISK_SEQUENTIAL = BENCH_BUFFER_SIZE / ATA_SECTOR_SIZE,
+#endif
+	BENCH_DISK_RANDOM = BENCH_BUFFER_SIZE / ATA_SECTOR_SIZE,
+};
+
+#if OS386 || OS64
+enum
+{
+	// as large as the largest request, the scatter case uses every other page of it
+	BENCH_DISK_BUFFER_SIZE = 32 * BENCH_BUFFER_SIZE,
+};
+
+// too large for the kernel image, which has to stay below the initrd, and handed to the devices by physical address,
+// so it comes from the frames of the identity map when the benchmarks start, NULL if there were not enough of them
+static uint8_t * bench_disk_buffer;
+# define bench_disk_ready() (bench_disk_buffer != NULL)
+#else
+# define bench_disk_buffer bench_buffer[0]
+# define bench_disk_ready() true
+#endif
+static uint32_t bench_disk_lba;
+static uint32_t bench_disk_seed = 1;
+
+static inline void bench_disk_sequential(ata_mode_t mode)
+{
+	if(!bench_disk_ready())
+	{
+		return;
+	}
+	if(bench_disk_lba + BENCH_DISK_SEQUENTIAL > ata_sectors)
+	{
+		bench_disk_lba = 0;
+	}
+	ata_transfer(mode, bench_disk_lba, BENCH_DISK_SEQUENTIAL, bench_disk_buffer, false);
+	bench_disk_lba += BENCH_DISK_SEQUENTIAL;
+}
+
+static inline void bench_disk_random(ata_mode_t mode)
+{
+	if(!bench_disk_ready() || ata_sectors < BENCH_DISK_RANDOM)
+	{
+		return;
+	}
+	// the same pseudo random sequence in every run
+	bench_disk_seed = bench_disk_seed * 1103515245 + 12345;
+	uint32_t lba = (bench_disk_seed >> 8) % (ata_sectors / BENCH_DISK_RANDOM) * BENCH_DISK_RANDOM;
+	ata_transfer(mode, lba, BENCH_DISK_RANDOM, bench_disk_buffer, false);
+}
+
+static void bench_ata_pio_sequential(void)
+{
+	bench_disk_sequential(ATA_MODE_PIO);
+}
+
+static void bench_ata_pio_random(void)
+{
+	bench_disk_random(ATA_MODE_PIO);
+}
+
+#if OS386 || OS64
+static void bench_ata_dma_sequential(void)
+{
+	bench_disk_sequential(ATA_MODE_DMA);
+}
+
+static void bench_ata_dma_random(void)
+{
+	bench_disk_random(ATA_MODE_DMA);
+}
+#endif
+#endif
+
+#if OS386 || OS64
+static void bench_pci_config(void)
+{
+	bench_sink = pci_config_read32(0, 0, 0, PCI_CONFIG_ID);
+}
+#endif
+
+#if (OS386 || OS64) && !HOST
+enum
+{
+	BENCH_VIRTIO_SECTORS = BENCH_BUFFER_SIZE / VIRTIO_BLK_SECTOR_SIZE,
+	// requests announced together by the batch case
+	BENCH_VIRTIO_BATCH = 16,
+};
+
+static uint32_t bench_virtio_sector;
+static uint32_t bench_virtio_seed = 1;
+
+static inline uint32_t bench_virtio_random(void)
+{
+	bench_virtio_seed = bench_virtio_seed * 1103515245 + 12345;
+	return (bench_virtio_seed >> 8) % (virtio_blk_capacity / BENCH_VIRTIO_SECTORS) * BENCH_VIRTIO_SECTORS;
+}
+
+static void bench_virtio_sequential(void)
+{
+	if(!bench_disk_ready())
+	{
+		return;
+	}
+	if(bench_virtio_sector + BENCH_DISK_SEQUENTIAL > virtio_blk_capacity)
+	{
+		bench_virtio_sector = 0;
+	}
+	virtio_blk_polling = false;
+	virtio_blk_transfer(bench_virtio_sector, BENCH_DISK_SEQUENTIAL, bench_disk_buffer, false);
+	bench_virtio_sector += BENCH_DISK_SEQUENTIAL;
+}
+
+/* One random read at a time, the time per operation is the latency of a request */
+static inline void bench_virtio_random_read(bool polling)
+{
+	if(!bench_disk_ready() || virtio_blk_capacity < BENCH_VIRTIO_SECTORS)
+	{
+		return;
+	}
+	virtio_blk_polling = polling;
+	virtio_blk_transfer(bench_virtio_random(), BENCH_VIRTIO_SECTORS, bench_disk_buffer, false);
+}
+
+static void bench_virtio_interrupt(void)
+{
+	bench_virtio_random_read(false);
+}
+
+static void bench_virtio_poll(void)
+{
+	bench_virtio_random_read(true);
+}
+
+/* BENCH_VIRTIO_BATCH random reads in flight together, with a single notification */
+static void bench_virtio_batch(void)
+{
+	if(!bench_disk_ready() || virtio_blk_capacity < BENCH_VIRTIO_SECTORS)
+	{
+		return;
+	}
+	virtio_blk_polling = true;
+	for(unsigned i = 0; i < BENCH_VIRTIO_BATCH; i++)
+	{
+		virtio_segment_t segment = { bench_disk_buffer + i * BENCH_BUFFER_SIZE, BENCH_BUFFER_SIZE };
+		virtio_blk_submit(bench_virtio_random(), &segment, 1, false);
+	}
+	virtio_blk_complete();
+}
+
+/* One request scattered over every other page of the buffer */
+static void bench_virtio_scatter(void)
+{
+	if(!bench_disk_ready() || virtio_blk_capacity < BENCH_VIRTIO_SECTORS * VIRTIO_BLK_SEGMENTS)
+	{
+		return;
+	}
+	virtio_blk_polling = true;
+	virtio_segment_t segments[VIRTIO_BLK_SEGMENTS];
+	unsigned count = virtio_blk_seg_max;
+	for(unsigned i = 0; i < count; i++)
+	{
+		segments[i].buffer = bench_disk_buffer + i * 2 * BENCH_BUFFER_SIZE;
+		segments[i].size = BENCH_BUFFER_SIZE;
+	}
+	virtio_blk_submit(0, segments, count, false);
+	virtio_blk_complete();
+}
+
+/* The text of the serial case through the virtio console, until the device has taken all of it */
+static void bench_virtio_console(void)
+{
+	virtio_console_write(bench_buffer[1], BENCH_BUFFER_SIZE);
+	while(virtio_console_transmit.in_flight != 0 && virtio_console_drain())
+		;
+}
+#endif
+
+enum
+{
+	BENCH_BLOCKS = BENCH_BUFFER_SIZE / BLOCK_SIZE,
+	// several times the cache, so that sequential reads keep missing, the writes go to the range after it
+	BENCH_BLOCK_SPAN = BLOCK_BUFFERS * 4,
+};
+
+// hd0, the scratch disk of the benchmark, or a RAM disk in the host build
+static block_device_t * bench_block_device;
+static uint32_t bench_block_read_next, bench_block_write_next;
+
+#if HOST
+static uint8_t bench_ram_disk[BENCH_BLOCK_SPAN * 2][BLOCK_SIZE];
+
+static bool bench_ram_transfer(block_device_t * device, uint32_t block, uint16_t count, void * buffer, bool write)
+{
+	(void) device;
+
+	if(write)
+		memcpy(bench_ram_disk[block], buffer, count * BLOCK_SIZE);
+	else
+		memcpy(buffer, bench_ram_disk[block], count * BLOCK_SIZE);
+	return true;
+}
+#endif
+
+static void bench_block_sequential(void)
+{
+	if(bench_block_device == NULL)
+	{
+		return;
+	}
+	block_read(bench_block_device, bench_block_read_next, BENCH_BLOCKS, bench_buffer[0]);
+	bench_block_read_next = (bench_block_read_next + BENCH_BLOCKS) % BENCH_BLOCK_SPAN;
 }
 
-static inline void screen_putdec(ssize_t value)
+static void bench_block_hot(void)
 {
-	// this approximates the number of digits for around 10 bytes
-	char buffer[(sizeof(value) * 5 + 1) / 2];
-	int ptr = sizeof(buffer);
-	if(value < 0)
+	if(bench_block_device == NULL)
 	{
-		screen_putchar('-');
-		value = -value;
+		return;
 	}
-	buffer[--ptr] = '\0';
-	do
+	block_read(bench_block_device, 0, BENCH_BLOCKS, bench_buffer[0]);
+}
+
+static void bench_block_write(void)
+{
+	if(bench_block_device == NULL)
 	{
-		buffer[--ptr] = '0' + (value % 10);
-		value /= 10;
-	} while(value != 0);
-	screen_putstr(&buffer[ptr]);
+		return;
+	}
+	block_write(bench_block_device, BENCH_BLOCK_SPAN + bench_block_write_next, BENCH_BLOCKS, bench_buffer[1]);
+	bench_block_write_next = (bench_block_write_next + BENCH_BLOCKS) % BENCH_BLOCK_SPAN;
 }
 
-static volatile uint32_t timer_tick;
+// kernel.c on the boot floppy, read round and round through the block cache
+static fat_file_t bench_fat_file;
+static bool bench_fat_open;
 
-static inline void timer_interrupt_handler(registers_t * registers)
+static void bench_fat_stat(void)
 {
-	(void) registers;
+	fat_stat_t stat;
+	fat_stat("kernel.c", &stat);
+}
 
-	timer_tick ++;
+static void bench_fat_read(void)
+{
+	if(!bench_fat_open)
+	{
+		return;
+	}
+	if(fat_read(&bench_fat_file, bench_buffer[0], BENCH_BUFFER_SIZE) < BENCH_BUFFER_SIZE)
+	{
+		fat_seek(&bench_fat_file, 0);
+	}
+}
 
-	screen_x = SCREEN_WIDTH - 1;
-	screen_y = 0;
-	screen_attribute = 0x0F;
-	screen_putchar("/-\\|"[timer_tick & 3]);
+#if !OS86
+static void bench_segment(void)
+{
+	descriptor_set_segment(&gdt[SEL_USER_SS / 8], 0, bench_sink, DESCRIPTOR_ACCESS_DATA | DESCRIPTOR_ACCESS_CPL3, 0);
 }
+#endif
 
-static const struct
+#if OS286
+enum
 {
-	char normal;
-	char shifted;
-} keyboard_scancode_table[256] =
+	BENCH_SEGMENT_COPY_SIZE = 0x8000,
+};
+
+// free memory above 1 MiB, below the floppy cache
+#define BENCH_SEGMENT_HIGH 0x100000UL
+
+static void bench_segment_alloc(void)
 {
-	[0x01] = { '\33', '\33' },
-	[0x02] = { '1', '!' },
-	[0x03] = { '2', '@' },
-	[0x04] = { '3', '#' },
-	[0x05] = { '4', '$' },
-	[0x06] = { '5', '%' },
-	[0x07] = { '6', '^' },
-	[0x08] = { '7', '&' },
-	[0x09] = { '8', '*' },
-	[0x0A] = { '9', '(' },
-	[0x0B] = { '0', ')' },
-	[0x0C] = { '-', '_' },
-	[0x0D] = { '=', '+' },
-	[0x0E] = { '\b', '\b' },
-	[0x0F] = { '\t', '\t' },
-	[0x10] = { 'q', 'Q' },
-	[0x11] = { 'w', 'W' },
-	[0x12] = { 'e', 'E' },
-	[0x13] = { 'r', 'R' },
-	[0x14] = { 't', 'T' },
-	[0x15] = { 'y', 'Y' },
-	[0x16] = { 'u', 'U' },
-	[0x17] = { 'i', 'I' },
-	[0x18] = { 'o', 'O' },
-	[0x19] = { 'p', 'P' },
-	[0x1A] = { '[', '{' },
-	[0x1B] = { ']', '}' },
-	[0x1C] = { '\n', '\n' },
+	uint16_t selector = segment_alloc(BENCH_SEGMENT_HIGH, 0xFFFF);
+	if(selector != 0)
+	{
+		segment_free(selector);
+	}
+}
+
+// a hit in the window cache
+static void bench_segment_window(void)
+{
+	bench_sink = FP_SEG(segment_window(BENCH_SEGMENT_HIGH, BENCH_BUFFER_SIZE));
+}
+
+// 32 KiB above 1 MiB, through two windows
+static void bench_segment_copy(void)
+{
+	segment_copy(BENCH_SEGMENT_HIGH + BENCH_SEGMENT_COPY_SIZE, BENCH_SEGMENT_HIGH, BENCH_SEGMENT_COPY_SIZE);
+}
+#endif
+
+/*
+ * The timer cases work on a wheel of their own, kept full of timers that put themselves back in with a new random
+ * delay as they expire, like driver timeouts that keep coming and going. Only the timer_tick case advances it, and
+ * timer_add adds one more timer and cancels it again.
+ */
+
+enum
+{
+#if OS86 || OS286
+	BENCH_TIMERS = 128,
+	BENCH_TIMER_SPAN = 1024,
+#else
+	BENCH_TIMERS = 131072,
+	// through the first three levels, eight timers expire in each tick
+	BENCH_TIMER_SPAN = 16384,
+#endif
+};
+
+static timer_wheel_t bench_timer_wheel;
+#if (OS386 || OS64) && !HOST
+// too large for the kernel image, allocated from the heap
+static timer_t * bench_timers;
+#else
+static timer_t bench_timers[BENCH_TIMERS];
+#endif
+// one timer that stays pending and one that is added and cancelled
+static timer_t bench_timer_moved, bench_timer_added;
+static uint32_t bench_timer_seed = 1;
+
+static inline uint32_t bench_timer_expiry(void)
+{
+	bench_timer_seed = bench_timer_seed * 1103515245 + 12345;
+	return bench_timer_wheel.now + 1 + ((bench_timer_seed >> 8) & (BENCH_TIMER_SPAN - 1));
+}
+
+static void bench_timer_expired(timer_t * timer)
+{
+	timer_wheel_add(&bench_timer_wheel, timer, bench_timer_expiry());
+}
+
+static inline void bench_timer_fill(void)
+{
+	timer_init(&bench_timer_moved, bench_timer_expired);
+	timer_init(&bench_timer_added, bench_timer_expired);
+	timer_wheel_add(&bench_timer_wheel, &bench_timer_moved, bench_timer_expiry());
+#if (OS386 || OS64) && !HOST
+	bench_timers = vm_heap_alloc(BENCH_TIMERS * sizeof(timer_t));
+	if(bench_timers == NULL)
+	{
+		return;
+	}
+#endif
+	for(uint32_t i = 0; i < BENCH_TIMERS; i++)
+	{
+		timer_init(&bench_timers[i], bench_timer_expired);
+		timer_wheel_add(&bench_timer_wheel, &bench_timers[i], bench_timer_expiry());
+	}
+}
+
+static void bench_timer_add_cancel(void)
+{
+	timer_wheel_add(&bench_timer_wheel, &bench_timer_added, bench_timer_expiry());
+	timer_wheel_cancel(&bench_timer_wheel, &bench_timer_added);
+}
+
+static void bench_timer_modify(void)
+{
+	timer_wheel_add(&bench_timer_wheel, &bench_timer_moved, bench_timer_expiry());
+}
+
+// one tick, with its expiries and cascades
+static void bench_timer_tick(void)
+{
+	timer_wheel_run(&bench_timer_wheel, bench_timer_wheel.now);
+}
+
+#if (OS386 || OS64) && !HOST
+enum
+{
+	// unused virtual addresses, backed by identity mapped memory that is only read
+	BENCH_VM_BASE = 0x40000000,
+	BENCH_VM_PHYSICAL = 0x800000,
+	BENCH_VM_PAGES = 16,
+	// a 4 MiB region touched once per page, mapped with small and with large pages
+	BENCH_TLB_SIZE = 0x400000,
+	BENCH_TLB_SMALL = BENCH_VM_BASE + 0x1000000,
+	BENCH_TLB_LARGE = BENCH_VM_BASE + 0x2000000,
+};
+
+static vm_space_t bench_space;
+
+static void bench_vm_map_pages(void)
+{
+	vm_map(&vm_kernel_space, BENCH_VM_BASE, BENCH_VM_PHYSICAL, BENCH_VM_PAGES * VM_PAGE_SIZE, VM_WRITE | VM_SMALL_PAGES);
+	vm_unmap(&vm_kernel_space, BENCH_VM_BASE, BENCH_VM_PAGES * VM_PAGE_SIZE);
+}
+
+static void bench_vm_map_large(void)
+{
+	vm_map(&vm_kernel_space, BENCH_VM_BASE, BENCH_VM_PHYSICAL, VM_LARGE_PAGE_SIZE, VM_WRITE);
+	vm_unmap(&vm_kernel_space, BENCH_VM_BASE, VM_LARGE_PAGE_SIZE);
+}
+
+static inline void bench_tlb_touch(size_t base)
+{
+	int sum = 0;
+	// the offset within the page moves along so that the accesses do not all compete for the same cache set
+	for(size_t page = 0; page < BENCH_TLB_SIZE / VM_PAGE_SIZE; page++)
+	{
+		sum += *(volatile uint8_t *)(base + page * VM_PAGE_SIZE + (page * 64 & (VM_PAGE_SIZE - 1)));
+	}
+	bench_sink = sum;
+}
+
+static void bench_tlb_small(void)
+{
+	static bool mapped;
+	if(!mapped)
+	{
+		mapped = vm_map(&vm_kernel_space, BENCH_TLB_SMALL, BENCH_VM_PHYSICAL, BENCH_TLB_SIZE, VM_SMALL_PAGES);
+	}
+	bench_tlb_touch(BENCH_TLB_SMALL);
+}
+
+static void bench_tlb_large(void)
+{
+	static bool mapped;
+	if(!mapped)
+	{
+		mapped = vm_map(&vm_kernel_space, BENCH_TLB_LARGE, BENCH_VM_PHYSICAL, BENCH_TLB_SIZE, 0);
+	}
+	bench_tlb_touch(BENCH_TLB_LARGE);
+}
+
+static void bench_vm_switch(void)
+{
+	if(bench_space.root == NULL && !vm_space_create(&bench_space))
+	{
+		return;
+	}
+	vm_switch(&bench_space);
+	vm_switch(&vm_kernel_space);
+}
+
+/* The first access to a fresh page of the heap: the page fault, a zeroed frame and its mapping */
+static void bench_vm_zero_fill(void)
+{
+	volatile uint8_t * page = vm_heap_alloc(VM_PAGE_SIZE);
+	if(page != NULL)
+	{
+		*page = 1;
+	}
+}
+#endif
+
+#if OS64
+// the scans go through the lines of text in bench_buffer[1], which holds no zero byte
+static fpu_context_t bench_fpu_contexts[2];
+static bool bench_fpu_ready;
+
+static void bench_scan_words(void)
+{
+	bench_sink = fpu_scan_words((const uint8_t *)bench_buffer[1], 0, BENCH_BUFFER_SIZE);
+}
+
+/* Through the vector scan the processor has, as the rest of the kernel would */
+static void bench_scan(void)
+{
+	bench_sink = fpu_scan(&fpu_kernel_context, bench_buffer[1], 0, BENCH_BUFFER_SIZE);
+}
+
+static void bench_scan_sse2(void)
+{
+	if(!fpu_context_ready(&fpu_kernel_context))
+	{
+		return;
+	}
+	kernel_fpu_begin(&fpu_kernel_context);
+	bench_sink = fpu_scan_sse2((const uint8_t *)bench_buffer[1], 0, BENCH_BUFFER_SIZE);
+	kernel_fpu_end(&fpu_kernel_context);
+}
+
+static void bench_scan_avx2(void)
+{
+	if(!fpu_avx2)
+	{
+		return;
+	}
+	kernel_fpu_begin(&fpu_kernel_context);
+	bench_sink = fpu_scan_avx2((const uint8_t *)bench_buffer[1], 0, BENCH_BUFFER_SIZE);
+	kernel_fpu_end(&fpu_kernel_context);
+}
+
+/* A region of the context that owns the registers already */
+static void bench_fpu_region(void)
+{
+	kernel_fpu_begin(&fpu_kernel_context);
+	kernel_fpu_end(&fpu_kernel_context);
+}
+
+/* Two contexts taking turns, each region saves the other one's registers and loads its own */
+static void bench_fpu_switch(void)
+{
+	if(!bench_fpu_ready)
+	{
+		return;
+	}
+	for(int i = 0; i < 2; i++)
+	{
+		kernel_fpu_begin(&bench_fpu_contexts[i]);
+		bench_sink = fpu_scan_sse2((const uint8_t *)bench_buffer[1], 0, 16);
+		kernel_fpu_end(&bench_fpu_contexts[i]);
+	}
+}
+#endif
+
+static void bench_crc32c(void)
+{
+	bench_sink = crc32c(0, bench_buffer[1], BENCH_BUFFER_SIZE);
+}
+
+/* The table version, also on CPUs with SSE4.2 */
+static void bench_crc32c_table(void)
+{
+	bench_sink = ~crc32c_table(0xFFFFFFFF, (const uint8_t *)bench_buffer[1], BENCH_BUFFER_SIZE);
+}
+
+static const bench_case_t bench_cases[] =
+{
+	{ "empty",          bench_empty,              256, 0 },
+	{ "memcpy_16",      bench_memcpy_16,          256, 16 },
+	{ "memcpy_256",     bench_memcpy_256,         64,  256 },
+	{ "memcpy_buffer",  bench_memcpy_buffer,      16,  BENCH_BUFFER_SIZE },
+	{ "memmove_buffer", bench_memmove_overlap,    16,  BENCH_BUFFER_SIZE },
+	{ "memset_buffer",  bench_memset_buffer,      16,  BENCH_BUFFER_SIZE },
+	{ "scroll",         bench_scroll,             4,   0 },
+	{ "putchar",        bench_putchar,            64,  0 },
+	{ "serial",         bench_serial,             1,   BENCH_BUFFER_SIZE },
+	{ "ksnprintf",      bench_kprintf,            16,  0 },
+	{ "input",          bench_input,              256, 0 },
+	{ "initrd_find",    bench_initrd_find,        256, 0 },
+	{ "crc32c",         bench_crc32c,             16,  BENCH_BUFFER_SIZE },
+	{ "crc32c_table",   bench_crc32c_table,       4,   BENCH_BUFFER_SIZE },
+	{ "timer_add",      bench_timer_add_cancel,   256, 0 },
+	{ "timer_modify",   bench_timer_modify,       256, 0 },
+	{ "timer_tick",     bench_timer_tick,         4,   0 },
+#if !HOST
+	{ "interrupt",      bench_interrupt,          4,   0 },
+#endif
+	{ "descriptor",     bench_descriptor,         256, 0 },
+#if !OS86
+	{ "segment",        bench_segment,            256, 0 },
+#endif
+#if OS286
+	{ "segment_alloc",  bench_segment_alloc,      256, 0 },
+	{ "segment_window", bench_segment_window,     256, 0 },
+	{ "segment_copy",   bench_segment_copy,       16,  BENCH_SEGMENT_COPY_SIZE },
+#endif
+#if OS86
+	{ "far_copy",       bench_far_copy,           16,  BENCH_UNREAL_SIZE },
+	{ "unreal_copy",    bench_unreal_copy,        16,  BENCH_UNREAL_SIZE },
+	{ "unreal_high",    bench_unreal_high,        16,  BENCH_UNREAL_SIZE },
+#endif
+#if OS386 || OS64
+	{ "pci_config",     bench_pci_config,         256, 0 },
+#endif
+#if !OS86 && !HOST
+	{ "floppy_seq",     bench_floppy_sequential,  1,   FLOPPY_SECTORS * FLOPPY_SECTOR_SIZE },
+	{ "floppy_cached",  bench_floppy_cached,      64,  BENCH_BUFFER_SIZE },
+	{ "ata_pio_seq",    bench_ata_pio_sequential, 16,  BENCH_DISK_SEQUENTIAL * ATA_SECTOR_SIZE },
+	{ "ata_pio_rand",   bench_ata_pio_random,     64,  BENCH_DISK_RANDOM * ATA_SECTOR_SIZE },
+#endif
+	{ "block_seq",      bench_block_sequential,   16,  BENCH_BUFFER_SIZE },
+	{ "block_hot",      bench_block_hot,          64,  BENCH_BUFFER_SIZE },
+	{ "block_write",    bench_block_write,        16,  BENCH_BUFFER_SIZE },
+	{ "fat_stat",       bench_fat_stat,           16,  0 },
+	{ "fat_read",       bench_fat_read,           16,  BENCH_BUFFER_SIZE },
+#if (OS386 || OS64) && !HOST
+	{ "ata_dma_seq",    bench_ata_dma_sequential, 16,  BENCH_DISK_SEQUENTIAL * ATA_SECTOR_SIZE },
+	{ "ata_dma_rand",   bench_ata_dma_random,     64,  BENCH_DISK_RANDOM * ATA_SECTOR_SIZE },
+	{ "virtio_seq",     bench_virtio_sequential,  16,  BENCH_DISK_SEQUENTIAL * VIRTIO_BLK_SECTOR_SIZE },
+	{ "virtio_irq",     bench_virtio_interrupt,   64,  BENCH_BUFFER_SIZE },
+	{ "virtio_poll",    bench_virtio_poll,        64,  BENCH_BUFFER_SIZE },
+	{ "virtio_batch",   bench_virtio_batch,       16,  BENCH_VIRTIO_BATCH * BENCH_BUFFER_SIZE },
+	{ "virtio_scatter", bench_virtio_scatter,     16,  VIRTIO_BLK_SEGMENTS * BENCH_BUFFER_SIZE },
+	{ "virtio_console", bench_virtio_console,     4,   BENCH_BUFFER_SIZE },
+	{ "vm_map_pages",   bench_vm_map_pages,       16,  0 },
+	{ "vm_map_large",   bench_vm_map_large,       16,  0 },
+	{ "tlb_small",      bench_tlb_small,          4,   0 },
+	{ "tlb_large",      bench_tlb_large,          4,   0 },
+	{ "vm_switch",      bench_vm_switch,          64,  0 },
+	{ "vm_zero_fill",   bench_vm_zero_fill,       16,  VM_PAGE_SIZE },
+#endif
+#if OS64
+	{ "scan",           bench_scan,               16,  BENCH_BUFFER_SIZE },
+	{ "scan_words",     bench_scan_words,         16,  BENCH_BUFFER_SIZE },
+	{ "scan_sse2",      bench_scan_sse2,          16,  BENCH_BUFFER_SIZE },
+	{ "scan_avx2",      bench_scan_avx2,          16,  BENCH_BUFFER_SIZE },
+	{ "fpu_region",     bench_fpu_region,         256, 0 },
+	{ "fpu_switch",     bench_fpu_switch,         64,  0 },
+#endif
+};
+
+__attribute__((format(printf, 1, 2)))
+static inline void bench_printf(const char * format, ...)
+{
+	char buffer[128];
+	va_list args;
+	va_start(args, format);
+	size_t length = kvsnprintf(buffer, sizeof buffer, format, args);
+	va_end(args);
+	length = length < sizeof buffer ? length : sizeof buffer - 1;
+	serial_write(buffer, length);
+	if(kprintf_mirror != NULL)
+	{
+		kprintf_mirror(buffer, length);
+	}
+}
+
+static inline void bench_case_run(const bench_case_t * test)
+{
+	uint32_t samples[BENCH_SAMPLES];
+	// the samples of the slower cases add up to more than 32 bits
+	uint64_t total = 0;
+	uint32_t operations = (uint32_t)test->operations * BENCH_SCALE;
+
+	// one untimed round warms up caches and the TLB
+	test->run();
+	for(int i = 0; i < BENCH_SAMPLES; i++)
+	{
+		uint32_t start = bench_read();
+		for(uint32_t j = 0; j < operations; j++)
+		{
+			test->run();
+		}
+		uint32_t sample = bench_read() - start;
+
+		// insertion sort as the samples arrive
+		int k;
+		for(k = i; k > 0 && samples[k - 1] > sample; k--)
+		{
+			samples[k] = samples[k - 1];
+		}
+		samples[k] = sample;
+		total += sample;
+	}
+
+	uint32_t median = samples[BENCH_SAMPLES / 2 - 1] + (samples[BENCH_SAMPLES / 2] - samples[BENCH_SAMPLES / 2 - 1]) / 2;
+	bench_printf("bench case=%s ops=%lu min=%lu median=%lu mean=%lu max=%lu",
+		test->name, (unsigned long)operations,
+		(unsigned long)samples[0],
+		(unsigned long)median,
+		(unsigned long)(total / BENCH_SAMPLES),
+		(unsigned long)samples[BENCH_SAMPLES - 1]);
+	if(test->bytes != 0 && bench_frequency != 0)
+	{
+		// from the median, throughput in 512 byte units to stay within 32 bits
+		uint32_t blocks_per_second = bench_rate(operations * ((test->bytes + 511) / 512), median);
+		uint32_t centi_megabytes = blocks_per_second / 625 * 32 + blocks_per_second % 625 * 32 / 625;
+		bench_printf(" iops=%lu mb_s=%lu.%02lu",
+			(unsigned long)bench_rate(operations, median),
+			(unsigned long)(centi_megabytes / 100), (unsigned long)(centi_megabytes % 100));
+	}
+	bench_printf("\n");
+}
+
+static inline noreturn void bench_run(void)
+{
+	const char * unit = "pit";
+#if OS386 || OS64
+	if(cpu_has_cpuid() && cpuid(0, 0).eax >= 1 && (cpuid(1, 0).edx & CPUID_1_EDX_TSC) != 0)
+	{
+		bench_use_tsc = true;
+		unit = "tsc";
+	}
+#endif
+#if !HOST
+	bench_frequency = PIT_FREQUENCY;
+# if OS386 || OS64
+	if(bench_use_tsc)
+	{
+		// against the PIT over a twentieth of a second
+		uint32_t clock_start = clock_read();
+		uint32_t start = bench_read();
+		while(clock_read() - clock_start < PIT_FREQUENCY / 20)
+			;
+		bench_frequency = (bench_read() - start) * 20;
+	}
+# endif
+#endif
+
+#if HOST
+	block_register("hd0", BENCH_BLOCK_SPAN * 2, bench_ram_transfer, false, NULL);
+#endif
+	bench_block_device = block_find("hd0");
+	bench_fat_open = fat_open("kernel.c", &bench_fat_file);
+	bench_timer_fill();
+#if (OS386 || OS64) && !HOST
+	bench_disk_buffer = (uint8_t *)vm_frames_alloc(BENCH_DISK_BUFFER_SIZE / VM_PAGE_SIZE);
+#endif
+#if OS64
+	bench_fpu_ready = fpu_context_init(&bench_fpu_contexts[0]) && fpu_context_init(&bench_fpu_contexts[1]);
+#endif
+#if OS86
+	uint32_t unreal_low = INITRD_ADDRESS + (uint32_t)initrd_sectors * 512;
+	if(unreal_low + 2UL * BENCH_UNREAL_SIZE <= BENCH_UNREAL_LOW_END)
+	{
+		bench_unreal_low = unreal_low;
+	}
+#endif
+	// lines of printable text for the console cases
+	for(size_t i = 0; i < BENCH_BUFFER_SIZE; i++)
+	{
+		bench_buffer[1][i] = i % 64 == 63 ? '\n' : ' ' + i % 64;
+	}
+
+	serial_init();
+#if (OS386 || OS64) && !HOST
+	// with the kernel in the initrd (make bench-386-kexec), the first run only reloads it, the second one reports how
+	// long that took
+	uint64_t reload_tsc = 0;
+	bool reloaded = kexec_reloaded(&reload_tsc);
+	initrd_file_t kernel;
+	if(!reloaded && initrd_find("kernel.bin", &kernel))
+	{
+		bench_printf("bench kexec\n");
+		kexec(kernel.data, kernel.size);
+	}
+#endif
+	bench_printf("bench begin target=%s unit=%s hz=%lu samples=%u\n", bench_target, unit, (unsigned long)bench_frequency, BENCH_SAMPLES);
+#if (OS386 || OS64) && !HOST
+	if(bench_boot_tsc > reload_tsc && bench_frequency >= 1000000)
+	{
+		// from the reset, or from the start of the reload
+		bench_printf("bench boot us=%lu loader=%s\n", (unsigned long)((bench_boot_tsc - reload_tsc) / (bench_frequency / 1000000)),
+			reloaded ? "kexec" : multiboot_memory != 0 ? "multiboot" : "floppy");
+	}
+#endif
+	for(size_t i = 0; i < sizeof bench_cases / sizeof bench_cases[0]; i++)
+	{
+		bench_case_run(&bench_cases[i]);
+	}
+	block_sync();
+	for(uint8_t i = 0; i < block_device_count; i++)
+	{
+		char stats[112];
+		block_format_stats(stats, sizeof stats, &block_devices[i]);
+		bench_printf("bench block %s\n", stats);
+	}
+	bench_printf("bench timers pending=%lu expired=%lu cascaded=%lu\n", (unsigned long)bench_timer_wheel.stats.pending,
+		(unsigned long)bench_timer_wheel.stats.expired, (unsigned long)bench_timer_wheel.stats.cascaded);
+#if IRQTRACE
+	bench_printf("bench irqoff windows=%lu total_us=%lu\n", (unsigned long)irqtrace_stats.windows,
+		(unsigned long)clock_to_microseconds(irqtrace_stats.total));
+	for(int i = 0; i < IRQTRACE_WINDOWS && irqtrace_windows[i].clocks != 0; i++)
+	{
+		char window[80];
+		irqtrace_format_window(window, sizeof window, &irqtrace_windows[i]);
+		bench_printf("bench irqoff_window %s\n", window);
+	}
+#endif
+#if OS386 || OS64
+	bench_printf("bench crc32c sse42=%u image=%s initrd=%s\n", crc32c_sse42, checksum_names[image_checksum],
+		checksum_names[initrd_checksum]);
+#else
+	bench_printf("bench crc32c image=%s initrd=%s\n", checksum_names[image_checksum], checksum_names[initrd_checksum]);
+#endif
+#if OS286
+	bench_printf("bench segment allocated=%u window_hits=%lu window_misses=%lu\n", segment_stats.allocated,
+		(unsigned long)segment_stats.window_hits, (unsigned long)segment_stats.window_misses);
+#endif
+#if OS86
+	bench_printf("bench unreal available=%u copies=%lu reloads=%lu\n", unreal_available,
+		(unsigned long)unreal_stats.copies, (unsigned long)unreal_stats.reloads);
+#endif
+#if (OS386 || OS64) && !HOST
+	if(virtio_blk_port != 0)
+	{
+		bench_printf("bench virtio requests=%lu notifications=%lu interrupts=%lu\n", (unsigned long)virtio_blk_stats.requests,
+			(unsigned long)virtio_blk_queue.notifications, (unsigned long)virtio_blk_stats.interrupts);
+	}
+# if OS64
+	bench_printf("bench fpu xsave=%u avx2=%u traps=%lu saves=%lu\n", fpu_xsave, fpu_avx2,
+		(unsigned long)fpu_stats.traps, (unsigned long)fpu_stats.saves);
+# endif
+	bench_printf("bench vm faults=%lu zero_fills=%lu heap=%lu\n", (unsigned long)vm_stats.faults,
+		(unsigned long)vm_stats.zero_fills, (unsigned long)(vm_heap_next - VM_HEAP_BASE));
+	if(virtio_console_port != 0)
+	{
+		bench_printf("bench virtio_console bytes=%lu submissions=%lu notifications=%lu dropped=%lu\n",
+			(unsigned long)virtio_console_stats.bytes, (unsigned long)virtio_console_stats.submissions,
+			(unsigned long)virtio_console_transmit.notifications, (unsigned long)virtio_console_stats.dropped);
+	}
+#endif
+	bench_printf("bench end\n");
 
-	[0x1E] = { 'a', 'A' },
-	[0x1F] = { 's', 'S' },
-	[0x20] = { 'd', 'D' },
-	[0x21] = { 'f', 'F' },
-	[0x22] = { 'g', 'G' },
-	[0x23] = { 'h', 'H' },
-	[0x24] = { 'j', 'J' },
-	[0x25] = { 'k', 'K' },
-	[0x26] = { 'l', 'L' },
-	[0x27] = { ';', ':' },
-	[0x28] = { '\'', '"' },
-	[0x29] = { '`', '~' },
+	outp(PORT_DEBUG_EXIT, 0);
+	// not running under QEMU
+	disable_interrupts();
+	for(;;)
+		asm volatile("hlt");
+}
+#endif
 
-	[0x2B] = { '\\', '|' },
-	[0x2C] = { 'z', 'Z' },
-	[0x2D] = { 'x', 'X' },
-	[0x2E] = { 'c', 'C' },
-	[0x2F] = { 'v', 'V' },
-	[0x30] = { 'b', 'B' },
-	[0x31] = { 'n', 'N' },
-	[0x32] = { 'm', 'M' },
-	[0x33] = { ',', '<' },
-	[0x34] = { '.', '>' },
-	[0x35] = { '/', '?' },
+#if TEST
+/*
+ * Unit tests, built into the host build with -DTEST=1 (make test). They run once the kernel has started, write one
+ * line per failed check and a summary to COM1, which the host driver prints, and exit with the number of failures.
+ */
 
-	[0x39] = { ' ', ' ' },
+#define TEST_CHECK(__condition) test_check((__condition), #__condition, __LINE__)
+
+DEFINE_RING(test_ring, int, 4)
+
+enum
+{
+	TEST_DISK_BLOCKS = 4 * BLOCK_MERGE_MAX,
 };
 
-static volatile bool keyboard_shift = false;
+static unsigned test_checks;
+static unsigned test_failures;
 
-#define KEYBOARD_BUFFER_SIZE 16
-static volatile char keyboard_buffer[KEYBOARD_BUFFER_SIZE];
-static volatile size_t keyboard_buffer_count;
-static volatile size_t keyboard_buffer_pointer;
+__attribute__((format(printf, 1, 2)))
+static inline void test_printf(const char * format, ...)
+{
+	char buffer[128];
+	va_list args;
+	va_start(args, format);
+	size_t length = kvsnprintf(buffer, sizeof buffer, format, args);
+	va_end(args);
+	serial_write(buffer, length < sizeof buffer ? length : sizeof buffer - 1);
+}
 
-static inline void keyboard_buffer_push(char c)
+static inline void test_check(bool condition, const char * text, int line)
 {
-	if(keyboard_buffer_count < KEYBOARD_BUFFER_SIZE)
+	test_checks++;
+	if(!condition)
 	{
-		keyboard_buffer[(keyboard_buffer_pointer + keyboard_buffer_count++) % KEYBOARD_BUFFER_SIZE] = c;
+		test_failures++;
+		test_printf("test failed line=%d %s\n", line, text);
 	}
 }
 
-static inline bool keyboard_buffer_empty(void)
+static inline void test_descriptor(void)
 {
-	return keyboard_buffer_count == 0;
+	descriptor_t descriptor;
+	// byte granular, every field gets bits that differ from its neighbours
+	descriptor_set_segment(&descriptor, 0x12345678, 0xABC, DESCRIPTOR_ACCESS_DATA | DESCRIPTOR_ACCESS_CPL0, DESCRIPTOR_FLAGS_32BIT);
+	TEST_CHECK(descriptor.d[0] == 0x56780ABC);
+	TEST_CHECK(descriptor.d[1] == 0x12409234);
+	// limits past 4 KiB are counted in pages
+	descriptor_set_segment(&descriptor, 0, 0xFFFFFFFF, DESCRIPTOR_ACCESS_CODE | DESCRIPTOR_ACCESS_CPL0, DESCRIPTOR_FLAGS_32BIT);
+	TEST_CHECK(descriptor.d[0] == 0x0000FFFF);
+	TEST_CHECK(descriptor.d[1] == 0x00CF9A00);
+	descriptor_set_segment(&descriptor, 0, 0, DESCRIPTOR_ACCESS_CODE | DESCRIPTOR_ACCESS_CPL3, DESCRIPTOR_FLAGS_64BIT);
+	TEST_CHECK(descriptor.d[0] == 0);
+	TEST_CHECK(descriptor.d[1] == 0x0020FA00);
 }
 
-static inline int keyboard_buffer_remove(void)
+static inline void test_ring_wrap(void)
 {
-	if(keyboard_buffer_empty())
+	test_ring_t ring = { 0 };
+	// the free running indices wrap around in the middle of the test
+	ring.head = ring.tail = ~0U - 1;
+	for(int i = 0; i < 4; i++)
 	{
-		return -1;
+		TEST_CHECK(test_ring_push(&ring, i));
 	}
-	else
+	TEST_CHECK(!test_ring_push(&ring, 4));
+	TEST_CHECK(ring.dropped == 1);
+	TEST_CHECK(test_ring_count(&ring) == 4);
+	TEST_CHECK(ring.high_watermark == 4);
+	for(int i = 0; i < 4; i++)
 	{
-		int c = keyboard_buffer[keyboard_buffer_pointer];
-		keyboard_buffer_pointer = (keyboard_buffer_pointer + 1) % KEYBOARD_BUFFER_SIZE;
-		keyboard_buffer_count --;
-		return c;
+		int value = -1;
+		TEST_CHECK(test_ring_pop(&ring, &value) && value == i);
 	}
+	int value;
+	TEST_CHECK(!test_ring_pop(&ring, &value));
+	TEST_CHECK(test_ring_empty(&ring));
+	TEST_CHECK(ring.head == 2);
 }
 
-static inline void keyboard_interrupt_handler(registers_t * registers)
+/* Whether format gives exactly expected, also in the length returned */
+static bool test_format(const char * expected, const char * format, ...)
 {
-	(void) registers;
+	char buffer[48];
+	va_list args;
+	va_start(args, format);
+	size_t length = kvsnprintf(buffer, sizeof buffer, format, args);
+	va_end(args);
+	return length == strlen(expected) && strcmp(buffer, expected) == 0;
+}
 
-	uint8_t scancode = inp(PORT_PS2_DATA);
+static inline void test_ksnprintf(void)
+{
+	TEST_CHECK(test_format("-2147483648", "%d", -__INT_MAX__ - 1));
+	TEST_CHECK(test_format(sizeof(long) == 8 ? "-9223372036854775808" : "-2147483648", "%ld", -__LONG_MAX__ - 1L));
+	TEST_CHECK(test_format("4294967295", "%u", 0xFFFFFFFFu));
+	TEST_CHECK(test_format("0", "%d", 0));
 
-	screen_x = SCREEN_WIDTH - 2;
-	screen_y = 1;
-	screen_attribute = 0x2F;
-	screen_puthex(scancode);
+	TEST_CHECK(test_format("   42|", "%5d|", 42));
+	TEST_CHECK(test_format("42   |", "%-5d|", 42));
+	TEST_CHECK(test_format("-0042", "%05d", -42));
+	TEST_CHECK(test_format("   7", "%*d", 4, 7));
+	TEST_CHECK(test_format("0000beef BEEF", "%08x %X", 0xBEEFu, 0xBEEFu));
+	TEST_CHECK(test_format("ab  |  c|", "%-4s|%3c|", "ab", 'c'));
+	TEST_CHECK(test_format("abcdef", "%3s", "abcdef"));
+	TEST_CHECK(test_format("100%", "%d%%", 100));
 
-	if((scancode & 0x80) == 0)
+	// cut off at the size, terminated, and nothing written past it
+	char buffer[16];
+	memset(buffer, '#', sizeof buffer);
+	TEST_CHECK(ksnprintf(buffer, 8, "%s", "abcdefghij") == 10);
+	TEST_CHECK(strcmp(buffer, "abcdefg") == 0 && buffer[8] == '#');
+	TEST_CHECK(ksnprintf(buffer, 4, "%d", -12345) == 6);
+	TEST_CHECK(strcmp(buffer, "-12") == 0);
+	TEST_CHECK(ksnprintf(buffer, 1, "%5d", 1) == 5);
+	TEST_CHECK(buffer[0] == '\0');
+	buffer[0] = '#';
+	TEST_CHECK(ksnprintf(buffer, 0, "abc") == 3);
+	TEST_CHECK(buffer[0] == '#');
+}
+
+typedef struct test_timer_t
+{
+	// first, so that the callback can get back to the rest
+	timer_t timer;
+	// the tick it expired in, 0 until then
+	uint32_t fired;
+	// cancelled by the callback
+	struct test_timer_t * cancel;
+	bool cancelled;
+} test_timer_t;
+
+static timer_wheel_t test_wheel;
+
+static void test_timer_callback(timer_t * timer)
+{
+	test_timer_t * test = (test_timer_t *)timer;
+	// the wheel has moved on to the next tick already
+	test->fired = test_wheel.now - 1;
+	if(test->cancel != NULL)
 	{
-		// key pressed
-		if(scancode == 0x2A || scancode == 0x36)
-		{
-			// shift
-			keyboard_shift = true;
-		}
-		else
-		{
-			int c = keyboard_shift ? keyboard_scancode_table[scancode].shifted : keyboard_scancode_table[scancode].normal;
-			keyboard_buffer_push(c);
-		}
+		test->cancelled = timer_wheel_cancel(&test_wheel, &test->cancel->timer);
 	}
-	else
+}
+
+static inline void test_timer_start(test_timer_t * test, uint32_t expires)
+{
+	timer_init(&test->timer, test_timer_callback);
+	test->fired = 0;
+	test->cancel = NULL;
+	test->cancelled = false;
+	timer_wheel_add(&test_wheel, &test->timer, expires);
+}
+
+static inline void test_timer_wheel(void)
+{
+	enum
 	{
-		// key released
-		if(scancode == (0x80|0x2A) || scancode == (0x80|0x36))
-		{
-			// shift
-			keyboard_shift = false;
-		}
+		TEST_TIMER_BOUNDARIES = 4,
+	};
+	// the last tick of level 0 and the first of level 1, the same for levels 1 and 2
+	static const uint32_t boundaries[TEST_TIMER_BOUNDARIES] = { 63, 64, 4095, 4096 };
+	test_timer_t timers[TEST_TIMER_BOUNDARIES];
+	for(int i = 0; i < TEST_TIMER_BOUNDARIES; i++)
+	{
+		test_timer_start(&timers[i], boundaries[i]);
+	}
+	TEST_CHECK(test_wheel.stats.pending == TEST_TIMER_BOUNDARIES);
+	for(int i = 0; i < TEST_TIMER_BOUNDARIES; i++)
+	{
+		timer_wheel_run(&test_wheel, boundaries[i] - 1);
+		TEST_CHECK(timers[i].fired == 0);
+		timer_wheel_run(&test_wheel, boundaries[i]);
+		TEST_CHECK(timers[i].fired == boundaries[i]);
 	}
+	TEST_CHECK(test_wheel.stats.pending == 0);
+
+	// down from level 2 and from level 3, the offsets within each level are not 0 so that every level below is passed
+	test_timer_t level2, level3;
+	uint32_t level2_expires = test_wheel.now + 3 * 4096 + 65;
+	uint32_t level3_expires = test_wheel.now + 2 * 262144 + 5 * 4096 + 3 * 64 + 7;
+	test_timer_start(&level2, level2_expires);
+	test_timer_start(&level3, level3_expires);
+	uint32_t cascaded = test_wheel.stats.cascaded;
+	timer_wheel_run(&test_wheel, level2_expires);
+	TEST_CHECK(level2.fired == level2_expires);
+	TEST_CHECK(test_wheel.stats.cascaded - cascaded >= 2);
+	cascaded = test_wheel.stats.cascaded;
+	timer_wheel_run(&test_wheel, level3_expires - 1);
+	TEST_CHECK(level3.fired == 0);
+	TEST_CHECK(test_wheel.stats.cascaded - cascaded >= 3);
+	timer_wheel_run(&test_wheel, level3_expires);
+	TEST_CHECK(level3.fired == level3_expires);
+
+	// beyond the reach of the wheel, it goes around until it is due
+	test_timer_t distant;
+	uint32_t distant_expires = test_wheel.now + 2 * TIMER_MAX_DELTA;
+	test_timer_start(&distant, distant_expires);
+	timer_wheel_run(&test_wheel, distant_expires - 1);
+	TEST_CHECK(distant.fired == 0 && timer_pending(&distant.timer));
+	timer_wheel_run(&test_wheel, distant_expires);
+	TEST_CHECK(distant.fired == distant_expires);
+
+	// siblings in one slot, the one that runs first cancels the other
+	test_timer_t first, second;
+	uint32_t sibling_expires = test_wheel.now + 10;
+	test_timer_start(&second, sibling_expires);
+	test_timer_start(&first, sibling_expires);
+	first.cancel = &second;
+	second.cancel = &first;
+	timer_wheel_run(&test_wheel, sibling_expires);
+	TEST_CHECK((first.fired == sibling_expires) != (second.fired == sibling_expires));
+	TEST_CHECK(first.cancelled != second.cancelled);
+	TEST_CHECK(!timer_pending(&first.timer) && !timer_pending(&second.timer));
+
+	// the present wraps around 2^32 between adding and expiring
+	test_wheel.now = 0xFFFFFFF0;
+	test_timer_t wrap_near, wrap_far;
+	test_timer_start(&wrap_near, 0x10);
+	test_timer_start(&wrap_far, 0x1000);
+	timer_wheel_run(&test_wheel, 0xFFFFFFFF);
+	timer_wheel_run(&test_wheel, 0x0F);
+	TEST_CHECK(wrap_near.fired == 0);
+	timer_wheel_run(&test_wheel, 0x10);
+	TEST_CHECK(wrap_near.fired == 0x10);
+	timer_wheel_run(&test_wheel, 0x1000);
+	TEST_CHECK(wrap_far.fired == 0x1000);
+
+	TEST_CHECK(test_wheel.stats.pending == 0);
 }
 
-void interrupt_handler(registers_t * registers)
+static inline void test_crc32c(void)
 {
-	if(IRQ8 <= registers->interrupt_number && registers->interrupt_number < IRQ8 + 8)
+	static const char check[] = "123456789";
+	// the check value of the Castagnoli CRC
+	TEST_CHECK(crc32c(0, check, 9) == 0xE3069283);
+	TEST_CHECK(~crc32c_table(0xFFFFFFFF, (const uint8_t *)check, 9) == 0xE3069283);
+	TEST_CHECK(crc32c(crc32c(0, check, 4), check + 4, 5) == 0xE3069283);
+
+	// one byte off the alignment of the words, so that every length has a head and a tail
+	static uint8_t data[1 + 17];
+	for(size_t i = 0; i < sizeof data; i++)
 	{
-		outp(PORT_PIC2_COMMAND, PIC_EOI);
-		outp(PORT_PIC1_COMMAND, PIC_EOI);
+		data[i] = (uint8_t)(i * 37 + 11);
 	}
-	else if(IRQ0 <= registers->interrupt_number && registers->interrupt_number < IRQ0 + 8)
+	uint32_t chained = crc32c_table(crc32c_table(0xFFFFFFFF, data + 1, 7), data + 8, 10);
+	TEST_CHECK(chained == crc32c_table(0xFFFFFFFF, data + 1, 17));
+#if OS386 || OS64
+	if(!crc32c_sse42)
 	{
-		outp(PORT_PIC1_COMMAND, PIC_EOI);
+		return;
+	}
+	for(size_t size = 0; size <= 17; size++)
+	{
+		TEST_CHECK(crc32c_table(0xFFFFFFFF, data + 1, size) == crc32c_instruction(0xFFFFFFFF, data + 1, size));
 	}
+	TEST_CHECK(chained == crc32c_instruction(crc32c_instruction(0xFFFFFFFF, data + 1, 7), data + 8, 10));
+#endif
+}
 
-	uint8_t old_screen_x = screen_x;
-	uint8_t old_screen_y = screen_y;
-	uint8_t old_screen_attribute = screen_attribute;
+// a RAM disk whose blocks hold their own number in every byte
+static uint8_t test_disk[TEST_DISK_BLOCKS][BLOCK_SIZE];
+static uint8_t test_block_buffer[BLOCK_MERGE_MAX][BLOCK_SIZE];
 
-	screen_x = 0;
-	screen_y = SCREEN_HEIGHT - 1;
-	screen_attribute = 0x4E;
+static bool test_disk_transfer(block_device_t * device, uint32_t block, uint16_t count, void * buffer, bool write)
+{
+	(void) device;
 
-	screen_putstr("Interrupt 0x");
-	screen_puthex(registers->interrupt_number);
-#if !OS86
-	screen_putstr(" with error code ");
-	screen_puthex(registers->error_code);
-#endif
-	screen_putstr(" called from 0x");
-#if OS64
-	screen_puthex(registers->rip);
-#elif OS386
-	screen_puthex(registers->eip);
-#else
-	screen_puthex(registers->ip);
-#endif
+	if(write)
+		memcpy(test_disk[block], buffer, count * BLOCK_SIZE);
+	else
+		memcpy(buffer, test_disk[block], count * BLOCK_SIZE);
+	return true;
+}
 
-	switch(registers->interrupt_number)
+static inline void test_block(void)
+{
+	for(int i = 0; i < TEST_DISK_BLOCKS; i++)
 	{
-	case IRQ0 + 0: // timer interrupt
-		timer_interrupt_handler(registers);
-		break;
-	case IRQ0 + 1: // keyboard interrupt
-		keyboard_interrupt_handler(registers);
-		break;
+		memset(test_disk[i], i, BLOCK_SIZE);
+	}
+	block_device_t * device = block_register("test", TEST_DISK_BLOCKS, test_disk_transfer, false, NULL);
+	TEST_CHECK(device != NULL);
+	if(device == NULL)
+	{
+		return;
 	}
 
-	screen_x = old_screen_x;
-	screen_y = old_screen_y;
-	screen_attribute = old_screen_attribute;
+	// a cold run goes through the cache in one request, each block is a miss and nothing else
+	TEST_CHECK(block_read(device, 0, 8, test_block_buffer));
+	TEST_CHECK(device->stats.reads == 8 && device->stats.misses == 8 && device->stats.hits == 0);
+	TEST_CHECK(test_block_buffer[0][0] == 0 && test_block_buffer[7][BLOCK_SIZE - 1] == 7);
+	TEST_CHECK(device->stats.device_reads == 1);
 
-	screen_move_cursor();
-}
+	// the same blocks again are all hits
+	TEST_CHECK(block_read(device, 0, 8, test_block_buffer));
+	TEST_CHECK(device->stats.reads == 16 && device->stats.hits == 8);
 
-#if OS86
-const char greeting[] = "Greetings! OS/86 running in real mode (8086)";
-#elif OS286
-const char greeting[] = "Greetings! OS/286 running in 16-bit protected mode (80286)";
-#elif OS386
-const char greeting[] = "Greetings! OS/386 running in 32-bit protected mode (80386)";
-#elif OS64
-const char greeting[] = "Greetings! OS/64 running in 64-bit long mode";
-#else
-# error Unknown target
-#endif
+	// a full run of missing blocks bypasses the cache
+	TEST_CHECK(block_read(device, 2 * BLOCK_MERGE_MAX, BLOCK_MERGE_MAX, test_block_buffer));
+	TEST_CHECK(test_block_buffer[BLOCK_MERGE_MAX - 1][0] == (uint8_t)(3 * BLOCK_MERGE_MAX - 1));
+	TEST_CHECK(device->stats.hits + device->stats.misses == device->stats.reads);
+	TEST_CHECK(device->stats.misses == 8 + BLOCK_MERGE_MAX);
+}
 
-static inline bool keyboard_kbhit(void)
+static inline int test_translate(uint8_t keycode, uint8_t modifiers, uint8_t flags)
 {
-	return !keyboard_buffer_empty();
+	input_event_t event = { .keycode = keycode, .modifiers = modifiers, .flags = flags };
+	return keyboard_translate(&event);
 }
 
-static inline int keyboard_getch(void)
+static inline void test_keyboard(void)
 {
-	while(keyboard_buffer_empty())
-		;
-	return keyboard_buffer_remove();
+	TEST_CHECK(test_translate(0x1E, 0, 0) == 'a');
+	TEST_CHECK(test_translate(0x1E, INPUT_MODIFIER_SHIFT, 0) == 'A');
+	TEST_CHECK(test_translate(0x1E, INPUT_MODIFIER_CAPS_LOCK, 0) == 'A');
+	TEST_CHECK(test_translate(0x1E, INPUT_MODIFIER_CAPS_LOCK | INPUT_MODIFIER_SHIFT, 0) == 'a');
+	// caps lock leaves everything but letters alone
+	TEST_CHECK(test_translate(0x02, INPUT_MODIFIER_CAPS_LOCK, 0) == '1');
+	TEST_CHECK(test_translate(0x02, INPUT_MODIFIER_SHIFT, 0) == '!');
+	TEST_CHECK(test_translate(0x1C, 0, 0) == '\n');
+	TEST_CHECK(test_translate(KEYCODE_KEYPAD_ENTER, 0, INPUT_FLAG_EXTENDED) == '\n');
+	TEST_CHECK(test_translate(KEYCODE_KEYPAD_SLASH, INPUT_MODIFIER_SHIFT, INPUT_FLAG_EXTENDED) == '/');
+	TEST_CHECK(test_translate(0x1E, 0, INPUT_FLAG_RELEASE) == -1);
+	TEST_CHECK(test_translate(KEYCODE_EXTENDED | 0x48, 0, INPUT_FLAG_EXTENDED) == -1);
+	TEST_CHECK(test_translate(KEYCODE_LEFT_SHIFT, 0, 0) == -1);
+	TEST_CHECK(test_translate(KEYCODE_F12, 0, 0) == -1);
 }
 
-static inline void test_scrolling(void)
+static inline void test_screen(void)
 {
-	for(int i = 0; i < SCREEN_HEIGHT; i++)
-	{
-		screen_putstr("scroll test\n");
-	}
+	uint8_t attribute = screen_attribute;
+	screen_attribute = 0x07;
+	screen_scroll_lines(SCREEN_HEIGHT);
+	TEST_CHECK(screen_buffer[0] == 0x0720 && screen_buffer[SCREEN_WIDTH * SCREEN_HEIGHT - 1] == 0x0720);
 
-	screen_puthex((size_t)0x1A2B3C4D);
-	screen_putdec(-12345);
-#if !OS86
-	screen_putdec(sizeof(descriptor_t));
-#if OS64
-	screen_putdec(sizeof(descriptor64_t));
-#endif
-#endif
+	// wrapping at the end of a line
+	screen_x = SCREEN_WIDTH - 2;
+	screen_y = 0;
+	screen_write("xyz", 3);
+	TEST_CHECK(screen_x == 1 && screen_y == 1);
+	TEST_CHECK(screen_buffer[SCREEN_WIDTH - 1] == 0x0779 && screen_buffer[SCREEN_WIDTH] == 0x077A);
+
+	// tabs, backspace and new lines
+	screen_putchar('\t');
+	TEST_CHECK(screen_x == 8);
+	screen_putchar('\t');
+	TEST_CHECK(screen_x == 16);
+	screen_x = 0;
+	screen_putchar('\b');
+	TEST_CHECK(screen_x == 0 && screen_y == 1);
+	screen_x = SCREEN_WIDTH - 4;
+	screen_putchar('\t');
+	TEST_CHECK(screen_x == 0 && screen_y == 2);
+	screen_putchar('\n');
+	TEST_CHECK(screen_x == 0 && screen_y == 3);
+	// characters without a glyph are dropped
+	screen_putchar('\a');
+	TEST_CHECK(screen_x == 0 && screen_buffer[SCREEN_WIDTH * 3] == 0x0720);
+
+	// a new line on the last one scrolls everything up and clears the line
+	screen_x = 0;
+	screen_y = SCREEN_HEIGHT - 1;
+	screen_write("last", 4);
+	screen_putchar('\n');
+	TEST_CHECK(screen_x == 0 && screen_y == SCREEN_HEIGHT - 1);
+	TEST_CHECK(screen_buffer[SCREEN_WIDTH * (SCREEN_HEIGHT - 2)] == 0x076C);
+	TEST_CHECK(screen_buffer[SCREEN_WIDTH * (SCREEN_HEIGHT - 1)] == 0x0720);
+	TEST_CHECK(screen_buffer[0] == 0x077A);
+
+	// scrolling by more than a screen clears it
+	screen_scroll_lines(SCREEN_HEIGHT + 5);
+	TEST_CHECK(screen_buffer[SCREEN_WIDTH * (SCREEN_HEIGHT - 2)] == 0x0720);
+
+	screen_x = 0;
+	screen_y = 0;
+	screen_attribute = attribute;
 }
 
-static inline void test_interrupts(void)
+static inline noreturn void test_run(void)
 {
-	asm volatile("int $0x03");
-	asm volatile("int $0x04");
-	asm volatile("int $0x80");
+	serial_init();
+	test_descriptor();
+	test_ring_wrap();
+	test_ksnprintf();
+	test_timer_wheel();
+	test_crc32c();
+	test_block();
+	test_keyboard();
+#if !FBCON
+	test_screen();
+#endif
+	test_printf("test checks=%u failures=%u\n", test_checks, test_failures);
+
+	outp(PORT_DEBUG_EXIT, test_failures < 0xFF ? test_failures : 0xFF);
+	for(;;)
+		;
 }
+#endif
 
 noreturn void kmain(void)
 {
 	disable_interrupts();
+#if BENCH && (OS386 || OS64) && !HOST
+	bench_boot_mark();
+#endif
+	crc32c_init();
+#if !HOST
+	image_check();
+#endif
 
 #if OS286
 	descriptor_set_segment(&gdt[SEL_KERNEL_CS / 8], 0, 0xFFFF, DESCRIPTOR_ACCESS_CODE | DESCRIPTOR_ACCESS_CPL0, DESCRIPTOR_FLAGS_16BIT);
@@ -1235,19 +8510,33 @@ noreturn void kmain(void)
 #if !OS86
 	load_gdt(gdt, sizeof gdt);
 #endif
+#if OS286
+	segment_init();
+#endif
+
+	initrd_init();
+
+#if OS64
+	if(cpu_has_cpuid() && cpuid(0, 0).eax >= 7)
+	{
+		string_erms = (cpuid(7, 0).ebx & CPUID_7_EBX_ERMS) != 0;
+	}
+#endif
+
+#if (OS386 || OS64) && !HOST
+	vm_init();
+#endif
+#if OS64
+	fpu_init();
+#endif
+#if OS386 || OS64
+	pci_init();
+#endif
 
 #if OS86
-# define DESCRIPTOR_ACCESS_INTGATE 0
-# define KERNEL_SEGMENT 0
-#elif OS286
-# define DESCRIPTOR_ACCESS_INTGATE DESCRIPTOR_ACCESS_INTGATE16
-# define KERNEL_SEGMENT SEL_KERNEL_CS
-#elif OS386
-# define DESCRIPTOR_ACCESS_INTGATE DESCRIPTOR_ACCESS_INTGATE32
-# define KERNEL_SEGMENT SEL_KERNEL_CS
-#elif OS64
-# define DESCRIPTOR_ACCESS_INTGATE DESCRIPTOR_ACCESS_INTGATE64
-# define KERNEL_SEGMENT SEL_KERNEL_CS
+	// the BIOS disk services stay reachable after the vector is taken over below
+	bios_disk_vector = *(uint32_t *)MK_FP(0, 0x13 * 4);
+	unreal_init();
 #endif
 
 	set_interrupt(0x00, KERNEL_SEGMENT, isr0x00, DESCRIPTOR_ACCESS_INTGATE);
@@ -1529,24 +8818,112 @@ noreturn void kmain(void)
 	outp(PORT_PIC1_DATA,    0);
 	outp(PORT_PIC2_DATA,    0);
 
-	uint16_t tick_interval = 1193180 / 20;
-	outp(PORT_PIT_COMMAND, PIT_CHANNEL0 | PIT_ACCESS_WORD | PIT_SQUARE_WAVE);
-	outp(PORT_PIT_DATA0,   tick_interval & 0xFF);
-	outp(PORT_PIT_DATA0,   tick_interval >> 8);
+	// the rate generator counts down by one per input clock, which clock_read relies on
+	timer_interval = PIT_FREQUENCY / 20;
+	outp(PORT_PIT_COMMAND, PIT_CHANNEL0 | PIT_ACCESS_WORD | PIT_RATE_GENERATOR);
+	outp(PORT_PIT_DATA0,   timer_interval & 0xFF);
+	outp(PORT_PIT_DATA0,   timer_interval >> 8);
+
+#if FBCON
+	fbcon_init();
+#endif
 
 	enable_interrupts();
 
+	block_init();
+#if OS86
+	bios_disk_init();
+#elif HOST
+	host_floppy_init();
+#else
+	floppy_init();
+	ata_init();
+#endif
+#if (OS386 || OS64) && !HOST
+	virtio_blk_init();
+	virtio_console_init();
+#endif
+	bool fat_mounted = fat_mount(block_find("fd0"));
+
 	screen_attribute = 0x1E;
 	screen_putstr(greeting);
 	screen_putchar('\n');
+	if(image_checksum == CHECKSUM_MISMATCH)
+	{
+		kprintf("image: checksum mismatch, the kernel was not loaded correctly\n");
+	}
+	if(initrd_checksum == CHECKSUM_MISMATCH)
+	{
+		kprintf("initrd: checksum mismatch, not used\n");
+	}
+	if(initrd_file_count != 0)
+	{
+		kprintf("initrd: %u files\n", initrd_file_count);
+	}
+	if(fat_mounted)
+	{
+		kprintf("fat: %u files\n", fat_root_files);
+	}
+#if OS86
+	if(unreal_available)
+	{
+		kprintf("unreal mode: 4 GiB data segments\n");
+	}
+#endif
+#if OS386 || OS64
+	if(pci_device_count != 0)
+	{
+		kprintf("pci: %u devices, configuration space through %s\n", pci_device_count, pci_ecam != 0 ? "ECAM" : "ports");
+	}
+#endif
+#if (OS386 || OS64) && !HOST
+	if(multiboot_memory != 0)
+	{
+		kprintf("multiboot: %lu KiB of memory\n", (unsigned long)multiboot_memory);
+	}
+#endif
+
+#if TEST
+	test_run();
+#endif
+#if BENCH
+	bench_run();
+#endif
 
 	test_interrupts();
 //	test_scrolling();
 
 	for(;;)
 	{
-		screen_putchar(keyboard_getch());
-		if(screen_y == SCREEN_HEIGHT - 1)
+		input_event_t event;
+		keyboard_wait_event(&event);
+		int c = keyboard_translate(&event);
+		if(c >= 0)
+		{
+			screen_putchar(c);
+			latency_record(&echo_latency, clock_read() - event.timestamp);
+		}
+		else if(event.keycode == KEYCODE_F12 && (event.flags & INPUT_FLAG_RELEASE) == 0)
+		{
+			latency_report("echo latency", &echo_latency);
+		}
+		else if(event.keycode == KEYCODE_F11 && (event.flags & INPUT_FLAG_RELEASE) == 0)
+		{
+			block_report();
+		}
+#if IRQTRACE
+		else if(event.keycode == KEYCODE_F9 && (event.flags & INPUT_FLAG_RELEASE) == 0)
+		{
+			irqtrace_report();
+		}
+#endif
+#if (OS386 || OS64) && !HOST
+		else if(event.keycode == KEYCODE_F10 && (event.flags & INPUT_FLAG_RELEASE) == 0)
+		{
+			kprintf("kexec: kernel.bin %s\n", kexec_file("kernel.bin") ? "started" : "not found or not bootable");
+		}
+#endif
+		if(screen_y == screen_height - 1)
 		{
 			screen_scroll_lines(1);
 			screen_y --;
@@ -0,0 +1,328 @@
+#ifndef _KPRINTF_H
+#define _KPRINTF_H
+
+#include "stdarg.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "string.h"
+
+/*
+ * A small printf engine supporting %d %i %u %x %X %p %s %c and %%, the '-' and '0' flags,
+ * field widths (including '*') and the 'l', 'z' and 'h' length modifiers.
+ *
+ * Decimal conversion never divides by 10: two digits are emitted at a time from a table,
+ * and the quotient by 100 is obtained with a reciprocal multiplication. On ia16, where a
+ * 32-bit division is a libgcc call, values are first split into base 10000 chunks using
+ * two hardware 16-bit divisions each.
+ */
+
+static const char kfmt_digit_pairs[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static inline char * kfmt_put_pair(char * end, unsigned pair)
+{
+	end -= 2;
+	end[0] = kfmt_digit_pairs[pair * 2];
+	end[1] = kfmt_digit_pairs[pair * 2 + 1];
+	return end;
+}
+
+// x / 100 for x < 43699, 5243 / 2^19 is close enough to 1 / 100 in that range
+static inline uint16_t kfmt_div100(uint16_t x)
+{
+#ifdef __ia16__
+	uint16_t low, high;
+	__asm__("mulw\t%w3"
+		: "=a"(low), "=d"(high)
+		: "0"(x), "rm"((uint16_t)5243));
+	(void) low;
+	return high >> 3;
+#else
+	return ((uint32_t)x * 5243) >> 19;
+#endif
+}
+
+#ifdef __ia16__
+// divides a 32-bit value in place by 10000 and returns the remainder, the second division cannot overflow since the high remainder is below the divisor
+static inline uint16_t kfmt_divmod10000(unsigned long * value)
+{
+	uint16_t quotient_high, quotient_low, remainder;
+	__asm__("divw\t%w3"
+		: "=a"(quotient_high), "=d"(remainder)
+		: "0"((uint16_t)(*value >> 16)), "rm"((uint16_t)10000), "1"((uint16_t)0));
+	__asm__("divw\t%w3"
+		: "=a"(quotient_low), "=d"(remainder)
+		: "0"((uint16_t)*value), "rm"((uint16_t)10000), "1"(remainder));
+	*value = ((unsigned long)quotient_high << 16) | quotient_low;
+	return remainder;
+}
+#endif
+
+// writes the decimal digits of value backwards, ending right before end, and returns a pointer to the first digit
+static inline char * kfmt_utoa(char * end, unsigned long value)
+{
+#ifdef __ia16__
+	while(value >= 10000)
+	{
+		uint16_t chunk = kfmt_divmod10000(&value);
+		uint16_t high = kfmt_div100(chunk);
+		end = kfmt_put_pair(end, chunk - high * 100);
+		end = kfmt_put_pair(end, high);
+	}
+	uint16_t rest = value;
+	while(rest >= 100)
+	{
+		uint16_t quotient = kfmt_div100(rest);
+		end = kfmt_put_pair(end, rest - quotient * 100);
+		rest = quotient;
+	}
+#else
+	// the compiler already turns a constant division into a multiplication on these targets
+	unsigned long rest = value;
+	while(rest >= 100)
+	{
+		unsigned long quotient = rest / 100;
+		end = kfmt_put_pair(end, rest - quotient * 100);
+		rest = quotient;
+	}
+#endif
+	if(rest >= 10)
+	{
+		end = kfmt_put_pair(end, rest);
+	}
+	else
+	{
+		*--end = '0' + rest;
+	}
+	return end;
+}
+
+static inline char * kfmt_xtoa(char * end, unsigned long value, bool upper)
+{
+	const char * digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	do
+	{
+		*--end = digits[value & 0xF];
+		value >>= 4;
+	} while(value != 0);
+	return end;
+}
+
+typedef struct kfmt_output_t
+{
+	char * pointer;
+	char * limit;
+	size_t count;
+} kfmt_output_t;
+
+static inline void kfmt_putc(kfmt_output_t * output, char c)
+{
+	if(output->pointer < output->limit)
+	{
+		*output->pointer++ = c;
+	}
+	output->count++;
+}
+
+static inline void kfmt_fill(kfmt_output_t * output, char c, int count)
+{
+	for(; count > 0; count--)
+	{
+		kfmt_putc(output, c);
+	}
+}
+
+enum
+{
+	KFMT_LEFT = 0x01,
+	KFMT_ZERO = 0x02,
+};
+
+static inline void kfmt_field(kfmt_output_t * output, const char * prefix, const char * text, size_t length, int width, uint8_t flags)
+{
+	size_t prefix_length = prefix != NULL ? strlen(prefix) : 0;
+	int padding = width - (int)(prefix_length + length);
+
+	if((flags & (KFMT_LEFT | KFMT_ZERO)) == 0)
+	{
+		kfmt_fill(output, ' ', padding);
+	}
+	for(size_t i = 0; i < prefix_length; i++)
+	{
+		kfmt_putc(output, prefix[i]);
+	}
+	if((flags & (KFMT_LEFT | KFMT_ZERO)) == KFMT_ZERO)
+	{
+		kfmt_fill(output, '0', padding);
+	}
+	for(size_t i = 0; i < length; i++)
+	{
+		kfmt_putc(output, text[i]);
+	}
+	if((flags & KFMT_LEFT) != 0)
+	{
+		kfmt_fill(output, ' ', padding);
+	}
+}
+
+/* Formats into buffer, always terminating it if size is not 0, and returns the length the full output would have had */
+static inline size_t kvsnprintf(char * buffer, size_t size, const char * format, va_list args)
+{
+	kfmt_output_t output;
+	output.pointer = buffer;
+	output.limit = size != 0 ? buffer + size - 1 : buffer;
+	output.count = 0;
+
+	// large enough for the decimal digits of an unsigned long
+	char digits[sizeof(unsigned long) * 3];
+	char * const digits_end = digits + sizeof digits;
+
+	for(; *format != '\0'; format++)
+	{
+		if(*format != '%')
+		{
+			kfmt_putc(&output, *format);
+			continue;
+		}
+		format++;
+
+		uint8_t flags = 0;
+		for(;; format++)
+		{
+			if(*format == '-')
+				flags |= KFMT_LEFT;
+			else if(*format == '0')
+				flags |= KFMT_ZERO;
+			else
+				break;
+		}
+
+		int width = 0;
+		if(*format == '*')
+		{
+			width = va_arg(args, int);
+			if(width < 0)
+			{
+				flags |= KFMT_LEFT;
+				width = -width;
+			}
+			format++;
+		}
+		else
+		{
+			for(; '0' <= *format && *format <= '9'; format++)
+			{
+				width = width * 10 + (*format - '0');
+			}
+		}
+
+		bool is_long = false;
+		if(*format == 'l')
+		{
+			is_long = true;
+			format++;
+		}
+		else if(*format == 'z')
+		{
+			is_long = sizeof(size_t) == sizeof(unsigned long);
+			format++;
+		}
+		else if(*format == 'h')
+		{
+			format++;
+		}
+
+		char * text;
+		char c;
+		const char * prefix = NULL;
+		unsigned long value;
+		switch(*format)
+		{
+		case 'd':
+		case 'i':
+			{
+				long number = is_long ? va_arg(args, long) : va_arg(args, int);
+				// negating in unsigned arithmetic keeps the most negative value intact
+				value = number < 0 ? -(unsigned long)number : (unsigned long)number;
+				if(number < 0)
+				{
+					prefix = "-";
+				}
+			}
+			text = kfmt_utoa(digits_end, value);
+			kfmt_field(&output, prefix, text, digits_end - text, width, flags);
+			break;
+		case 'u':
+			value = is_long ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+			text = kfmt_utoa(digits_end, value);
+			kfmt_field(&output, NULL, text, digits_end - text, width, flags);
+			break;
+		case 'x':
+		case 'X':
+			value = is_long ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+			text = kfmt_xtoa(digits_end, value, *format == 'X');
+			kfmt_field(&output, NULL, text, digits_end - text, width, flags);
+			break;
+		case 'p':
+			value = (size_t)va_arg(args, void *);
+			text = kfmt_xtoa(digits_end, value, false);
+			// pointers are shown with all their digits
+			while(digits_end - text < (int)(sizeof(void *) * 2))
+			{
+				*--text = '0';
+			}
+			kfmt_field(&output, "0x", text, digits_end - text, width, flags & ~KFMT_ZERO);
+			break;
+		case 's':
+			text = va_arg(args, char *);
+			if(text == NULL)
+			{
+				text = "(null)";
+			}
+			kfmt_field(&output, NULL, text, strlen(text), width, flags & ~KFMT_ZERO);
+			break;
+		case 'c':
+			c = va_arg(args, int);
+			kfmt_field(&output, NULL, &c, 1, width, flags & ~KFMT_ZERO);
+			break;
+		case '%':
+			kfmt_putc(&output, '%');
+			break;
+		case '\0':
+			format--;
+			break;
+		default:
+			kfmt_putc(&output, '%');
+			kfmt_putc(&output, *format);
+			break;
+		}
+	}
+
+	if(size != 0)
+	{
+		*output.pointer = '\0';
+	}
+	return output.count;
+}
+
+__attribute__((format(printf, 3, 4)))
+static inline size_t ksnprintf(char * buffer, size_t size, const char * format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	size_t length = kvsnprintf(buffer, size, format, args);
+	va_end(args);
+	return length;
+}
+
+#endif // _KPRINTF_H
@@ -1,15 +1,232 @@
 #! /usr/bin/python3
 
+import argparse
+import os
+import struct
 import sys
+import time
+
+SECTOR_SIZE = 512
+# Offset of the boot information block in the boot sector, see boot.asm
+BOOT_INFO = 0x1F0
+
+# The loader reads the archive to 0x20000, it has to end below the extended BIOS data area
+INITRD_ADDRESS = 0x20000
+INITRD_LIMIT = 0x9F000 - INITRD_ADDRESS
+
+INITRD_MAGIC = b'IRD1'
+INITRD_EMPTY = 0xFFFF
+# File data is paragraph aligned so that real mode pointers to it start at offset 0
+INITRD_ALIGN = 16
+# The 286 sees the archive through 64 KiB windows, small files are kept within one of them
+INITRD_WINDOW = 0x10000
+
+# The boot sector starts with a jump over the FAT BIOS parameter block, which ends where the boot code starts
+BPB_OFFSET = 3
+BPB_END = 0x3E
+
+# A 1.44 MB floppy: one sector per cluster, 2 FATs of 9 sectors and 224 root directory entries
+FLOPPY_SECTORS = 2880
+FAT_COUNT = 2
+FAT_SECTORS = 9
+FAT_ROOT_ENTRIES = 224
+FAT_ENTRY_SIZE = 32
+FAT_MEDIA = 0xF0
+FAT_ATTRIBUTE_ARCHIVE = 0x20
+FAT_END = 0xFFF
+
+FNV_OFFSET = 0x811C9DC5
+FNV_PRIME = 0x01000193
+
+def fnv1a(data):
+	value = FNV_OFFSET
+	for byte in data:
+		value = ((value ^ byte) * FNV_PRIME) & 0xFFFFFFFF
+	return value
+
+# Reflected Castagnoli polynomial, the CRC of the SSE4.2 instruction that the kernel uses to check it
+CRC32C_POLYNOMIAL = 0x82F63B78
+
+def crc32c_entry(value):
+	for bit in range(8):
+		value = value >> 1 ^ (CRC32C_POLYNOMIAL if value & 1 else 0)
+	return value
+
+CRC32C_TABLE = [crc32c_entry(value) for value in range(256)]
+
+def crc32c(data):
+	value = 0xFFFFFFFF
+	for byte in data:
+		value = value >> 8 ^ CRC32C_TABLE[(value ^ byte) & 0xFF]
+	return value ^ 0xFFFFFFFF
+
+def align(value, alignment):
+	return (value + alignment - 1) // alignment * alignment
+
+def build_archive(paths):
+	"""
+	Layout, all values little endian:
+		header: magic, file count (u16), index slots (u16), archive size (u32),
+			CRC-32C of the rest of the archive (u32)
+		index: one u16 entry number per slot, open addressing with linear probing on the FNV-1a hash of the name
+		entries: hash (u32), data offset (u32), size (u32), name offset (u16), name length (u16)
+		names, then the file data
+	"""
+	files = []
+	for path in paths:
+		name = os.path.basename(path).encode()
+		with open(path, 'rb') as file:
+			files.append((name, file.read()))
+	if len({name for name, data in files}) != len(files):
+		sys.exit("makeboot: duplicate initrd file names")
+
+	# at least one slot stays empty, which ends every unsuccessful lookup
+	slots = 1
+	while slots < len(files) * 2:
+		slots *= 2
+
+	names = b''.join(name for name, data in files)
+	names_offset = 16 + slots * 2 + len(files) * 16
+	if names_offset + len(names) > 0x10000:
+		sys.exit("makeboot: the initrd index does not fit in 64 KiB")
+
+	index = [INITRD_EMPTY] * slots
+	entries = b''
+	placements = []
+	name_offset = names_offset
+	offset = align(names_offset + len(names), INITRD_ALIGN)
+	for number, (name, data) in enumerate(files):
+		if len(data) < INITRD_WINDOW and offset // INITRD_WINDOW != (offset + len(data) - 1) // INITRD_WINDOW:
+			offset = align(offset, INITRD_WINDOW)
+		value = fnv1a(name)
+		slot = value & (slots - 1)
+		while index[slot] != INITRD_EMPTY:
+			slot = (slot + 1) & (slots - 1)
+		index[slot] = number
+		entries += struct.pack('<IIIHH', value, offset, len(data), name_offset, len(name))
+		placements.append((offset, data))
+		name_offset += len(name)
+		offset = align(offset + len(data), INITRD_ALIGN)
+
+	archive = bytearray(offset)
+	struct.pack_into('<4sHHII', archive, 0, INITRD_MAGIC, len(files), slots, offset, 0)
+	struct.pack_into(f'<{slots}H', archive, 16, *index)
+	archive[16 + slots * 2:names_offset] = entries
+	archive[names_offset:names_offset + len(names)] = names
+	for data_offset, data in placements:
+		archive[data_offset:data_offset + len(data)] = data
+	struct.pack_into('<I', archive, 12, crc32c(archive[16:]))
+	if len(archive) > INITRD_LIMIT:
+		sys.exit(f"makeboot: the initrd is {len(archive)} bytes, at most {INITRD_LIMIT} can be loaded")
+	return bytes(archive)
+
+def fat_name(path):
+	"""The 8.3 directory entry name of a file, names that do not fit are rejected rather than shortened"""
+	base = os.path.basename(path).upper()
+	name, dot, extension = base.partition('.')
+	allowed = set("ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!#$%&'()-@^_`{}~")
+	if not 1 <= len(name) <= 8 or len(extension) > 3 or not set(name + extension) <= allowed:
+		sys.exit(f"makeboot: {path} has no 8.3 name")
+	return (name.ljust(8) + extension.ljust(3)).encode('ascii')
+
+def fat_timestamp(path):
+	local = time.localtime(os.path.getmtime(path))
+	year = min(max(local.tm_year, 1980), 2107)
+	return (local.tm_hour << 11 | local.tm_min << 5 | local.tm_sec // 2,
+		(year - 1980) << 9 | local.tm_mon << 5 | local.tm_mday)
+
+def build_fat(image, reserved, paths):
+	"""
+	Lays out a FAT12 file system on a 1.44 MB floppy image after the reserved sectors, which hold the boot sector,
+	the kernel and the initrd. The files go to the root directory, each in consecutive clusters.
+	"""
+	root_start = reserved + FAT_COUNT * FAT_SECTORS
+	data_start = root_start + FAT_ROOT_ENTRIES * FAT_ENTRY_SIZE // SECTOR_SIZE
+	clusters = FLOPPY_SECTORS - data_start
+	if clusters <= 0:
+		sys.exit("makeboot: no room for the file system after the kernel and the initrd")
+	if len(paths) > FAT_ROOT_ENTRIES:
+		sys.exit("makeboot: too many files for the root directory")
+	names = [fat_name(path) for path in paths]
+	if len(set(names)) != len(names):
+		sys.exit("makeboot: duplicate file names on the file system")
+
+	fat = [0] * (clusters + 2)
+	fat[0] = 0xF00 | FAT_MEDIA
+	fat[1] = FAT_END
+	directory = b''
+	cluster = 2
+	for name, path in zip(names, paths):
+		with open(path, 'rb') as file:
+			data = file.read()
+		count = align(len(data), SECTOR_SIZE) // SECTOR_SIZE
+		if cluster + count > clusters + 2:
+			sys.exit(f"makeboot: {path} does not fit on the file system")
+		first = cluster if count != 0 else 0
+		for i in range(count):
+			fat[cluster + i] = cluster + i + 1 if i < count - 1 else FAT_END
+		start = (data_start + cluster - 2) * SECTOR_SIZE
+		image[start:start + len(data)] = data
+		cluster += count
+		entry_time, entry_date = fat_timestamp(path)
+		directory += struct.pack('<11sB10sHHHI', name, FAT_ATTRIBUTE_ARCHIVE, bytes(10), entry_time, entry_date, first, len(data))
+
+	if len(fat) % 2 != 0:
+		fat.append(0)
+	table = b''.join(struct.pack('<I', fat[i] | fat[i + 1] << 12)[:3] for i in range(0, len(fat), 2))
+	if len(table) > FAT_SECTORS * SECTOR_SIZE:
+		sys.exit("makeboot: the FAT does not fit")
+	for copy in range(FAT_COUNT):
+		start = (reserved + copy * FAT_SECTORS) * SECTOR_SIZE
+		image[start:start + len(table)] = table
+	image[root_start * SECTOR_SIZE:root_start * SECTOR_SIZE + len(directory)] = directory
+
+	bpb = b'MAKEBOOT' + struct.pack('<HBHBHHBHHHII', SECTOR_SIZE, 1, reserved, FAT_COUNT, FAT_ROOT_ENTRIES, FLOPPY_SECTORS,
+		FAT_MEDIA, FAT_SECTORS, 18, 2, 0, 0)
+	bpb += struct.pack('<BBBI11s8s', 0, 0, 0x29, fnv1a(directory), b'NO NAME    ', b'FAT12   ')
+	assert BPB_OFFSET + len(bpb) == BPB_END
+	image[BPB_OFFSET:BPB_END] = bpb
 
 def main():
-	if len(sys.argv) <= 1:
-		print(f"Usage: {sys.argv[0]} <image file name>")
-		exit()
-	with open(sys.argv[1], 'r+b') as file:
-		file.seek(0x1FE)
-		file.write(b'\x55\xAA')
+	parser = argparse.ArgumentParser(description="Finishes a boot image, optionally appending an initrd archive after the kernel")
+	parser.add_argument('image', help="disk image, with the kernel binary already written to its start")
+	parser.add_argument('kernel', nargs='?', help="kernel binary, the initrd is placed at the first sector after it")
+	parser.add_argument('files', nargs='*', help="files to put in the initrd")
+	parser.add_argument('--archive', action='store_true', help="only write an initrd archive of all the other arguments to the first one, for the host build")
+	parser.add_argument('--fat', nargs='*', metavar='FILE', help="put a FAT12 file system with these files on the image, after the kernel and the initrd")
+	arguments = parser.parse_args()
+
+	if arguments.archive:
+		files = ([arguments.kernel] if arguments.kernel is not None else []) + arguments.files
+		with open(arguments.image, 'wb') as file:
+			file.write(build_archive(files))
+		return
+
+	with open(arguments.image, 'rb') as file:
+		image = bytearray(file.read())
+	# without a kernel, only the boot sector is reserved and it just jumps over the parameter block
+	reserved = 1
+	if arguments.kernel is None:
+		image[0:BPB_OFFSET] = bytes([0xEB, BPB_END - 2, 0x90])
+	else:
+		reserved = align(os.path.getsize(arguments.kernel), SECTOR_SIZE) // SECTOR_SIZE
+		image[BOOT_INFO + 2:BOOT_INFO + 6] = struct.pack('<I', crc32c(image[SECTOR_SIZE:reserved * SECTOR_SIZE]))
+	if arguments.kernel is not None and len(arguments.files) != 0:
+		archive = build_archive(arguments.files)
+		sectors = align(len(archive), SECTOR_SIZE) // SECTOR_SIZE
+		start = reserved * SECTOR_SIZE
+		if start + sectors * SECTOR_SIZE > len(image):
+			sys.exit("makeboot: the initrd does not fit on the disk image")
+		image[start:start + len(archive)] = archive
+		image[BOOT_INFO:BOOT_INFO + 2] = struct.pack('<H', sectors)
+		reserved += sectors
+	if arguments.fat is not None:
+		if len(image) != FLOPPY_SECTORS * SECTOR_SIZE:
+			sys.exit("makeboot: the file system needs a 1.44 MB floppy image")
+		build_fat(image, reserved, arguments.fat)
+	image[0x1FE:0x200] = b'\x55\xAA'
+	with open(arguments.image, 'r+b') as file:
+		file.write(image)
 
 if __name__ == '__main__':
 	main()
-
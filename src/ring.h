@@ -0,0 +1,75 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include "stdbool.h"
+
+/*
+ * Single producer, single consumer ring buffers, typically filled by an interrupt handler and drained by the main loop.
+ *
+ * DEFINE_RING(name, type, capacity) declares name_t along with name_push, name_pop, name_empty and name_count.
+ * The head index is only written by the producer and the tail index only by the consumer, both run freely and are
+ * masked on access, so neither side needs to disable interrupts and no division is needed. The capacity must be a
+ * power of two so that the unsigned wraparound of the indices stays consistent with the mask.
+ *
+ * The producer also counts the elements it had to drop because the ring was full, and the highest fill level seen.
+ */
+
+// keeps the compiler from moving element accesses across index updates, x86 does not reorder them otherwise
+#define ring_barrier() __asm__ volatile("" : : : "memory")
+
+#define DEFINE_RING(__name, __type, __capacity) \
+_Static_assert((__capacity) > 0 && ((__capacity) & ((__capacity) - 1)) == 0, #__name " capacity must be a power of two"); \
+\
+typedef struct __name##_t \
+{ \
+	volatile unsigned head; \
+	volatile unsigned tail; \
+	volatile unsigned dropped; \
+	volatile unsigned high_watermark; \
+	__type data[__capacity]; \
+} __name##_t; \
+\
+static inline unsigned __name##_count(const __name##_t * ring) \
+{ \
+	return ring->head - ring->tail; \
+} \
+\
+static inline bool __name##_empty(const __name##_t * ring) \
+{ \
+	return ring->head == ring->tail; \
+} \
+\
+static inline bool __name##_push(__name##_t * ring, __type value) \
+{ \
+	unsigned head = ring->head; \
+	unsigned used = head - ring->tail; \
+	if(used >= (__capacity)) \
+	{ \
+		ring->dropped++; \
+		return false; \
+	} \
+	ring->data[head & ((__capacity) - 1)] = value; \
+	ring_barrier(); \
+	ring->head = head + 1; \
+	if(used + 1 > ring->high_watermark) \
+	{ \
+		ring->high_watermark = used + 1; \
+	} \
+	return true; \
+} \
+\
+static inline bool __name##_pop(__name##_t * ring, __type * value) \
+{ \
+	unsigned tail = ring->tail; \
+	if(ring->head == tail) \
+	{ \
+		return false; \
+	} \
+	ring_barrier(); \
+	*value = ring->data[tail & ((__capacity) - 1)]; \
+	ring_barrier(); \
+	ring->tail = tail + 1; \
+	return true; \
+}
+
+#endif // _RING_H
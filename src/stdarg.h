@@ -0,0 +1,11 @@
+#ifndef _STDARG_H
+#define _STDARG_H
+
+typedef __builtin_va_list va_list;
+
+#define va_start(__ap, __last) __builtin_va_start(__ap, __last)
+#define va_end(__ap) __builtin_va_end(__ap)
+#define va_arg(__ap, __type) __builtin_va_arg(__ap, __type)
+#define va_copy(__dest, __src) __builtin_va_copy(__dest, __src)
+
+#endif // _STDARG_H
@@ -1,12 +1,16 @@
 #ifndef _STDDEF_H
 #define _STDDEF_H
 
+#define NULL ((void *)0)
+
 #ifndef __amd64__
 typedef unsigned int   size_t;
 typedef          int  ssize_t;
+typedef          int  ptrdiff_t;
 #else
 typedef unsigned long  size_t;
 typedef          long ssize_t;
+typedef          long ptrdiff_t;
 #endif
 
 #endif // _STDDEF_H
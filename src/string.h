@@ -1,114 +1,491 @@
 #ifndef _STRING_H
 #define _STRING_H
 
+#include "stdbool.h"
 #include "stddef.h"
+#include "stdint.h"
 #include "i86.h"
 
+/*
+ * The bulk operations use the string instructions with the widest word of the target: rep movsw/stosw on ia16,
+ * rep movsl/stosl on the 386 and rep movsq/stosq on x86-64. Large destinations are first aligned to a word boundary
+ * with byte moves, the remaining tail is also moved bytewise. On x86-64 CPUs with enhanced rep movsb/stosb, large
+ * blocks are moved in a single byte string instruction, string_erms has to be set during startup for this.
+ *
+ * strlen and memcmp work a word at a time, strlen detects a zero byte anywhere in a word with the usual
+ * (w - 0x01..01) & ~w & 0x80..80 test.
+ */
+
+typedef size_t __attribute__((may_alias)) __string_word_t;
+
+#define __STRING_ONES ((size_t)-1 / 0xFF)
+#define __STRING_HIGHS (__STRING_ONES * 0x80)
+
+// below this size, aligning the destination does not pay off
+#define __STRING_ALIGN_THRESHOLD 16
+
+#ifdef __x86_64__
+// set when the CPU reports enhanced rep movsb/stosb
+static bool string_erms;
+# define __STRING_ERMS_THRESHOLD 256
+#endif
+
+#ifdef __ia16__
+/* ES is not guaranteed to match DS in C code, the string instructions need it to */
+# define __STRING_ES_ENTER "pushw\t%%es\n\tpushw\t%%ds\n\tpopw\t%%es\n\t"
+# define __STRING_ES_LEAVE "\n\tpopw\t%%es"
+# define __STRING_MOVSW "rep movsw"
+# define __STRING_STOSW "rep stosw"
+#elif defined __x86_64__
+# define __STRING_ES_ENTER ""
+# define __STRING_ES_LEAVE ""
+# define __STRING_MOVSW "rep movsq"
+# define __STRING_STOSW "rep stosq"
+#else
+# define __STRING_ES_ENTER ""
+# define __STRING_ES_LEAVE ""
+# define __STRING_MOVSW "rep movsl"
+# define __STRING_STOSW "rep stosl"
+#endif
+
+static inline void __string_movsb(char ** dest, const char ** src, size_t count)
+{
+	__asm__ volatile(__STRING_ES_ENTER "rep movsb" __STRING_ES_LEAVE
+		: "+D"(*dest), "+S"(*src), "+c"(count)
+		:
+		: "memory");
+}
+
+static inline void __string_movsw(char ** dest, const char ** src, size_t count)
+{
+	__asm__ volatile(__STRING_ES_ENTER __STRING_MOVSW __STRING_ES_LEAVE
+		: "+D"(*dest), "+S"(*src), "+c"(count)
+		:
+		: "memory");
+}
+
+static inline void __string_stosb(char ** dest, size_t value, size_t count)
+{
+	__asm__ volatile(__STRING_ES_ENTER "rep stosb" __STRING_ES_LEAVE
+		: "+D"(*dest), "+c"(count)
+		: "a"(value)
+		: "memory");
+}
+
+static inline void __string_stosw(char ** dest, size_t value, size_t count)
+{
+	__asm__ volatile(__STRING_ES_ENTER __STRING_STOSW __STRING_ES_LEAVE
+		: "+D"(*dest), "+c"(count)
+		: "a"(value)
+		: "memory");
+}
+
 static inline size_t strlen(const char * s)
 {
-	size_t len;
-	for(len = 0; s[len] != '\0'; len++)
+	const char * p = s;
+	for(; ((size_t)p & (sizeof(__string_word_t) - 1)) != 0; p++)
+	{
+		if(*p == '\0')
+			return p - s;
+	}
+	// an aligned word never crosses into a page that the string does not reach
+	for(;; p += sizeof(__string_word_t))
+	{
+		size_t word = *(const __string_word_t *)p;
+		if(((word - __STRING_ONES) & ~word & __STRING_HIGHS) != 0)
+			break;
+	}
+	for(; *p != '\0'; p++)
 		;
-	return len;
+	return p - s;
 }
 
 static inline void * memset(void * s, int c, size_t n)
 {
-	for(size_t i = 0; i < n; i++)
+	char * d = s;
+	size_t value = (unsigned char)c * __STRING_ONES;
+#ifdef __x86_64__
+	if(string_erms && n >= __STRING_ERMS_THRESHOLD)
 	{
-		((char *)s)[i] = c;
+		__string_stosb(&d, value, n);
+		return s;
 	}
+#endif
+	if(n >= __STRING_ALIGN_THRESHOLD)
+	{
+		size_t head = -(size_t)d & (sizeof(__string_word_t) - 1);
+		__string_stosb(&d, value, head);
+		n -= head;
+		__string_stosw(&d, value, n / sizeof(__string_word_t));
+		n &= sizeof(__string_word_t) - 1;
+	}
+	__string_stosb(&d, value, n);
 	return s;
 }
 
 static inline void * memcpy(void * dest, const void * src, size_t n)
 {
-	for(size_t i = 0; i < n; i++)
+	char * d = dest;
+	const char * s = src;
+#ifdef __x86_64__
+	if(string_erms && n >= __STRING_ERMS_THRESHOLD)
 	{
-		((char *)dest)[i] = ((const char *)src)[i];
+		__string_movsb(&d, &s, n);
+		return dest;
 	}
+#endif
+	if(n >= __STRING_ALIGN_THRESHOLD)
+	{
+		size_t head = -(size_t)d & (sizeof(__string_word_t) - 1);
+		__string_movsb(&d, &s, head);
+		n -= head;
+		__string_movsw(&d, &s, n / sizeof(__string_word_t));
+		n &= sizeof(__string_word_t) - 1;
+	}
+	__string_movsb(&d, &s, n);
 	return dest;
 }
 
 static inline void * memmove(void * dest, const void * src, size_t n)
 {
-	if(dest < src && src < dest + n)
-	{
-		for(size_t i = n; i > 0; i--)
-		{
-			((char *)dest)[i - 1] = ((const char *)src)[i - 1];
-		}
-		return dest;
-	}
-	else
+	if(!(src < dest && dest < src + n))
 	{
+		// a forward copy is safe when the destination is below the source
 		return memcpy(dest, src, n);
 	}
+
+	// copy backwards, first the bytes past the last full word, then the words. The direction flag has to be clear
+	// again before any code the compiler generates, so everything from std to cld is a single statement.
+	char * d = (char *)dest + n - 1;
+	const char * s = (const char *)src + n - 1;
+	size_t count = n & (sizeof(__string_word_t) - 1);
+	__asm__ volatile(__STRING_ES_ENTER
+		"std\n\t"
+		"rep movsb\n\t"
+		// a word is addressed by its lowest byte
+		"sub\t%[adjust], %0\n\t"
+		"sub\t%[adjust], %1\n\t"
+		"mov\t%[words], %2\n\t"
+		__STRING_MOVSW "\n\t"
+		"cld"
+		__STRING_ES_LEAVE
+		: "+D"(d), "+S"(s), "+c"(count)
+		: [words] "r"(n / sizeof(__string_word_t)), [adjust] "i"(sizeof(__string_word_t) - 1)
+		: "memory", "cc");
+	return dest;
 }
 
 static inline int memcmp(const void * s1, const void * s2, size_t n)
 {
-	for(size_t i = 0; i < n; i++)
+	const unsigned char * p1 = s1;
+	const unsigned char * p2 = s2;
+	for(; n >= sizeof(__string_word_t); n -= sizeof(__string_word_t))
 	{
-		unsigned char c1 = ((unsigned char *)s1)[i];
-		unsigned char c2 = ((unsigned char *)s2)[i];
-		if(c1 != c2)
-			return c1 - c2;
+		if(*(const __string_word_t *)p1 != *(const __string_word_t *)p2)
+			break;
+		p1 += sizeof(__string_word_t);
+		p2 += sizeof(__string_word_t);
+	}
+	for(; n > 0; n--, p1++, p2++)
+	{
+		if(*p1 != *p2)
+			return *p1 - *p2;
 	}
 	return 0;
 }
 
+static inline int strcmp(const char * s1, const char * s2)
+{
+	const unsigned char * p1 = (const unsigned char *)s1;
+	const unsigned char * p2 = (const unsigned char *)s2;
+	for(; *p1 != '\0' && *p1 == *p2; p1++, p2++)
+		;
+	return *p1 - *p2;
+}
+
 #ifdef __ia16__
+/*
+ * The far versions load ES:DI and DS:SI once per run and use the string instructions on them. A run never goes past
+ * the end of a segment: in real mode the pointers are normalized between runs so that blocks are treated as linear
+ * memory and may span several 64 KiB segments, in protected mode the offsets wrap around within the segment like
+ * the processor would, but never inside a word access, which faults on 286 and later processors.
+ */
+
+typedef struct __far_cursor_t
+{
+	uint16_t offset;
+	uint16_t segment;
+} __far_cursor_t;
+
+#if !OS286
+static inline uint32_t __far_linear(__far_cursor_t cursor)
+{
+	return ((uint32_t)cursor.segment << 4) + cursor.offset;
+}
+
+// the cursor with the largest offset for a linear address, for runs going backwards
+static inline __far_cursor_t __far_from_linear_down(uint32_t linear)
+{
+	__far_cursor_t cursor;
+	cursor.segment = linear >= 0xFFF0 ? (uint16_t)((linear - 0xFFF0) >> 4) : 0;
+	cursor.offset = linear - ((uint32_t)cursor.segment << 4);
+	return cursor;
+}
+#endif
+
+// a cursor for a forward run, in real mode with the smallest offset to leave the most room in the segment
+static inline __far_cursor_t __far_cursor(const void far * pointer)
+{
+	__far_cursor_t cursor;
+	cursor.offset = (uint32_t)pointer;
+	cursor.segment = (uint32_t)pointer >> 16;
+#if !OS286
+	cursor.segment += cursor.offset >> 4;
+	cursor.offset &= 0xF;
+#endif
+	return cursor;
+}
+
+// a cursor to the last byte of a block, for a backward run
+static inline __far_cursor_t __far_cursor_last(const void far * pointer, size_t count)
+{
+	__far_cursor_t cursor = __far_cursor(pointer);
+#if !OS286
+	return __far_from_linear_down(__far_linear(cursor) + count - 1);
+#else
+	cursor.offset += count - 1;
+	return cursor;
+#endif
+}
+
+static inline void __far_advance(__far_cursor_t * cursor, size_t count)
+{
+	uint16_t offset = cursor->offset + count;
+#if !OS286
+	if(offset < cursor->offset)
+	{
+		cursor->segment += 0x1000;
+	}
+	cursor->segment += offset >> 4;
+	offset &= 0xF;
+#endif
+	cursor->offset = offset;
+}
+
+static inline void __far_retreat(__far_cursor_t * cursor, size_t count)
+{
+#if !OS286
+	*cursor = __far_from_linear_down(__far_linear(*cursor) - count);
+#else
+	cursor->offset -= count;
+#endif
+}
+
+// limits a run to the room left in a segment, 0 stands for a full segment
+static inline size_t __far_limit(size_t count, uint16_t room)
+{
+	return room != 0 && room < count ? room : count;
+}
+
+static inline void __far_movs(__far_cursor_t dest, __far_cursor_t src, size_t count)
+{
+	__asm__ volatile(
+		"pushw\t%%ds\n\t"
+		"pushw\t%%es\n\t"
+		"movw\t%3, %%es\n\t"
+		"movw\t%4, %%ds\n\t"
+		"jcxz\t2f\n\t"
+		// an even destination makes every word access a single bus cycle on the 8086 and 286
+		"testw\t$1, %%di\n\t"
+		"jz\t1f\n\t"
+		"movsb\n\t"
+		"decw\t%%cx\n"
+		"1:\n\t"
+		"shrw\t$1, %%cx\n\t"
+		"rep movsw\n\t"
+		"adcw\t%%cx, %%cx\n\t"
+		"rep movsb\n"
+		"2:\n\t"
+		"popw\t%%es\n\t"
+		"popw\t%%ds"
+		: "+D"(dest.offset), "+S"(src.offset), "+c"(count)
+		: "r"(dest.segment), "r"(src.segment)
+		: "memory", "cc");
+}
+
+// copies count bytes ending at the cursors, going downwards
+static inline void __far_movs_backward(__far_cursor_t dest, __far_cursor_t src, size_t count)
+{
+	__asm__ volatile(
+		"pushw\t%%ds\n\t"
+		"pushw\t%%es\n\t"
+		"movw\t%3, %%es\n\t"
+		"movw\t%4, %%ds\n\t"
+		"std\n\t"
+		"shrw\t$1, %%cx\n\t"
+		"jnc\t1f\n\t"
+		"movsb\n"
+		"1:\n\t"
+		// a word is addressed by its low byte
+		"decw\t%%si\n\t"
+		"decw\t%%di\n\t"
+		"rep movsw\n\t"
+		"cld\n\t"
+		"popw\t%%es\n\t"
+		"popw\t%%ds"
+		: "+D"(dest.offset), "+S"(src.offset), "+c"(count)
+		: "r"(dest.segment), "r"(src.segment)
+		: "memory", "cc");
+}
+
+static inline void __far_stos(__far_cursor_t dest, uint16_t value, size_t count)
+{
+	__asm__ volatile(
+		"pushw\t%%es\n\t"
+		"movw\t%3, %%es\n\t"
+		"jcxz\t2f\n\t"
+		"testw\t$1, %%di\n\t"
+		"jz\t1f\n\t"
+		"stosb\n\t"
+		"decw\t%%cx\n"
+		"1:\n\t"
+		"shrw\t$1, %%cx\n\t"
+		"rep stosw\n\t"
+		"adcw\t%%cx, %%cx\n\t"
+		"rep stosb\n"
+		"2:\n\t"
+		"popw\t%%es"
+		: "+D"(dest.offset), "+c"(count)
+		: "a"(value), "r"(dest.segment)
+		: "memory", "cc");
+}
+
+// compares a non-empty run, returns the difference of the first mismatching bytes or 0
+static inline int __far_cmps(__far_cursor_t s1, __far_cursor_t s2, size_t count)
+{
+	uint16_t c1 = 0, c2 = 0;
+	__asm__ volatile(
+		"pushw\t%%ds\n\t"
+		"pushw\t%%es\n\t"
+		"movw\t%5, %%es\n\t"
+		"movw\t%6, %%ds\n\t"
+		"repe cmpsb\n\t"
+		"je\t1f\n\t"
+		"movb\t-1(%%si), %b3\n\t"
+		"movb\t%%es:-1(%%di), %b4\n"
+		"1:\n\t"
+		"popw\t%%es\n\t"
+		"popw\t%%ds"
+		: "+D"(s2.offset), "+S"(s1.offset), "+c"(count), "+a"(c1), "+d"(c2)
+		: "r"(s2.segment), "r"(s1.segment)
+		: "memory", "cc");
+	return (int)c1 - (int)c2;
+}
+
 static inline size_t _fstrlen(const char far * s)
 {
-	size_t len;
-	for(len = 0; s[len] != '\0'; len++)
-		;
-	return len;
+	__far_cursor_t cursor = __far_cursor(s);
+	size_t length = 0;
+	for(;;)
+	{
+		// a scan of at most half a segment keeps the count in a signed range
+		size_t count = __far_limit(0x8000, -cursor.offset);
+		size_t left = count;
+		uint16_t found = 0;
+		__asm__ volatile(
+			"pushw\t%%es\n\t"
+			"movw\t%4, %%es\n\t"
+			"repne scasb\n\t"
+			"jne\t1f\n\t"
+			"incw\t%2\n"
+			"1:\n\t"
+			"popw\t%%es"
+			: "+D"(cursor.offset), "+c"(left), "+d"(found)
+			: "a"(0), "r"(cursor.segment)
+			: "memory", "cc");
+		if(found)
+		{
+			return length + count - left - 1;
+		}
+		length += count;
+#if !OS286
+		cursor.offset -= count;
+		__far_advance(&cursor, count);
+#endif
+	}
 }
 
 static inline void far * _fmemset(void far * s, int c, size_t n)
 {
-	for(size_t i = 0; i < n; i++)
+	__far_cursor_t cursor = __far_cursor(s);
+	uint16_t value = (unsigned char)c * 0x0101;
+	while(n > 0)
 	{
-		((char far *)s)[i] = c;
+		size_t count = __far_limit(n, -cursor.offset);
+		__far_stos(cursor, value, count);
+		__far_advance(&cursor, count);
+		n -= count;
 	}
 	return s;
 }
 
 static inline void far * _fmemcpy(void far * dest, const void far * src, size_t n)
 {
-	for(size_t i = 0; i < n; i++)
+	__far_cursor_t d = __far_cursor(dest);
+	__far_cursor_t s = __far_cursor(src);
+	while(n > 0)
 	{
-		((char far *)dest)[i] = ((const char far *)src)[i];
+		size_t count = __far_limit(__far_limit(n, -d.offset), -s.offset);
+		__far_movs(d, s, count);
+		__far_advance(&d, count);
+		__far_advance(&s, count);
+		n -= count;
 	}
 	return dest;
 }
 
 static inline void far * _fmemmove(void far * dest, const void far * src, size_t n)
 {
-	if(dest < src && src < dest + n)
+	__far_cursor_t d = __far_cursor(dest);
+	__far_cursor_t s = __far_cursor(src);
+#if !OS286
+	uint32_t distance = __far_linear(d) - __far_linear(s);
+#else
+	// distinct selectors are assumed not to alias
+	uint32_t distance = d.segment == s.segment ? (uint16_t)(d.offset - s.offset) : 0;
+#endif
+	if(distance == 0 || distance >= n)
 	{
-		for(size_t i = n; i > 0; i--)
-		{
-			((char far *)dest)[i - 1] = ((const char far *)src)[i - 1];
-		}
-		return dest;
+		// a forward copy is safe unless the destination starts inside the source
+		return _fmemcpy(dest, src, n);
 	}
-	else
+
+	d = __far_cursor_last(dest, n);
+	s = __far_cursor_last(src, n);
+	while(n > 0)
 	{
-		return _fmemcpy(dest, src, n);
+		size_t count = __far_limit(__far_limit(n, d.offset + 1), s.offset + 1);
+		__far_movs_backward(d, s, count);
+		__far_retreat(&d, count);
+		__far_retreat(&s, count);
+		n -= count;
 	}
+	return dest;
 }
 
 static inline int _fmemcmp(const void far * s1, const void far * s2, size_t n)
 {
-	for(size_t i = 0; i < n; i++)
+	__far_cursor_t p1 = __far_cursor(s1);
+	__far_cursor_t p2 = __far_cursor(s2);
+	while(n > 0)
 	{
-		unsigned char c1 = ((unsigned char far *)s1)[i];
-		unsigned char c2 = ((unsigned char far *)s2)[i];
-		if(c1 != c2)
-			return c1 - c2;
+		size_t count = __far_limit(__far_limit(n, -p1.offset), -p2.offset);
+		int result = __far_cmps(p1, p2, count);
+		if(result != 0)
+			return result;
+		__far_advance(&p1, count);
+		__far_advance(&p2, count);
+		n -= count;
 	}
 	return 0;
 }